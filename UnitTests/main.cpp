@@ -9,11 +9,53 @@
 #include "gtest/gtest.h"
 #include "btVector3n.h"
 #include "btSparseMatrix.h"
+#include "btElement.h"
+#include "btMaterial.h"
+#include "btDefracBodyComponent.h"
+#include "btDefracBody.h"
+#include "btDefracDynamicsWorld.h"
+#include "btBulletDynamicsCommon.h"
+#include "btDefracUtils.h"
+#include "btDefracBodyTemplate.h"
+#include "btDefracMeshFile.h"
+#include "btDefracBodyCache.h"
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
 
 
 #define VN_SIZE 2
 
 
+//the mesh several fixtures share: two tetrahedrons sharing the face (1,2,3), moved by offset
+static void makeTwoTetrahedrons(btAlignedObjectArray<btVector3>& positions, btAlignedObjectArray<int>& indices,
+                                const btVector3& offset = btVector3(0, 0, 0))
+{
+    const btVector3 p[] = {
+        btVector3(0, 0, 0),
+        btVector3(1, btScalar(0.1), 0),
+        btVector3(btScalar(0.2), btScalar(0.9), btScalar(0.1)),
+        btVector3(btScalar(0.1), btScalar(0.3), btScalar(1.2)),
+        btVector3(1, 1, 1)
+    };
+    const int ti[] = {
+        0, 1, 2, 3,
+        4, 3, 2, 1
+    };
+    
+    positions.resize(0);
+    indices.resize(0);
+    
+    for (int i=0; i<5; ++i) {
+        positions.push_back(p[i] + offset);
+    }
+    
+    for (int i=0; i<8; ++i) {
+        indices.push_back(ti[i]);
+    }
+}
+
+
 class btMatrixIndexTest : public ::testing::Test
 {
     
@@ -29,6 +71,7 @@ protected:
     {
         v1[0] = btVector3(1, 2, 3); v1[1] = btVector3(4, 5, 6);
         v2[0] = btVector3(4, 5, 6); v2[1] = btVector3(1, 2, 3);
+        v3[0] = btVector3(7, 8, 9); v3[1] = btVector3(3, 2, 1);
     }
     
     btVector3n v1, v2, v3;
@@ -76,6 +119,385 @@ protected:
 std::set<btMatrixIndex> btSparseMatrixTest::indices = btSparseMatrixTest::__initIndices();
 
 
+class btSparsityPatternTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        //node 5 is not referenced
+        btAlignedObjectArray<btVector3> positions;
+        btAlignedObjectArray<int> ti;
+        makeTwoTetrahedrons(positions, ti);
+        tetIndices.assign(&ti[0], &ti[0] + ti.size());
+        
+        for (int t=0; t<tetIndices.size()/4; ++t) {
+            for (int i=0; i<4; ++i) {
+                for (int j=0; j<4; ++j) {
+                    btMatrixIndex mi = {tetIndices[t*4 + i], tetIndices[t*4 + j]};
+                    indices.insert(mi);
+                }
+            }
+        }
+        
+        pattern.buildFromTetrahedrons(6, &tetIndices[0], tetIndices.size()/4);
+    }
+    
+    std::vector<int> tetIndices;
+    std::set<btMatrixIndex> indices;
+    btSparsityPattern pattern;
+};
+
+
+class btTetrahedronTest : public ::testing::Test
+{
+protected:
+    btTetrahedronTest() : material(1000, btScalar(0.3)), tetrahedron(NULL) {}
+    
+    virtual void SetUp()
+    {
+        btVector3 p[] = {
+            btVector3(0, 0, 0),
+            btVector3(1, btScalar(0.1), 0),
+            btVector3(btScalar(0.2), btScalar(0.9), btScalar(0.1)),
+            btVector3(btScalar(0.1), btScalar(0.3), btScalar(1.2))
+        };
+        
+        for (int i=0; i<4; ++i) {
+            nodes[i] = btNode(p[i], 1);
+            nodePointers[i] = &nodes[i];
+        }
+        
+        tetrahedron = new btTetrahedron(nodePointers, &material);
+    }
+    
+    virtual void TearDown()
+    {
+        delete tetrahedron;
+    }
+    
+    //the 12x12 stiffness B^T*E*B*volume, the way it was assembled before the normalized blocks
+    Eigen::Matrix<btScalar, 12, 12, Eigen::RowMajor> referenceStiffness()
+    {
+        const btVector3& v0 = nodes[0].getPosition0();
+        const btVector3& v1 = nodes[1].getPosition0();
+        const btVector3& v2 = nodes[2].getPosition0();
+        const btVector3& v3 = nodes[3].getPosition0();
+        btScalar volume6 = ((v1-v2).cross(v0-v1)).dot(v3-v0);
+        btScalar v = 1/volume6;
+        btVector3 dN[] = {
+            (v1-v2).cross(v2-v3)*v,
+            (v3-v0).cross(v2-v3)*v,
+            (v3-v0).cross(v0-v1)*v,
+            (v1-v2).cross(v0-v1)*v
+        };
+        
+        Eigen::Matrix<btScalar, 6, 12, Eigen::RowMajor> B;
+        B.setZero();
+        
+        for (int i=0; i<4; ++i) {
+            B(0, i*3+0) = dN[i].x();
+            B(1, i*3+1) = dN[i].y();
+            B(2, i*3+2) = dN[i].z();
+            B(3, i*3+0) = dN[i].y(); B(3, i*3+1) = dN[i].x();
+            B(4, i*3+1) = dN[i].z(); B(4, i*3+2) = dN[i].y();
+            B(5, i*3+0) = dN[i].z(); B(5, i*3+2) = dN[i].x();
+        }
+        
+        Eigen::Matrix<btScalar, 12, 12, Eigen::RowMajor> k = B.transpose()*(material.getE()*B);
+        return k*(btFabs(volume6)/6);
+    }
+    
+    void expectStiffness(const Eigen::Matrix<btScalar, 12, 12, Eigen::RowMajor>& k)
+    {
+        const btScalar tolerance = k.cwiseAbs().maxCoeff()*btScalar(1e-5);
+        
+        for (int i=0; i<12; ++i) {
+            for (int j=0; j<12; ++j) {
+                EXPECT_NEAR(tetrahedron->getStiffness(i, j), k(i, j), tolerance);
+            }
+        }
+    }
+    
+    btMaterial material;
+    btNode nodes[4];
+    btNode* nodePointers[4];
+    btTetrahedron* tetrahedron;
+};
+
+
+class btDefracBodyComponentTest : public ::testing::Test
+{
+protected:
+    btDefracBodyComponentTest() : material(1000, btScalar(0.3)) {}
+    
+    virtual void SetUp()
+    {
+        btAlignedObjectArray<btVector3> positions;
+        makeTwoTetrahedrons(positions, indices);
+        
+        for (int i=0; i<5; ++i) {
+            nodeStorage[i] = btNode(positions[i], 1);
+            nodes.push_back(&nodeStorage[i]);
+        }
+        
+        for (int t=0; t<2; ++t) {
+            btNode* n[4];
+            
+            for (int i=0; i<4; ++i) {
+                n[i] = nodes[indices[t*4 + i]];
+            }
+            
+            tetrahedrons.push_back(new btTetrahedron(n, &material));
+        }
+    }
+    
+    virtual void TearDown()
+    {
+        for (int t=0; t<tetrahedrons.size(); ++t) {
+            delete tetrahedrons[t];
+        }
+    }
+    
+    //rotates the rest shape by rotation and moves node 4 by offset, so each tetrahedron rotates differently
+    void deform(const btQuaternion& rotation, const btVector3& offset)
+    {
+        btMatrix3x3 r(rotation);
+        
+        for (int i=0; i<nodes.size(); ++i) {
+            nodes[i]->setPosition(r*nodes[i]->getPosition0());
+        }
+        
+        nodes[4]->setPosition(nodes[4]->getPosition() + offset);
+    }
+    
+    //expects the matrices of component to match those of a component assembled from scratch
+    void expectFullyAssembled(btDefracBodyComponent& component)
+    {
+        btDefracBodyComponent reference(nodes, tetrahedrons, indices);
+        reference.computeRotationsGramSchmidt();
+        reference.updateStiffnessMatrices(0, 0);
+        
+        expectEqual(component.getK1(), reference.getK1());
+        expectEqual(component.getK2(), reference.getK2());
+    }
+    
+    void expectEqual(const btSparseMatrix& A, const btSparseMatrix& B)
+    {
+        const int nonZeros = B.getRowIndices()[B.size()];
+        const btMatrix3x3* a = A.getElements();
+        const btMatrix3x3* b = B.getElements();
+        btScalar tolerance = 0;
+        
+        ASSERT_EQ(A.getRowIndices()[A.size()], nonZeros);
+        
+        for (int k=0; k<nonZeros; ++k) {
+            for (int i=0; i<3; ++i) {
+                for (int j=0; j<3; ++j) {
+                    tolerance = btMax(tolerance, btFabs(b[k][i][j]));
+                }
+            }
+        }
+        
+        tolerance *= btScalar(1e-4);
+        
+        for (int k=0; k<nonZeros; ++k) {
+            for (int i=0; i<3; ++i) {
+                for (int j=0; j<3; ++j) {
+                    EXPECT_NEAR(a[k][i][j], b[k][i][j], tolerance);
+                }
+            }
+        }
+    }
+    
+    btMaterial material;
+    btNode nodeStorage[5];
+    btAlignedObjectArray<btNode*> nodes;
+    btAlignedObjectArray<btTetrahedron*> tetrahedrons;
+    btAlignedObjectArray<int> indices;
+};
+
+
+class btDefracDynamicsWorldTest : public ::testing::Test
+{
+protected:
+    btDefracDynamicsWorldTest() :
+        dispatcher(&configuration),
+        world(&dispatcher, &broadphase, &solver, &configuration),
+        material(1000, btScalar(0.3))
+    {
+    }
+    
+    virtual void SetUp()
+    {
+        world.setGravity(btVector3(0, 0, 0));
+    }
+    
+    virtual void TearDown()
+    {
+        for (int i=0; i<bodies.size(); ++i) {
+            world.removeDefracBody(bodies[i]);
+            delete bodies[i];
+        }
+    }
+    
+    btDefracBody* addBody(const btAlignedObjectArray<btVector3>& positions, const btAlignedObjectArray<int>& indices)
+    {
+        btDefracBody* body = new btDefracBody(positions, indices, 1, &material);
+        world.addDefracBody(body);
+        bodies.push_back(body);
+        return body;
+    }
+    
+    btDefracBody* addTetrahedron(const btVector3& p0, const btVector3& p1, const btVector3& p2, const btVector3& p3)
+    {
+        btAlignedObjectArray<btVector3> positions;
+        btAlignedObjectArray<int> indices;
+        positions.push_back(p0);
+        positions.push_back(p1);
+        positions.push_back(p2);
+        positions.push_back(p3);
+        
+        for (int i=0; i<4; ++i) {
+            indices.push_back(i);
+        }
+        
+        return addBody(positions, indices);
+    }
+    
+    //adds a body of the two tetrahedrons of makeTwoTetrahedrons, with its corner at offset
+    btDefracBody* addBody(const btVector3& offset)
+    {
+        btAlignedObjectArray<btVector3> positions;
+        btAlignedObjectArray<int> indices;
+        makeTwoTetrahedrons(positions, indices, offset);
+        return addBody(positions, indices);
+    }
+    
+    //a large tetrahedron with its top face on z = 0, and a small one above it whose lowest node, node 0,
+    //is at height z over the middle of that face. Returns the component of the small one
+    btDefracBodyComponent* addNodeOverFace(btScalar z)
+    {
+        addTetrahedron(btVector3(-3, -3, 0), btVector3(3, -3, 0), btVector3(0, 3, 0), btVector3(0, 0, -3));
+        return addTetrahedron(btVector3(0, 0, z), btVector3(0, 0, z + 2), btVector3(1, 0, z + btScalar(1.5)),
+                              btVector3(0, 1, z + btScalar(1.5)))->getComponent(0);
+    }
+    
+    //the face contact of the given node in the last step, NULL if there is none
+    const btDefracFaceContact* findFaceContact(const btDefracBodyComponent* component, int node)
+    {
+        for (int i=0; i<world.getNumFaceContacts(); ++i) {
+            const btDefracFaceContact& c = world.getFaceContact(i);
+            
+            if (c.m_component == component && c.m_node == node) {
+                return &c;
+            }
+        }
+        
+        return NULL;
+    }
+    
+    void step(int steps)
+    {
+        for (int i=0; i<steps; ++i) {
+            world.stepSimulation(btScalar(1.)/60, 0);
+        }
+    }
+    
+    btDefaultCollisionConfiguration configuration;
+    btCollisionDispatcher dispatcher;
+    btDbvtBroadphase broadphase;
+    btSequentialImpulseConstraintSolver solver;
+    btDefracDynamicsWorld world;
+    btMaterial material;
+    btAlignedObjectArray<btDefracBody*> bodies;
+};
+
+
+class btDefracBodyOrderingTest : public ::testing::Test
+{
+protected:
+    btDefracBodyOrderingTest() : material(1000, btScalar(0.3)) {}
+    
+    //a grid of CELLS^3 cubes of 6 tetrahedrons each, with its nodes numbered in a scrambled order
+    virtual void SetUp()
+    {
+        const int n = CELLS + 1;
+        std::vector<int> number(n*n*n);
+        
+        for (int i=0; i<(int)number.size(); ++i) {
+            number[i] = i;
+        }
+        
+        unsigned int seed = 12345;
+        
+        for (int i=(int)number.size()-1; i>0; --i) {
+            seed = seed*1103515245 + 12345;
+            std::swap(number[i], number[(seed >> 8)%(i+1)]);
+        }
+        
+        positions.resize(n*n*n);
+        
+        for (int z=0; z<n; ++z) {
+            for (int y=0; y<n; ++y) {
+                for (int x=0; x<n; ++x) {
+                    positions[number[(z*n + y)*n + x]] = btVector3((btScalar)x, (btScalar)y, (btScalar)z);
+                }
+            }
+        }
+        
+        //each tetrahedron goes from corner 0 to corner 7 of its cube along one path of edges
+        static const int paths[6][3] = {{1, 2, 4}, {1, 4, 2}, {2, 1, 4}, {2, 4, 1}, {4, 1, 2}, {4, 2, 1}};
+        
+        for (int z=0; z<CELLS; ++z) {
+            for (int y=0; y<CELLS; ++y) {
+                for (int x=0; x<CELLS; ++x) {
+                    for (int p=0; p<6; ++p) {
+                        int corner = 0;
+                        indices.push_back(number[(z*n + y)*n + x]);
+                        
+                        for (int k=0; k<3; ++k) {
+                            corner |= paths[p][k];
+                            indices.push_back(number[((z + (corner >> 2))*n + y + ((corner >> 1) & 1))*n + x + (corner & 1)]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    
+    static bool isPermutation(const btAlignedObjectArray<int>& order, int size)
+    {
+        std::vector<bool> found(size, false);
+        
+        if (order.size() != size) {
+            return false;
+        }
+        
+        for (int i=0; i<order.size(); ++i) {
+            if (order[i] < 0 || order[i] >= size || found[order[i]]) {
+                return false;
+            }
+            
+            found[order[i]] = true;
+        }
+        
+        return true;
+    }
+    
+    int bandwidth(const btAlignedObjectArray<int>& tetIndices)
+    {
+        btSparsityPattern pattern;
+        pattern.buildFromTetrahedrons(positions.size(), &tetIndices[0], tetIndices.size()/4);
+        return btDefracUtils::ComputeBandwidth(pattern);
+    }
+    
+    static const int CELLS = 4;
+    btMaterial material;
+    btAlignedObjectArray<btVector3> positions;
+    btAlignedObjectArray<int> indices;
+};
+
+
 TEST_F(btMatrixIndexTest, SmallerOperator)
 {
     btMatrixIndex mi0; 
@@ -221,8 +643,1213 @@ TEST_F(btSparseMatrixTest, MultiplyScalar)
      */
 }
 
+TEST_F(btSparsityPatternTest, BuildFromTetrahedrons)
+{
+    ASSERT_EQ(pattern.size(), 6);
+    ASSERT_EQ(pattern.getNonZeroCount(), (int)indices.size());
+    
+    const std::vector<int>& rows = pattern.getRowIndices();
+    const std::vector<int>& columns = pattern.getColumnIndices();
+    std::set<btMatrixIndex>::iterator it = indices.begin();
+    
+    for (int i=0; i<pattern.size(); ++i) {
+        for (int k=rows[i]; k<rows[i+1]; ++k) {
+            btMatrixIndex mi = *(it++);
+            ASSERT_EQ(mi.i, i);
+            ASSERT_EQ(mi.j, columns[k]);
+        }
+    }
+    
+    ASSERT_EQ(rows[5], rows[6]); //empty row
+}
+
+TEST_F(btSparsityPatternTest, MatchesSetConstructor)
+{
+    btSparseMatrix S1(6, indices);
+    btSparseMatrix S2(pattern);
+    btMatrix3x3 m(1,2,3,4,5,6,7,8,9);
+    
+    std::set<btMatrixIndex>::iterator it = indices.begin();
+    for (; it != indices.end(); ++it) {
+        S1(it->i, it->j) = m * (btScalar)(it->i + 1);
+        S2(it->i, it->j) = m * (btScalar)(it->i + 1);
+    }
+    
+    btVector3n vn(6);
+    for (int i=0; i<vn.size(); ++i) {
+        vn[i].setValue(i+1, 2*i, 1);
+    }
+    
+    ASSERT_EQ(S1 * vn, S2 * vn);
+}
+
+TEST_F(btSparsityPatternTest, SharedStructure)
+{
+    btSparseMatrix S1(pattern);
+    btSparseMatrix S2(pattern, true);
+    btMatrix3x3 m(1,2,3,4,5,6,7,8,9);
+    
+    std::set<btMatrixIndex>::iterator it = indices.begin();
+    for (; it != indices.end(); ++it) {
+        S1(it->i, it->j) = m * (btScalar)(it->j + 1);
+        S2(it->i, it->j) = m * (btScalar)(it->j + 1);
+    }
+    
+    btSparseMatrix S3(S2 * 2);
+    
+    btVector3n vn(6);
+    for (int i=0; i<vn.size(); ++i) {
+        vn[i].setValue(1, i, 2*i);
+    }
+    
+    ASSERT_EQ(S1 * vn, S2 * vn);
+    ASSERT_EQ((S1 * 2) * vn, S3 * vn);
+}
+
+TEST_F(btTetrahedronTest, NormalizedStiffnessMatchesReference)
+{
+    expectStiffness(referenceStiffness());
+    
+    material.setYoungModulusAndPoissonRatio(5000, btScalar(0.45));
+    expectStiffness(referenceStiffness());
+    
+    tetrahedron->setStiffnessScale(3);
+    expectStiffness(referenceStiffness()*3);
+}
+
+TEST_F(btTetrahedronTest, Revisions)
+{
+    unsigned int materialRevision = material.getRevision();
+    material.setYoungModulus(2000);
+    ASSERT_NE(material.getRevision(), materialRevision);
+    materialRevision = material.getRevision();
+    material.setPoissonRatio(btScalar(0.4));
+    ASSERT_NE(material.getRevision(), materialRevision);
+    
+    unsigned int revision = tetrahedron->getRevision();
+    tetrahedron->setStiffnessScale(2);
+    ASSERT_NE(tetrahedron->getRevision(), revision);
+    revision = tetrahedron->getRevision();
+    tetrahedron->setMaterial(&material);
+    ASSERT_NE(tetrahedron->getRevision(), revision);
+    revision = tetrahedron->getRevision();
+    tetrahedron->nodesPosition0Changed();
+    ASSERT_NE(tetrahedron->getRevision(), revision);
+}
+
+TEST_F(btDefracBodyComponentTest, DeltaUpdateMatchesFullAssembly)
+{
+    btDefracBodyComponent component(nodes, tetrahedrons, indices);
+    component.computeRotationsGramSchmidt();
+    ASSERT_EQ(component.updateStiffnessMatrices(0, 0), 2);
+    
+    for (int step=1; step<=3; ++step) {
+        deform(btQuaternion(btVector3(1, 2, 3).normalized(), btScalar(0.3)*step), btVector3(0, btScalar(0.1)*step, 0));
+        component.computeRotationsGramSchmidt();
+        component.updateStiffnessMatrices(0, 0);
+        expectFullyAssembled(component);
+    }
+    
+    //the differences would subtract the old terms with the new material
+    material.setYoungModulus(3000);
+    deform(btQuaternion(btVector3(0, 1, 0), btScalar(0.5)), btVector3(btScalar(0.1), 0, 0));
+    component.computeRotationsGramSchmidt();
+    ASSERT_EQ(component.updateStiffnessMatrices(0, 0), 2);
+    expectFullyAssembled(component);
+    
+    tetrahedrons[1]->setStiffnessScale(2);
+    deform(btQuaternion(btVector3(0, 0, 1), btScalar(0.7)), btVector3(0, 0, btScalar(0.1)));
+    component.computeRotationsGramSchmidt();
+    ASSERT_EQ(component.updateStiffnessMatrices(0, 0), 2);
+    expectFullyAssembled(component);
+    
+    deform(btQuaternion(btVector3(1, 0, 0), btScalar(0.2)), btVector3(0, 0, 0));
+    component.computeRotationsGramSchmidt();
+    component.updateStiffnessMatrices(0, 0);
+    expectFullyAssembled(component);
+}
+
+TEST_F(btDefracBodyComponentTest, WarpRebuildsRestStiffness)
+{
+    btDefracBodyComponent component(nodes, tetrahedrons, indices);
+    component.computeNodeRotationsGramSchmidt();
+    component.warpStiffnessMatrices(0);
+    
+    deform(btQuaternion(btVector3(1, 2, 3).normalized(), btScalar(0.4)), btVector3(0, btScalar(0.1), 0));
+    component.computeNodeRotationsGramSchmidt();
+    component.warpStiffnessMatrices(0);
+    
+    material.setPoissonRatio(btScalar(0.45));
+    tetrahedrons[0]->setStiffnessScale(btScalar(0.5));
+    deform(btQuaternion(btVector3(0, 1, 0), btScalar(0.6)), btVector3(btScalar(0.1), 0, 0));
+    component.computeNodeRotationsGramSchmidt();
+    ASSERT_EQ(component.warpStiffnessMatrices(0), (int)nodes.size());
+    
+    btDefracBodyComponent reference(nodes, tetrahedrons, indices);
+    reference.computeNodeRotationsGramSchmidt();
+    reference.warpStiffnessMatrices(0);
+    
+    expectEqual(component.getK1(), reference.getK1());
+    expectEqual(component.getK2(), reference.getK2());
+}
+
+TEST_F(btDefracBodyComponentTest, SharedTemplateMatchesOwnMatrices)
+{
+    btAlignedObjectArray<btVector3> positions;
+    
+    for (int i=0; i<nodes.size(); ++i) {
+        positions.push_back(nodes[i]->getPosition0());
+    }
+    
+    btDefracBodyTemplate bodyTemplate(positions, indices, 1, &material);
+    btDefracBody first(&bodyTemplate);
+    btDefracBody second(&bodyTemplate);
+    btDefracBody* bodies[] = {&first, &second};
+    
+    for (int b=0; b<2; ++b) {
+        ASSERT_EQ(bodies[b]->getComponentCount(), 1);
+        btDefracBodyComponent* component = bodies[b]->getComponent(0);
+        ASSERT_EQ(component->getNodeCount(), nodes.size());
+        ASSERT_EQ(component->getTetrahedronCount(), tetrahedrons.size());
+        
+        for (int t=0; t<tetrahedrons.size(); ++t) {
+            ASSERT_FALSE(tetrahedrons[t]->hasSharedMatrices());
+            ASSERT_TRUE(component->getTetrahedron(t)->hasSharedMatrices());
+            
+            for (int k=0; k<16; ++k) {
+                ASSERT_EQ(component->getTetrahedron(t)->getStiffnessBlock(k), tetrahedrons[t]->getStiffnessBlock(k));
+            }
+        }
+    }
+    
+    for (int step=1; step<=3; ++step) {
+        const btQuaternion rotation(btVector3(1, 2, 3).normalized(), btScalar(0.3)*step);
+        const btVector3 offset(0, btScalar(0.1)*step, 0);
+        deform(rotation, offset);
+        
+        for (int b=0; b<2; ++b) {
+            btDefracBodyComponent* component = bodies[b]->getComponent(0);
+            
+            for (int i=0; i<component->getNodeCount(); ++i) {
+                component->displaceNode(i, nodes[i]->getPosition() - component->getNode(i)->getPosition());
+            }
+            
+            component->computeRotationsGramSchmidt();
+            component->updateStiffnessMatrices(0, 0);
+            expectFullyAssembled(*component);
+        }
+    }
+}
+
+TEST_F(btDefracDynamicsWorldTest, SleepsAtRestAndWakesWhenForced)
+{
+    btDefracBody* body = addBody(btVector3(0, 0, 0));
+    btDefracBodyComponent* component = body->getComponent(0);
+    ASSERT_TRUE(component->isActive());
+    
+    //at rest, it falls asleep once it stayed under the thresholds for gDeactivationTime
+    step((int)(gDeactivationTime*60) + 10);
+    ASSERT_EQ(component->getActivationState(), ISLAND_SLEEPING);
+    
+    //without forces it stays asleep and its nodes stay where they are
+    const btVector3 position = component->getNode(4)->getPosition();
+    step(10);
+    ASSERT_EQ(component->getActivationState(), ISLAND_SLEEPING);
+    ASSERT_FALSE(component->wasForceApplied());
+    ASSERT_EQ(component->getNode(4)->getPosition(), position);
+    
+    //a force applied to one of its nodes, like a spring does, wakes it in the next step
+    body->getTetrahedron(0)->applyForce(btVector3(0, 100, 0), btVector4(btScalar(0.25), btScalar(0.25), btScalar(0.25), btScalar(0.25)));
+    ASSERT_TRUE(component->wasForceApplied());
+    step(1);
+    ASSERT_TRUE(component->isActive());
+    ASSERT_FALSE(component->wasForceApplied());
+    ASSERT_NE(component->getNode(4)->getPosition(), position);
+}
+
+TEST_F(btDefracDynamicsWorldTest, NodeInFrontOfTriangle)
+{
+    btDefracBodyComponent* component = addNodeOverFace(btScalar(0.2));
+    const btScalar margin = component->getCollisionShape()->getMargin()*2;
+    step(1);
+    
+    const btDefracFaceContact* contact = findFaceContact(component, 0);
+    ASSERT_TRUE(contact != NULL);
+    EXPECT_NEAR(contact->m_distance, btScalar(0.2) - margin, btScalar(1e-3));
+    EXPECT_GT(contact->m_normal.z(), btScalar(0.99));
+}
+
+TEST_F(btDefracDynamicsWorldTest, NodeBehindTriangleIsNotPushedThrough)
+{
+    //it starts behind the face, within the margins, so it came from inside and stays there
+    btDefracBodyComponent* component = addNodeOverFace(btScalar(-0.2));
+    step(1);
+    
+    ASSERT_TRUE(findFaceContact(component, 0) == NULL);
+}
+
+TEST_F(btDefracDynamicsWorldTest, DeepNodeIsRejected)
+{
+    btDefracBodyComponent* component = addNodeOverFace(btScalar(-0.7));
+    step(1);
+    
+    ASSERT_TRUE(findFaceContact(component, 0) == NULL);
+}
+
+TEST_F(btDefracDynamicsWorldTest, NodeCrossingTriangleCollides)
+{
+    //it goes from 0.1 in front of the face to about 0.2 behind it in one step
+    btDefracBodyComponent* component = addNodeOverFace(btScalar(0.1));
+    const btScalar margin = component->getCollisionShape()->getMargin()*2;
+    
+    for (int i=0; i<component->getNodeCount(); ++i) {
+        component->setNodeVelocity(i, btVector3(0, 0, -18));
+    }
+    
+    step(1);
+    
+    const btDefracFaceContact* contact = findFaceContact(component, 0);
+    ASSERT_TRUE(contact != NULL);
+    EXPECT_LT(contact->m_distance, -margin);
+    EXPECT_GT(contact->m_normal.z(), btScalar(0.99));
+}
+
+TEST_F(btDefracDynamicsWorldTest, ContactIsKeptBehindTriangle)
+{
+    btDefracBodyComponent* component = addNodeOverFace(btScalar(0.1));
+    
+    for (int i=0; i<component->getNodeCount(); ++i) {
+        component->setNodeVelocity(i, btVector3(0, 0, -18));
+    }
+    
+    step(1);
+    ASSERT_TRUE(findFaceContact(component, 0) != NULL);
+    
+    //at rest behind the face, it was never in front of it in this step, but touched it in the last one
+    for (int i=0; i<bodies.size(); ++i) {
+        bodies[i]->reset();
+    }
+    
+    for (int i=0; i<component->getNodeCount(); ++i) {
+        component->displaceNode(i, btVector3(0, 0, btScalar(-0.3)));
+    }
+    
+    step(1);
+    ASSERT_TRUE(findFaceContact(component, 0) != NULL);
+}
+
+TEST_F(btDefracDynamicsWorldTest, SelfCollisionExcludesAdjacentTriangles)
+{
+    //every node is within the margin of every triangle, but each triangle has a node that shares a
+    //tetrahedron with it
+    btDefracBodyComponent* component = addBody(btVector3(0, 0, 0))->getComponent(0);
+    component->setSelfCollision(true);
+    component->setSelfCollisionMargin(10);
+    world.setFaceContactsEnabled(false);
+    step(1);
+    
+    ASSERT_EQ(world.getNumFaceContacts(), 0);
+}
+
+TEST_F(btDefracDynamicsWorldTest, SelfCollisionOfSeparateParts)
+{
+    //a small tetrahedron whose node 0 is just above the top face of a large one, in the same component
+    btVector3 p[] = {
+        btVector3(0, 0, btScalar(0.05)),
+        btVector3(0, 0, 2),
+        btVector3(1, 0, btScalar(1.5)),
+        btVector3(0, 1, btScalar(1.5)),
+        btVector3(-3, -3, 0),
+        btVector3(3, -3, 0),
+        btVector3(0, 3, 0),
+        btVector3(0, 0, -3)
+    };
+    btAlignedObjectArray<btVector3> positions;
+    btAlignedObjectArray<int> indices;
+    
+    for (int i=0; i<8; ++i) {
+        positions.push_back(p[i]);
+        indices.push_back(i);
+    }
+    
+    btDefracBodyComponent* component = addBody(positions, indices)->getComponent(0);
+    component->setSelfCollision(true);
+    component->setSelfCollisionMargin(btScalar(0.1));
+    world.setFaceContactsEnabled(false);
+    step(1);
+    
+    const btDefracFaceContact* contact = findFaceContact(component, 0);
+    ASSERT_TRUE(contact != NULL);
+    ASSERT_EQ(contact->m_otherComponent, component);
+    EXPECT_NEAR(contact->m_distance, btScalar(0.05 - 0.1), btScalar(1e-3));
+    
+    for (int k=0; k<3; ++k) {
+        EXPECT_GE(component->getSurfaceNodeIndex(contact->m_triangle*3 + k), 4);
+    }
+}
+
+TEST_F(btDefracDynamicsWorldTest, SelfCollisionWithLargeTriangle)
+{
+    //the scene of SelfCollisionOfSeparateParts with many small tetrahedrons off to the side, which make
+    //the cells so small that the top face of the large tetrahedron spans too many of them to be hashed
+    btVector3 p[] = {
+        btVector3(0, 0, btScalar(0.05)),
+        btVector3(0, 0, 2),
+        btVector3(1, 0, btScalar(1.5)),
+        btVector3(0, 1, btScalar(1.5)),
+        btVector3(-3, -3, 0),
+        btVector3(3, -3, 0),
+        btVector3(0, 3, 0),
+        btVector3(0, 0, -3)
+    };
+    btAlignedObjectArray<btVector3> positions;
+    btAlignedObjectArray<int> indices;
+    
+    for (int i=0; i<8; ++i) {
+        positions.push_back(p[i]);
+        indices.push_back(i);
+    }
+    
+    for (int i=0; i<100; ++i) {
+        const btVector3 corner(10 + (i%10)*btScalar(0.5), (i/10)*btScalar(0.5), 0);
+        
+        for (int k=0; k<4; ++k) {
+            indices.push_back(positions.size());
+            positions.push_back(corner + btVector3(k == 1, k == 2, k == 3)*btScalar(0.1));
+        }
+    }
+    
+    btDefracBodyComponent* component = addBody(positions, indices)->getComponent(0);
+    component->setSelfCollision(true);
+    component->setSelfCollisionMargin(btScalar(0.1));
+    
+    btDefracSpatialHash hash;
+    hash.build(component, component->getSelfCollisionMargin());
+    ASSERT_GT(hash.getLargeTriangleCount(), 0);
+    
+    for (int i=0; i<hash.getLargeTriangleCount(); ++i) {
+        ASSERT_LT(component->getSurfaceNodeIndex(hash.getLargeTriangle(i)*3), 8);
+    }
+    
+    //cells far beyond the range where the hash products fit an int still map to a bucket
+    const btScalar far = hash.getCellSize()*btScalar(1e6);
+    const int bucket = hash.getBucket(btVector3(far, -far, far));
+    ASSERT_LE(hash.getBucketBegin(bucket), hash.getBucketEnd(bucket));
+    
+    world.setFaceContactsEnabled(false);
+    step(1);
+    
+    const btDefracFaceContact* contact = findFaceContact(component, 0);
+    ASSERT_TRUE(contact != NULL);
+    EXPECT_NEAR(contact->m_distance, btScalar(0.05 - 0.1), btScalar(1e-3));
+    
+    for (int k=0; k<3; ++k) {
+        EXPECT_GE(component->getSurfaceNodeIndex(contact->m_triangle*3 + k), 4);
+        EXPECT_LT(component->getSurfaceNodeIndex(contact->m_triangle*3 + k), 8);
+    }
+}
+
+TEST_F(btDefracBodyOrderingTest, ReverseCuthillMcKeeReducesBandwidth)
+{
+    btSparsityPattern pattern;
+    pattern.buildFromTetrahedrons(positions.size(), &indices[0], indices.size()/4);
+    
+    btAlignedObjectArray<int> order;
+    btDefracUtils::ReverseCuthillMcKee(pattern, order);
+    ASSERT_TRUE(isPermutation(order, positions.size()));
+    
+    //renumber the nodes, node order[k] becomes node k
+    std::vector<int> newIndex(positions.size());
+    btAlignedObjectArray<int> reordered;
+    
+    for (int k=0; k<order.size(); ++k) {
+        newIndex[order[k]] = k;
+    }
+    
+    for (int i=0; i<indices.size(); ++i) {
+        reordered.push_back(newIndex[indices[i]]);
+    }
+    
+    //a grid numbered plane by plane has a bandwidth of about a plane and a row
+    const int n = CELLS + 1;
+    EXPECT_LT(bandwidth(reordered), bandwidth(indices));
+    EXPECT_LE(bandwidth(reordered), 2*(n*n + n + 1));
+}
+
+TEST_F(btDefracBodyOrderingTest, ReorderedBodyTranslatesNodeIndices)
+{
+    btDefracBody body(positions, indices, 1, &material, btDefracBody::CF_REORDER_NODES);
+    ASSERT_EQ(body.getNodeCount(), positions.size());
+    
+    for (int i=0; i<positions.size(); ++i) {
+        const int index = body.getNodeIndexFromOriginal(i);
+        ASSERT_EQ(body.getOriginalNodeIndex(index), i);
+        ASSERT_EQ(body.getNode(index)->getPosition0(), positions[i]);
+    }
+    
+    //each tetrahedron keeps its nodes, under their new indices
+    for (int t=0; t<body.getTetrahedronCount(); ++t) {
+        for (int k=0; k<4; ++k) {
+            ASSERT_EQ(body.getTetrahedron(t)->getNode(k)->getPosition0(), positions[indices[t*4 + k]]);
+        }
+    }
+    
+    EXPECT_LT(btDefracUtils::ComputeBandwidth(body.getTemplate()->getSparsityPattern()), bandwidth(indices));
+}
+
+TEST_F(btDefracBodyOrderingTest, TetrahedronOrdersArePermutations)
+{
+    const int numTets = indices.size()/4;
+    btAlignedObjectArray<int> order;
+    
+    btDefracUtils::SortTetrahedronsMorton(positions, indices, order);
+    ASSERT_TRUE(isPermutation(order, numTets));
+    
+    btDefracUtils::SortTetrahedronsByNode(indices, order);
+    ASSERT_TRUE(isPermutation(order, numTets));
+    
+    for (int k=1; k<order.size(); ++k) {
+        const int* a = &indices[order[k-1]*4];
+        const int* b = &indices[order[k]*4];
+        ASSERT_LE(std::min(std::min(a[0], a[1]), std::min(a[2], a[3])), std::min(std::min(b[0], b[1]), std::min(b[2], b[3])));
+    }
+}
+
+TEST_F(btDefracBodyOrderingTest, SortedBodyTranslatesTetrahedronIndices)
+{
+    const int flags[] = {
+        btDefracBody::CF_SORT_TETRAHEDRONS,
+        btDefracBody::CF_REORDER_NODES | btDefracBody::CF_SORT_TETRAHEDRONS_BY_NODE
+    };
+    
+    for (int f=0; f<2; ++f) {
+        btDefracBody body(positions, indices, 1, &material, flags[f]);
+        ASSERT_EQ(body.getTetrahedronCount(), indices.size()/4);
+        
+        for (int t=0; t<body.getTetrahedronCount(); ++t) {
+            const int index = body.getTetrahedronIndexFromOriginal(t);
+            ASSERT_EQ(body.getOriginalTetrahedronIndex(index), t);
+            
+            for (int k=0; k<4; ++k) {
+                ASSERT_EQ(body.getTetrahedron(index)->getNode(k)->getPosition0(), positions[indices[t*4 + k]]);
+            }
+        }
+    }
+}
+
+class btDefracMeshFileTest : public ::testing::Test
+{
+protected:
+    btDefracMeshFileTest() : filename("btDefracMeshFileTest.xmsh") {}
+    
+    //two tetrahedrons sharing the face 1 2 3, of different materials
+    virtual void SetUp()
+    {
+        positions.push_back(btVector3(0, 0, 0));
+        positions.push_back(btVector3(1, 0, 0));
+        positions.push_back(btVector3(0, 1, 0));
+        positions.push_back(btVector3(0, 0, 1));
+        positions.push_back(btVector3(1, 1, 1));
+        
+        const int tets[] = {0, 1, 2, 3, 1, 2, 3, 4};
+        const int faces[] = {0, 2, 1, 0, 1, 3, 0, 3, 2, 1, 2, 4, 1, 4, 3, 2, 3, 4};
+        
+        for (int i=0; i<8; ++i) {
+            indices.push_back(tets[i]);
+        }
+        
+        for (int i=0; i<18; ++i) {
+            faceIndices.push_back(faces[i]);
+        }
+        
+        materials.push_back(1);
+        materials.push_back(0);
+    }
+    
+    virtual void TearDown()
+    {
+        std::remove(filename.c_str());
+    }
+    
+    //overwrites the field of the file header at the given byte offset
+    template <typename T>
+    void patchHeader(size_t offset, T value)
+    {
+        FILE* file = fopen(filename.c_str(), "r+b");
+        ASSERT_TRUE(file != NULL);
+        fseek(file, (long)offset, SEEK_SET);
+        fwrite(&value, sizeof(value), 1, file);
+        fclose(file);
+    }
+    
+    std::string filename;
+    btAlignedObjectArray<btVector3> positions;
+    btAlignedObjectArray<int> indices;
+    btAlignedObjectArray<int> faceIndices;
+    btAlignedObjectArray<int> materials;
+};
+
+TEST_F(btDefracMeshFileTest, RoundTrip)
+{
+    ASSERT_TRUE(btDefracMeshFile::write(filename, positions, indices, &faceIndices, &materials));
+    
+    btDefracMeshFile file;
+    ASSERT_TRUE(file.open(filename));
+    ASSERT_EQ(file.getNodeCount(), positions.size());
+    ASSERT_EQ(file.getTetrahedronCount(), indices.size()/4);
+    ASSERT_EQ(file.getFaceCount(), faceIndices.size()/3);
+    ASSERT_TRUE(file.hasMaterials());
+    
+    for (int i=0; i<positions.size(); ++i) {
+        for (int k=0; k<3; ++k) {
+            ASSERT_EQ(file.getNodes()[i*4 + k], (float)positions[i][k]);
+        }
+    }
+    
+    for (int i=0; i<indices.size(); ++i) {
+        ASSERT_EQ(file.getTetrahedronIndices()[i], indices[i]);
+    }
+    
+    for (int i=0; i<faceIndices.size(); ++i) {
+        ASSERT_EQ(file.getFaceIndices()[i], faceIndices[i]);
+    }
+    
+    for (int i=0; i<materials.size(); ++i) {
+        ASSERT_EQ(file.getMaterials()[i], materials[i]);
+    }
+}
+
+TEST_F(btDefracMeshFileTest, RoundTripWithoutFacesAndMaterials)
+{
+    ASSERT_TRUE(btDefracMeshFile::write(filename, positions, indices, NULL, NULL));
+    
+    btDefracMeshFile file;
+    ASSERT_TRUE(file.open(filename));
+    ASSERT_EQ(file.getFaceCount(), 0);
+    ASSERT_FALSE(file.hasMaterials());
+    ASSERT_TRUE(file.getMaterials() == NULL);
+    
+    for (int i=0; i<indices.size(); ++i) {
+        ASSERT_EQ(file.getTetrahedronIndices()[i], indices[i]);
+    }
+}
+
+TEST_F(btDefracMeshFileTest, CreatesBodyWithMaterials)
+{
+    ASSERT_TRUE(btDefracMeshFile::write(filename, positions, indices, &faceIndices, &materials));
+    
+    btMaterial defaultMaterial(1000, btScalar(0.3));
+    btMaterial material0(2000, btScalar(0.3));
+    btMaterial material1(3000, btScalar(0.3));
+    btMaterial* bodyMaterials[] = {&material0, &material1};
+    
+    btDefracBody* body = btDefracUtils::CreateFromBinaryFile(filename, 1, &defaultMaterial, 0, bodyMaterials, 2);
+    ASSERT_TRUE(body != NULL);
+    ASSERT_EQ(body->getNodeCount(), positions.size());
+    ASSERT_EQ(body->getTetrahedronCount(), indices.size()/4);
+    
+    for (int t=0; t<body->getTetrahedronCount(); ++t) {
+        ASSERT_EQ(body->getTetrahedron(t)->getMaterial(), bodyMaterials[materials[t]]);
+        
+        for (int k=0; k<4; ++k) {
+            ASSERT_EQ(body->getTetrahedron(t)->getNode(k)->getPosition0(), positions[indices[t*4 + k]]);
+        }
+    }
+    
+    delete body;
+}
+
+TEST_F(btDefracMeshFileTest, RejectsOtherMagic)
+{
+    ASSERT_TRUE(btDefracMeshFile::write(filename, positions, indices, &faceIndices, &materials));
+    patchHeader(offsetof(btDefracMeshFileHeader, m_magic), BT_DEFRAC_MESH_MAGIC + 1);
+    
+    btDefracMeshFile file;
+    ASSERT_FALSE(file.open(filename));
+    ASSERT_FALSE(file.isOpen());
+}
+
+TEST_F(btDefracMeshFileTest, RejectsOtherVersion)
+{
+    ASSERT_TRUE(btDefracMeshFile::write(filename, positions, indices, &faceIndices, &materials));
+    patchHeader(offsetof(btDefracMeshFileHeader, m_version), BT_DEFRAC_MESH_VERSION + 1);
+    
+    btDefracMeshFile file;
+    ASSERT_FALSE(file.open(filename));
+    ASSERT_TRUE(btDefracUtils::CreateFromBinaryFile(filename, 1, NULL) == NULL);
+}
+
+TEST_F(btDefracMeshFileTest, RejectsTruncatedFile)
+{
+    ASSERT_TRUE(btDefracMeshFile::write(filename, positions, indices, &faceIndices, &materials));
+    patchHeader(offsetof(btDefracMeshFileHeader, m_numNodes), 1000u);
+    
+    btDefracMeshFile file;
+    ASSERT_FALSE(file.open(filename));
+}
+
+TEST_F(btDefracMeshFileTest, RejectsBadSectionOffsets)
+{
+    btDefracMeshFile file;
+    
+    //not aligned for the btVector3 array that wraps the nodes
+    ASSERT_TRUE(btDefracMeshFile::write(filename, positions, indices, &faceIndices, &materials));
+    patchHeader(offsetof(btDefracMeshFileHeader, m_nodesOffset), (unsigned long long)sizeof(btDefracMeshFileHeader) + 4);
+    ASSERT_FALSE(file.open(filename));
+    
+    //offset + size would wrap around to a small number
+    ASSERT_TRUE(btDefracMeshFile::write(filename, positions, indices, &faceIndices, &materials));
+    patchHeader(offsetof(btDefracMeshFileHeader, m_facesOffset), ~0ull - 15);
+    ASSERT_FALSE(file.open(filename));
+    
+    ASSERT_TRUE(btDefracMeshFile::write(filename, positions, indices, &faceIndices, &materials));
+    ASSERT_TRUE(file.open(filename));
+}
+
+TEST_F(btDefracMeshFileTest, RejectsNodeIndexOutOfRange)
+{
+    btDefracMeshFile file;
+    
+    indices[6] = positions.size();
+    ASSERT_TRUE(btDefracMeshFile::write(filename, positions, indices, &faceIndices, &materials));
+    ASSERT_FALSE(file.open(filename));
+    ASSERT_TRUE(btDefracUtils::CreateFromBinaryFile(filename, 1, NULL) == NULL);
+    
+    indices[6] = -1;
+    ASSERT_TRUE(btDefracMeshFile::write(filename, positions, indices, &faceIndices, &materials));
+    ASSERT_FALSE(file.open(filename));
+    
+    indices[6] = 3;
+    faceIndices[17] = positions.size();
+    ASSERT_TRUE(btDefracMeshFile::write(filename, positions, indices, &faceIndices, &materials));
+    ASSERT_FALSE(file.open(filename));
+}
+
+class btDefracBodyCacheTest : public btDefracBodyOrderingTest
+{
+protected:
+    btDefracBodyCacheTest() : cache("."), flags(btDefracBody::CF_REORDER_NODES | btDefracBody::CF_SORT_TETRAHEDRONS) {}
+    
+    virtual void SetUp()
+    {
+        btDefracBodyOrderingTest::SetUp();
+        key = btDefracBodyCache::computeKey(positions, indices, flags);
+        std::remove(cache.getFilename(key).c_str());
+    }
+    
+    virtual void TearDown()
+    {
+        std::remove(cache.getFilename(key).c_str());
+    }
+    
+    btDefracBodyCacheHeader readHeader()
+    {
+        btDefracBodyCacheHeader header;
+        FILE* file = fopen(cache.getFilename(key).c_str(), "rb");
+        EXPECT_TRUE(file != NULL);
+        
+        if (file) {
+            EXPECT_EQ(fread(&header, sizeof(header), 1, file), 1u);
+            fclose(file);
+        }
+        
+        return header;
+    }
+    
+    //overwrites the cache file at the given byte offset
+    void patchFile(unsigned long long offset, const void* data, size_t size)
+    {
+        FILE* file = fopen(cache.getFilename(key).c_str(), "r+b");
+        ASSERT_TRUE(file != NULL);
+        fseek(file, (long)offset, SEEK_SET);
+        fwrite(data, size, 1, file);
+        fclose(file);
+    }
+    
+    static void expectEqual(const btDefracBodyTemplate& a, const btDefracBodyTemplate& b)
+    {
+        ASSERT_EQ(a.getNodeCount(), b.getNodeCount());
+        ASSERT_EQ(a.getTetrahedronCount(), b.getTetrahedronCount());
+        
+        for (int i=0; i<a.getNodeCount(); ++i) {
+            ASSERT_EQ(a.getOriginalNodeIndex(i), b.getOriginalNodeIndex(i));
+        }
+        
+        for (int t=0; t<a.getTetrahedronCount(); ++t) {
+            ASSERT_EQ(a.getOriginalTetrahedronIndex(t), b.getOriginalTetrahedronIndex(t));
+            
+            for (int i=0; i<3; ++i) {
+                for (int j=0; j<3; ++j) {
+                    ASSERT_EQ(a.getBasisMatrix(t)[i][j], b.getBasisMatrix(t)[i][j]);
+                }
+            }
+            
+            for (int i=0; i<12; ++i) {
+                for (int j=0; j<12; ++j) {
+                    ASSERT_EQ(a.getNormalizedStiffnessMatrix(t).get(i, j), b.getNormalizedStiffnessMatrix(t).get(i, j));
+                }
+            }
+        }
+        
+        ASSERT_EQ(a.getSparsityPattern().getRowIndices(), b.getSparsityPattern().getRowIndices());
+        ASSERT_EQ(a.getSparsityPattern().getColumnIndices(), b.getSparsityPattern().getColumnIndices());
+    }
+    
+    btDefracBodyCache cache;
+    int flags;
+    unsigned long long key;
+};
+
+TEST_F(btDefracBodyCacheTest, StoredEntryMatchesComputedTemplate)
+{
+    btDefracBodyTemplate computed(positions, indices, 1, &material, flags);
+    btDefracBodyTemplate stored(positions, indices, 1, &material, flags, &cache);
+    
+    btDefracBodyCacheFile file;
+    ASSERT_TRUE(cache.open(key, positions.size(), indices.size()/4, file));
+    file.close();
+    
+    btDefracBodyTemplate loaded(positions, indices, 1, &material, flags, &cache);
+    expectEqual(computed, stored);
+    expectEqual(computed, loaded);
+}
+
+TEST_F(btDefracBodyCacheTest, ReadsStoredEntry)
+{
+    btDefracBodyTemplate stored(positions, indices, 1, &material, flags, &cache);
+    
+    //a loaded template takes the basis matrices from the file instead of computing them
+    const btScalar value = 1234;
+    patchFile(readHeader().m_basisOffset, &value, sizeof(value));
+    
+    btDefracBodyTemplate loaded(positions, indices, 1, &material, flags, &cache);
+    ASSERT_EQ(loaded.getBasisMatrix(0)[0][0], value);
+    ASSERT_NE(stored.getBasisMatrix(0)[0][0], value);
+}
+
+TEST_F(btDefracBodyCacheTest, RejectsCorruptEntry)
+{
+    btDefracBodyTemplate computed(positions, indices, 1, &material, flags);
+    const std::string filename = cache.getFilename(key);
+    const int numTets = indices.size()/4;
+    btDefracBodyCacheFile file;
+    
+    //each patch writes an int that breaks one part of the entry: a repeated node, a repeated
+    //tetrahedron, a row that goes back, a column out of range, a column out of order and a moved section
+    for (int c=0; c<6; ++c) {
+        btDefracBodyTemplate stored(positions, indices, 1, &material, flags, &cache);
+        btDefracBodyCacheHeader header = readHeader();
+        const int* rows = &stored.getSparsityPattern().getRowIndices()[0];
+        const int* columns = &stored.getSparsityPattern().getColumnIndices()[0];
+        unsigned long long offset = 0;
+        int value = 0;
+        
+        switch (c) {
+            case 0: offset = header.m_nodeOrderOffset + sizeof(int); value = stored.getOriginalNodeIndex(0); break;
+            case 1: offset = header.m_tetrahedronOrderOffset; value = stored.getOriginalTetrahedronIndex(numTets - 1); break;
+            case 2: offset = header.m_rowIndicesOffset + 2*sizeof(int); value = rows[1] - 1; break;
+            case 3: offset = header.m_columnIndicesOffset; value = positions.size(); break;
+            case 4: offset = header.m_columnIndicesOffset + sizeof(int); value = columns[0]; break;
+            case 5: offset = offsetof(btDefracBodyCacheHeader, m_basisOffset); value = (int)header.m_basisOffset + 16; break;
+        }
+        
+        patchFile(offset, &value, sizeof(value));
+        ASSERT_FALSE(file.open(filename, key, positions.size(), numTets)) << "case " << c;
+        
+        //the entry is computed again and replaced
+        btDefracBodyTemplate recomputed(positions, indices, 1, &material, flags, &cache);
+        expectEqual(computed, recomputed);
+        ASSERT_TRUE(file.open(filename, key, positions.size(), numTets));
+        file.close();
+    }
+}
+
+TEST_F(btDefracBodyCacheTest, RejectsMismatchedEntry)
+{
+    btDefracBodyTemplate stored(positions, indices, 1, &material, flags, &cache);
+    const std::string filename = cache.getFilename(key);
+    
+    btDefracBodyCacheFile file;
+    ASSERT_TRUE(file.open(filename, key, positions.size(), indices.size()/4));
+    file.close();
+    ASSERT_FALSE(file.open(filename, key + 1, positions.size(), indices.size()/4));
+    ASSERT_FALSE(file.open(filename, key, positions.size() + 1, indices.size()/4));
+    ASSERT_FALSE(file.open(filename, key, positions.size(), indices.size()/4 - 1));
+    
+    //different flags give a different key
+    ASSERT_NE(btDefracBodyCache::computeKey(positions, indices, 0), key);
+    
+    const unsigned int version = BT_DEFRAC_CACHE_VERSION + 1;
+    patchFile(offsetof(btDefracBodyCacheHeader, m_version), &version, sizeof(version));
+    ASSERT_FALSE(file.open(filename, key, positions.size(), indices.size()/4));
+    
+    //an outdated entry is computed again and replaced
+    btDefracBodyTemplate recomputed(positions, indices, 1, &material, flags, &cache);
+    expectEqual(stored, recomputed);
+    ASSERT_TRUE(file.open(filename, key, positions.size(), indices.size()/4));
+}
+
+class btTetgenFileTest : public ::testing::Test
+{
+protected:
+    btTetgenFileTest() : base("btTetgenFileTest") {}
+    
+    virtual void TearDown()
+    {
+        const char* extensions[] = {".node", ".ele", ".face", ".xmsh"};
+        
+        for (int i=0; i<4; ++i) {
+            std::remove((base + extensions[i]).c_str());
+        }
+    }
+    
+    void writeFile(const std::string& extension, const char* contents)
+    {
+        FILE* file = fopen((base + extension).c_str(), "wb");
+        ASSERT_TRUE(file != NULL);
+        fputs(contents, file);
+        fclose(file);
+    }
+    
+    //the two tetrahedrons of btDefracMeshFileTest
+    static void expectMesh(const btAlignedObjectArray<btVector3>& positions, const btAlignedObjectArray<int>& indices)
+    {
+        const btVector3 expectedPositions[] = {
+            btVector3(0, 0, 0), btVector3(1, 0, 0), btVector3(0, 1, 0), btVector3(0, 0, 1), btVector3(1, 1, 1)
+        };
+        const int expectedIndices[] = {0, 1, 2, 3, 1, 2, 3, 4};
+        
+        ASSERT_EQ(positions.size(), 5);
+        ASSERT_EQ(indices.size(), 8);
+        
+        for (int i=0; i<5; ++i) {
+            ASSERT_EQ(positions[i], expectedPositions[i]);
+        }
+        
+        for (int i=0; i<8; ++i) {
+            ASSERT_EQ(indices[i], expectedIndices[i]);
+        }
+    }
+    
+    std::string base;
+};
+
+TEST_F(btTetgenFileTest, OneBasedWithCommentsAndAttributes)
+{
+    writeFile(".node",
+        "# nodes of two tetrahedrons\r\n"
+        "5 3 1 1\r\n"
+        "\r\n"
+        "1  0.0 0.0 0.0  0.5 1 # attribute and boundary marker\r\n"
+        "2  1.0 0.0 0.0  0.5 1\r\n"
+        "\t# a comment between records\r\n"
+        "3  0 1e0 0  0.5 1\r\n"
+        "4  0 0 10E-1  0.5 0\r\n"
+        "5  +1 1. 1  0.5 1\r\n");
+    writeFile(".ele",
+        "2 4 1\n"
+        "1  1 2 3 4  7\n"
+        "2  2 3 4 5  3\n"
+        "# generated by tetgen\n");
+    writeFile(".face",
+        "2 1\n"
+        "1  1 3 2  -1\n"
+        "2  2 5 4  -1\n");
+    
+    btAlignedObjectArray<btVector3> positions;
+    btAlignedObjectArray<int> indices;
+    btAlignedObjectArray<int> faceIndices;
+    btAlignedObjectArray<int> attributes;
+    ASSERT_TRUE(btDefracUtils::LoadTetgenFile(base, positions, indices, &faceIndices, &attributes));
+    expectMesh(positions, indices);
+    
+    const int expectedFaces[] = {0, 2, 1, 1, 4, 3};
+    ASSERT_EQ(faceIndices.size(), 6);
+    
+    for (int i=0; i<6; ++i) {
+        ASSERT_EQ(faceIndices[i], expectedFaces[i]);
+    }
+    
+    ASSERT_EQ(attributes.size(), 2);
+    ASSERT_EQ(attributes[0], 7);
+    ASSERT_EQ(attributes[1], 3);
+}
+
+TEST_F(btTetgenFileTest, ZeroBasedWithoutAttributes)
+{
+    writeFile(".node",
+        "5 3 0 0\n"
+        "0 0 0 0\n"
+        "1 1 0 0\n"
+        "2 0 1 0\n"
+        "3 0 0 1\n"
+        "4 1 1 1\n");
+    writeFile(".ele",
+        "2 4 0\n"
+        "0 0 1 2 3\n"
+        "1 1 2 3 4\n");
+    
+    btAlignedObjectArray<btVector3> positions;
+    btAlignedObjectArray<int> indices;
+    btAlignedObjectArray<int> faceIndices;
+    btAlignedObjectArray<int> attributes;
+    ASSERT_TRUE(btDefracUtils::LoadTetgenFile(base, positions, indices, &faceIndices, &attributes));
+    expectMesh(positions, indices);
+    
+    //the .face file is optional
+    ASSERT_EQ(faceIndices.size(), 0);
+    ASSERT_EQ(attributes.size(), 0);
+}
+
+TEST_F(btTetgenFileTest, RejectsMalformedFiles)
+{
+    btAlignedObjectArray<btVector3> positions;
+    btAlignedObjectArray<int> indices;
+    ASSERT_FALSE(btDefracUtils::LoadTetgenFile(base, positions, indices));
+    
+    writeFile(".node",
+        "5 3 0 0\n"
+        "0 0 0 0\n"
+        "1 1 0 0\n"
+        "2 0 1 0\n"
+        "3 0 0 1\n"
+        "4 1 1 1\n");
+    writeFile(".ele",
+        "2 4 0\n"
+        "0 0 1 2 3\n"
+        "1 1 2 x 4\n");
+    ASSERT_FALSE(btDefracUtils::LoadTetgenFile(base, positions, indices));
+    
+    //fewer records than the header tells
+    writeFile(".ele",
+        "3 4 0\n"
+        "0 0 1 2 3\n"
+        "1 1 2 3 4\n");
+    ASSERT_FALSE(btDefracUtils::LoadTetgenFile(base, positions, indices));
+    
+    writeFile(".ele",
+        "2 4 0\n"
+        "0 0 1 2 3\n"
+        "1 1 2 3 4\n");
+    ASSERT_TRUE(btDefracUtils::LoadTetgenFile(base, positions, indices));
+}
+
+TEST_F(btTetgenFileTest, ConvertsToBinaryFile)
+{
+    writeFile(".node",
+        "5 3 0 0\n"
+        "1 0 0 0\n"
+        "2 1 0 0\n"
+        "3 0 1 0\n"
+        "4 0 0 1\n"
+        "5 1 1 1\n");
+    writeFile(".ele",
+        "2 4 1\n"
+        "1 1 2 3 4 7\n"
+        "2 2 3 4 5 3\n");
+    writeFile(".face",
+        "1 0\n"
+        "1 1 3 2\n");
+    ASSERT_TRUE(btDefracUtils::ConvertTetgenToBinaryFile(base, base + ".xmsh"));
+    
+    btDefracMeshFile file;
+    ASSERT_TRUE(file.open(base + ".xmsh"));
+    ASSERT_EQ(file.getNodeCount(), 5);
+    ASSERT_EQ(file.getTetrahedronCount(), 2);
+    ASSERT_EQ(file.getFaceCount(), 1);
+    ASSERT_EQ(file.getFaceIndices()[1], 2);
+    ASSERT_EQ(file.getNodes()[4*4 + 1], 1.0f);
+    ASSERT_EQ(file.getTetrahedronIndices()[7], 4);
+    ASSERT_TRUE(file.hasMaterials());
+    ASSERT_EQ(file.getMaterials()[0], 7);
+    ASSERT_EQ(file.getMaterials()[1], 3);
+}
+
+class btExtractRotationsTest : public ::testing::Test
+{
+protected:
+    typedef Eigen::Matrix<btScalar, 3, 3> Matrix3;
+    
+    //deformation gradients of random rotations and stretches with distinct singular values. If reflect is
+    //true, one axis of the stretch is flipped so that det(F) < 0
+    virtual void SetUp()
+    {
+        unsigned int seed = 2024;
+        
+        for (int k=0; k<COUNT; ++k) {
+            btVector3 axis(random(seed) - btScalar(0.5), random(seed) - btScalar(0.5), random(seed) - btScalar(0.5));
+            btMatrix3x3 rotation(btQuaternion(axis.normalized(), random(seed)*SIMD_2_PI));
+            btMatrix3x3 frame(btQuaternion(btVector3(1, 1, random(seed)).normalized(), random(seed)*SIMD_2_PI));
+            btMatrix3x3 stretch(frame.transpose());
+            
+            for (int i=0; i<3; ++i) {
+                stretch[i] *= btScalar(0.5) + i*btScalar(0.6) + random(seed)*btScalar(0.4);
+            }
+            
+            if (k%2 == 1) {
+                stretch[k%3] *= -1;
+            }
+            
+            F[k] = rotation*frame*stretch;
+        }
+    }
+    
+    static btScalar random(unsigned int& seed)
+    {
+        seed = seed*1103515245 + 12345;
+        return (btScalar)((seed >> 8) & 0xffff)/0xffff;
+    }
+    
+    //the rotation of the polar decomposition of F, from its singular value decomposition. If det(F) < 0
+    //the smallest singular value is taken negative, which gives the closest rotation
+    static Matrix3 polarRotation(const btMatrix3x3& F)
+    {
+        Matrix3 f;
+        
+        for (int i=0; i<3; ++i) {
+            for (int j=0; j<3; ++j) {
+                f(i, j) = F[i][j];
+            }
+        }
+        
+        Eigen::JacobiSVD<Matrix3> svd(f, Eigen::ComputeFullU | Eigen::ComputeFullV);
+        Matrix3 d = Matrix3::Identity();
+        d(2, 2) = (svd.matrixU()*svd.matrixV().transpose()).determinant() < 0 ? -1 : 1;
+        return svd.matrixU()*d*svd.matrixV().transpose();
+    }
+    
+    void expectPolarRotations(const btQuaternion* q, btScalar tolerance)
+    {
+        for (int k=0; k<COUNT; ++k) {
+            Matrix3 expected = polarRotation(F[k]);
+            btMatrix3x3 r(q[k]);
+            
+            for (int i=0; i<3; ++i) {
+                for (int j=0; j<3; ++j) {
+                    EXPECT_NEAR(r[i][j], expected(i, j), tolerance) << "F[" << k << "]";
+                }
+            }
+        }
+    }
+    
+    static const int COUNT = 21;//not a multiple of the batch size
+    btMatrix3x3 F[COUNT];
+};
+
+TEST_F(btExtractRotationsTest, MatchesPolarDecomposition)
+{
+    btQuaternion q[COUNT];
+    
+    for (int k=0; k<COUNT; ++k) {
+        q[k] = btQuaternion::getIdentity();
+    }
+    
+    btDefracUtils::ExtractRotations(F, q, COUNT, 100);
+    expectPolarRotations(q, btScalar(1e-3));
+}
+
+TEST_F(btExtractRotationsTest, WarmStartStaysAtPolarRotation)
+{
+    btQuaternion q[COUNT];
+    
+    for (int k=0; k<COUNT; ++k) {
+        Matrix3 r = polarRotation(F[k]);
+        btMatrix3x3(r(0, 0), r(0, 1), r(0, 2), r(1, 0), r(1, 1), r(1, 2), r(2, 0), r(2, 1), r(2, 2)).getRotation(q[k]);
+    }
+    
+    btDefracUtils::ExtractRotations(F, q, COUNT, 1);
+    expectPolarRotations(q, btScalar(1e-4));
+}
+
+class btQuickprofTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        CProfileManager::Reset();
+    }
+    
+    //runs a profiled scope SCOPES times on each thread of a parallel region, returns the number of threads.
+    //Without OpenMP it is the calling thread alone
+    static int profileInParallel()
+    {
+        int threads = 0;
+        
+        #pragma omp parallel num_threads(4) reduction(+:threads)
+        {
+            threads += 1;
+            
+            for (int i=0; i<SCOPES; ++i) {
+                BT_PROFILE("btQuickprofTest");
+            }
+        }
+        
+        return threads;
+    }
+    
+    //the calls of the scope under the root of the iterator, which is released
+    static int totalCalls(CProfileIterator* iterator)
+    {
+        int calls = 0;
+        
+        if (iterator == NULL) {
+            return 0;
+        }
+        
+        for (iterator->First(); !iterator->Is_Done(); iterator->Next()) {
+            if (strcmp(iterator->Get_Current_Name(), "btQuickprofTest") == 0) {
+                calls += iterator->Get_Current_Total_Calls();
+            }
+        }
+        
+        CProfileManager::Release_Iterator(iterator);
+        return calls;
+    }
+    
+    static const int SCOPES = 10;
+};
+
+TEST_F(btQuickprofTest, MergesThreadTrees)
+{
+    const int threads = profileInParallel();
+#ifdef _OPENMP
+    ASSERT_EQ(threads, 4);
+#endif
+    ASSERT_GE(CProfileManager::Get_Thread_Count(), threads);
+    
+    //the threads of the region may be any of the registered ones
+    int calls = 0;
+    
+    for (int i=0; i<CProfileManager::Get_Thread_Count(); ++i) {
+        calls += totalCalls(CProfileManager::Get_Thread_Iterator(i));
+    }
+    
+    ASSERT_EQ(calls, threads*SCOPES);
+    
+    CProfileManager::Merge_Threads();
+    ASSERT_EQ(totalCalls(CProfileManager::Get_Merged_Iterator()), threads*SCOPES);
+    
+    //merging again starts over instead of adding to the last merge
+    CProfileManager::Merge_Threads();
+    ASSERT_EQ(totalCalls(CProfileManager::Get_Merged_Iterator()), threads*SCOPES);
+}
+
+TEST_F(btQuickprofTest, ProfilesAgainAfterCleanup)
+{
+    profileInParallel();
+    CProfileManager::CleanupMemory();
+    CProfileManager::Merge_Threads();
+    ASSERT_EQ(totalCalls(CProfileManager::Get_Merged_Iterator()), 0);
+    
+    CProfileManager::Reset();
+    const int threads = profileInParallel();
+    CProfileManager::Merge_Threads();
+    ASSERT_EQ(totalCalls(CProfileManager::Get_Merged_Iterator()), threads*SCOPES);
+}
+
+
+int main(int argc, char **argv) {
 
-int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
 }
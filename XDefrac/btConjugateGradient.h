@@ -0,0 +1,122 @@
+#ifndef _BT_CONJUGATE_GRADIENT_H
+#define _BT_CONJUGATE_GRADIENT_H
+
+#include "btSparseMatrix.h"
+#include "btVector3n.h"
+
+
+/**
+ * Conjugate gradient solver for A*x = b that is advanced a given number of iterations at a time,
+ * so the iterations of several systems can be interleaved and stopped at any point. A and x are
+ * referenced, not copied, and must outlive the solve. x is the initial guess and holds the solution
+ * found so far after each call to iterate.
+ */
+class btConjugateGradient
+{
+public:
+    btConjugateGradient(const btSparseMatrix& A, btVector3n& x, const btVector3n& b,
+                        btScalar rTOL = 1e-6, btScalar aTOL = 1e-14) :
+        m_A(A),
+        m_x(x),
+        m_resid(b - A*x),
+        m_g(x.size()),
+        m_d1(x.size()),
+        m_rTOL(rTOL),
+        m_aTOL(aTOL),
+        m_iteration(1)
+    {
+        m_g = m_resid;
+        m_norm = m_resid.dot(m_resid);
+        m_norm_0 = m_norm;
+        m_d1 = m_resid;
+        m_h2 = m_resid.dot(m_d1);
+    }
+
+    /**
+     * Runs up to n iterations, less if it converges first. Returns the number of iterations run.
+     */
+    int iterate(int n)
+    {
+        int i = 0;
+
+        for (; i<n && !isConverged(); ++i) {
+            btScalar h1 = m_h2;
+
+            m_d1 = m_A*m_g;
+
+            m_h2 = m_g.dot(m_d1);
+
+            btScalar alpha = h1/m_h2;
+
+            m_x += alpha*m_g;
+            m_resid -= alpha*m_d1;
+
+            m_d1 = m_resid;
+            m_h2 = m_resid.dot(m_d1);
+
+            btScalar beta = m_h2/h1;
+            m_g = beta*m_g + m_d1;
+
+            m_norm = m_resid.dot(m_resid);
+
+            ++m_iteration;
+        }
+
+        return i;
+    }
+
+    /**
+     * Whether the residual is below the absolute tolerance or below the relative tolerance times
+     * the initial residual.
+     */
+    bool isConverged() const
+    {
+        return m_norm <= m_aTOL*m_aTOL || m_norm/m_norm_0 <= m_rTOL*m_rTOL;
+    }
+
+    /**
+     * Returns the number of iterations so far, counting the computation of the initial residual
+     * as the first one.
+     */
+    int getIterationCount() const
+    {
+        return m_iteration;
+    }
+
+    btScalar getInitialResidual() const
+    {
+        return btSqrt(m_norm_0);
+    }
+
+    btScalar getResidual() const
+    {
+        return btSqrt(m_norm);
+    }
+
+    /**
+     * Returns the residual over the initial residual, which is 1 when it starts and decreases
+     * towards rTOL as it converges.
+     */
+    btScalar getRelativeResidual() const
+    {
+        return m_norm_0 > 0 ? btSqrt(m_norm/m_norm_0) : 0;
+    }
+
+private:
+    btConjugateGradient(const btConjugateGradient&);
+    btConjugateGradient& operator = (const btConjugateGradient&);
+
+    const btSparseMatrix& m_A;
+    btVector3n& m_x;
+    btVector3n m_resid;
+    btVector3n m_g;
+    btVector3n m_d1;
+    btScalar m_rTOL;
+    btScalar m_aTOL;
+    btScalar m_norm;
+    btScalar m_norm_0;
+    btScalar m_h2;
+    int m_iteration;
+};
+
+#endif
@@ -1,29 +1,41 @@
-
 #include "btDefracBody.h"
 #include "btElement.h"
 #include "btDefracBodyComponent.h"
+#include "btDefracBodyTemplate.h"
 
 btDefracBody::btDefracBody(const btAlignedObjectArray<btVector3>& nodePosition, 
 						   const btAlignedObjectArray<int>& indices, btScalar mass, 
-						   btMaterial *material)
+						   btMaterial *material, int flags, btDefracBodyCache* cache):
+	m_ownsTemplate(true)
+{
+	m_template = new btDefracBodyTemplate(nodePosition, indices, mass, material, flags, cache);
+	instantiate();
+}
+
+btDefracBody::btDefracBody(btDefracBodyTemplate* bodyTemplate, bool ownsTemplate):
+	m_template(bodyTemplate),
+	m_ownsTemplate(ownsTemplate)
+{
+	instantiate();
+}
+
+void btDefracBody::instantiate()
 {
-	btAssert(indices.size()%4 == 0);//4 indices(nodes) for each tetrahedron
-	
-	const int numNodes = nodePosition.size();
-	const int numTets = indices.size()/4;
+	const int numNodes = m_template->getNodeCount();
+	const int numTets = m_template->getTetrahedronCount();
+	const btAlignedObjectArray<int>& indices = m_template->getIndices();
 
 	m_nodes.reserve(numNodes);
 	m_tetrahedrons.reserve(numTets);
 
-	const btScalar nodeMass = mass/numNodes;
-
 	for(int i=0; i<numNodes; ++i)
 	{
 		void* mem = btAlignedAlloc(sizeof(btNode), 16);
-		btNode* n = new (mem) btNode(nodePosition[i], nodeMass);
+		btNode* n = new (mem) btNode(m_template->getRestPosition(i), m_template->getNodeMass());
 		m_nodes.push_back(n);
 	}
 
+	//the tetrahedrons point to the matrices in the template instead of holding a copy
 	for(int i=0; i<numTets; ++i)
 	{
 		void* mem = btAlignedAlloc(sizeof(btTetrahedron), 16);
@@ -32,34 +44,88 @@ btDefracBody::btDefracBody(const btAlignedObjectArray<btVector3>& nodePosition,
 						   m_nodes[indices[i*4+2]],
 						   m_nodes[indices[i*4+3]]};
 
-		btTetrahedron* t = new (mem) btTetrahedron(nodes, material);
+		btTetrahedron* t = new (mem) btTetrahedron(nodes, m_template->getMaterial(i), 
+			&m_template->getBasisMatrix(i), &m_template->getNormalizedStiffnessMatrix(i));
 		m_tetrahedrons.push_back(t);
 	}
 
 	//by now assume the body is initially made of only one component
 	void* mem = btAlignedAlloc(sizeof(btDefracBodyComponent), 16);
-	btDefracBodyComponent* c = new (mem) btDefracBodyComponent(m_nodes, m_tetrahedrons, indices);
+	const btAlignedObjectArray<int>* faces = m_template->getFaceCount() > 0 ? &m_template->getFaceIndices() : NULL;
+	btDefracBodyComponent* c = new (mem) btDefracBodyComponent(m_nodes, m_tetrahedrons, indices, &m_template->getSparsityPattern(), faces);
 	m_components.push_back(c);
 }
 
 btDefracBody::~btDefracBody()
 {
 	for(int i=0; i<m_components.size(); ++i)
+	{
+		m_components[i]->~btDefracBodyComponent();
 		btAlignedFree(m_components[i]);
+	}
 
 	for(int i=0; i<m_tetrahedrons.size(); ++i)
+	{
+		m_tetrahedrons[i]->~btTetrahedron();
 		btAlignedFree(m_tetrahedrons[i]);
+	}
 
 	for(int i=0; i<m_nodes.size(); ++i)
+	{
+		m_nodes[i]->~btNode();
 		btAlignedFree(m_nodes[i]);
+	}
+
+	if(m_ownsTemplate)
+		delete m_template;
 }
 
 void btDefracBody::removeComponent(btDefracBodyComponent* c)
 {
 	m_components.remove(c);
+	c->~btDefracBodyComponent();
 	btAlignedFree(c);
 }
 
+int btDefracBody::getNodeIndexFromOriginal(int originalIndex) const
+{
+	return m_template->getNodeIndexFromOriginal(originalIndex);
+}
+
+int btDefracBody::getOriginalNodeIndex(int index) const
+{
+	return m_template->getOriginalNodeIndex(index);
+}
+
+int btDefracBody::getTetrahedronIndexFromOriginal(int originalIndex) const
+{
+	return m_template->getTetrahedronIndexFromOriginal(originalIndex);
+}
+
+int btDefracBody::getOriginalTetrahedronIndex(int index) const
+{
+	return m_template->getOriginalTetrahedronIndex(index);
+}
+
+void btDefracBody::setSurfaceFaces(const btAlignedObjectArray<int>& originalIndices)
+{
+	m_template->setSurfaceFaces(originalIndices);
+
+	//the node indices of the only component are those of the body
+	if(m_components.size() == 1)
+		m_components[0]->setSurfaceTriangles(m_template->getFaceIndices());
+}
+
+int btDefracBody::getFaceCount() const
+{
+	return m_template->getFaceCount();
+}
+
+int btDefracBody::getFaceNodeIndex(int index) const
+{
+	return m_template->getFaceNodeIndex(index);
+}
+
 void btDefracBody::reset()
 {
 	for(int i=0; i<m_nodes.size(); ++i)
@@ -69,4 +135,7 @@ void btDefracBody::reset()
 		n->setVelocity(btVector3(0, 0, 0));
 		n->setForce(btVector3(0, 0, 0));
 	}
-}
\ No newline at end of file
+
+	for(int i=0; i<m_components.size(); ++i)
+		static_cast<btDefracCollisionShape*>(m_components[i]->getCollisionShape())->refitBvh();
+}
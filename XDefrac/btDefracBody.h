@@ -10,26 +10,57 @@ class btNode;
 class btTetrahedron;
 class btDefracBodyComponent;
 class btMaterial;
+class btDefracBodyCache;
+class btDefracBodyTemplate;
 
 class btDefracBody
 {
+public:
+	enum CreationFlags
+	{
+		CF_REORDER_NODES = 1,//renumber nodes with Reverse Cuthill-McKee to reduce the stiffness matrix bandwidth
+		CF_SORT_TETRAHEDRONS = 2,//sort tetrahedrons by the Morton code of their centroids
+		CF_SORT_TETRAHEDRONS_BY_NODE = 4//sort tetrahedrons by their smallest node index, after CF_REORDER_NODES
+	};
+
 private:
 	btAlignedObjectArray<btNode*> m_nodes;
 	btAlignedObjectArray<btTetrahedron*> m_tetrahedrons;
 	btAlignedObjectArray<btDefracBodyComponent*> m_components;
+	btDefracBodyTemplate* m_template;//rest state, possibly shared with other bodies
+	bool m_ownsTemplate;
+
+	void instantiate();//creates the nodes, tetrahedrons and component from m_template
 
 public:
 	btDefracBody(const btAlignedObjectArray<btVector3>& nodePosition, 
-		const btAlignedObjectArray<int>& indices, btScalar mass, btMaterial* material);
+		const btAlignedObjectArray<int>& indices, btScalar mass, btMaterial* material, int flags=0, 
+		btDefracBodyCache* cache=NULL);//creates a template only for this body, see btDefracBodyTemplate
+	btDefracBody(btDefracBodyTemplate* bodyTemplate, bool ownsTemplate=false);//creates a body sharing the rest state in bodyTemplate, which must outlive it unless it is owned
 	~btDefracBody();
 
+	btDefracBodyTemplate* getTemplate() { return m_template; }
+	const btDefracBodyTemplate* getTemplate() const { return m_template; }
+
 	void reset();//resets all nodes to original position with zero velocity and force
 
 	const btNode* getNode(int index) const { return m_nodes[index]; }
 
+	//nodes may be renumbered at creation (see CreationFlags), these translate between the indices
+	//given to the constructor and the ones used by getNode and the components
+	int getNodeIndexFromOriginal(int originalIndex) const;
+	int getOriginalNodeIndex(int index) const;
+
 	const btTetrahedron* getTetrahedron(int index) const { return m_tetrahedrons[index]; }
 	btTetrahedron* getTetrahedron(int index) { return m_tetrahedrons[index]; }
 
+	int getTetrahedronIndexFromOriginal(int originalIndex) const;
+	int getOriginalTetrahedronIndex(int index) const;
+
+	void setSurfaceFaces(const btAlignedObjectArray<int>& originalIndices);//3 node indices per triangle, as given at creation. Sets them in the template
+	int getFaceCount() const;
+	int getFaceNodeIndex(int index) const;//index of the (index%3)-th node of face index/3
+
 	const btDefracBodyComponent* getComponent(int index) const { return m_components[index]; }
 	btDefracBodyComponent* getComponent(int index) { return m_components[index]; }
 	void removeComponent(btDefracBodyComponent* c);
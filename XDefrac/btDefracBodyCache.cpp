@@ -0,0 +1,241 @@
+#include "btDefracBodyCache.h"
+#include "btDefracUtils.h"
+#include "btSparsityPattern.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static unsigned long long AlignOffset(unsigned long long offset)
+{
+	return (offset + 15) & ~15ull;
+}
+
+//64 bit FNV-1a
+static void HashBytes(unsigned long long& hash, const void* data, size_t size)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+
+	for(size_t i=0; i<size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+}
+
+//sets the section offsets and file size of an entry from its counts. They are a fixed function of the
+//counts, so open compares them with the ones in the file
+static void ComputeLayout(btDefracBodyCacheHeader& header)
+{
+	const unsigned long long numNodes = header.m_numNodes;
+	const unsigned long long numTets = header.m_numTetrahedrons;
+
+	header.m_nodeOrderOffset = AlignOffset(sizeof(btDefracBodyCacheHeader));
+	header.m_tetrahedronOrderOffset = AlignOffset(header.m_nodeOrderOffset + numNodes*sizeof(int));
+	header.m_rowIndicesOffset = AlignOffset(header.m_tetrahedronOrderOffset + numTets*sizeof(int));
+	header.m_columnIndicesOffset = AlignOffset(header.m_rowIndicesOffset + (numNodes+1)*sizeof(int));
+	header.m_basisOffset = AlignOffset(header.m_columnIndicesOffset + header.m_nonZeroCount*(unsigned long long)sizeof(int));
+	header.m_stiffnessOffset = AlignOffset(header.m_basisOffset + numTets*sizeof(btMatrix3x3));
+	header.m_fileSize = header.m_stiffnessOffset + numTets*sizeof(btMatrix3x3_12x12);
+}
+
+//whether order holds each of 0..count-1 once
+static bool IsPermutation(const int* order, int count)
+{
+	btAlignedObjectArray<char> found;
+	found.resize(count, 0);
+
+	for(int i=0; i<count; ++i)
+	{
+		if((unsigned int)order[i] >= (unsigned int)count || found[order[i]])
+			return false;
+
+		found[order[i]] = 1;
+	}
+
+	return true;
+}
+
+//whether the arrays are a valid btSparsityPattern of size numNodes with nonZeroCount blocks: rows start
+//at 0 and never go back, and the columns of each row are in range and strictly increasing
+static bool IsValidPattern(const int* rowIndices, const int* columnIndices, int numNodes, unsigned int nonZeroCount)
+{
+	if(rowIndices[0] != 0 || (unsigned int)rowIndices[numNodes] != nonZeroCount)
+		return false;
+
+	for(int i=0; i<numNodes; ++i)
+	{
+		if(rowIndices[i+1] < rowIndices[i])
+			return false;
+
+		for(int k=rowIndices[i]; k<rowIndices[i+1]; ++k)
+		{
+			if((unsigned int)columnIndices[k] >= (unsigned int)numNodes || (k > rowIndices[i] && columnIndices[k] <= columnIndices[k-1]))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+bool btDefracBodyCacheFile::open(const std::string& filename, unsigned long long key, int numNodes, int numTetrahedrons)
+{
+	close();
+
+	if(!m_file.open(filename))
+		return false;
+
+	const size_t size = m_file.getSize();
+	const btDefracBodyCacheHeader* header = (const btDefracBodyCacheHeader*)m_file.getData();
+
+	if(size < sizeof(btDefracBodyCacheHeader) ||
+	   header->m_magic != BT_DEFRAC_CACHE_MAGIC ||
+	   header->m_version != BT_DEFRAC_CACHE_VERSION ||
+	   header->m_headerSize != sizeof(btDefracBodyCacheHeader) ||
+	   header->m_scalarSize != sizeof(btScalar) ||
+	   header->m_key != key ||
+	   header->m_numNodes != (unsigned int)numNodes ||
+	   header->m_numTetrahedrons != (unsigned int)numTetrahedrons ||
+	   header->m_fileSize != size)
+	{
+		close();
+		return false;
+	}
+
+	btDefracBodyCacheHeader layout = *header;
+	ComputeLayout(layout);
+
+	if(header->m_nodeOrderOffset != layout.m_nodeOrderOffset ||
+	   header->m_tetrahedronOrderOffset != layout.m_tetrahedronOrderOffset ||
+	   header->m_rowIndicesOffset != layout.m_rowIndicesOffset ||
+	   header->m_columnIndicesOffset != layout.m_columnIndicesOffset ||
+	   header->m_basisOffset != layout.m_basisOffset ||
+	   header->m_stiffnessOffset != layout.m_stiffnessOffset ||
+	   header->m_fileSize != layout.m_fileSize)
+	{
+		close();
+		return false;
+	}
+
+	m_header = header;
+
+	//templates index their arrays with the orders and pattern straight away, so a corrupt entry is
+	//rejected here and computed again
+	if(!IsPermutation(getNodeOrder(), numNodes) ||
+	   !IsPermutation(getTetrahedronOrder(), numTetrahedrons) ||
+	   !IsValidPattern(getRowIndices(), getColumnIndices(), numNodes, header->m_nonZeroCount))
+	{
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+void btDefracBodyCacheFile::close()
+{
+	m_file.close();
+	m_header = NULL;
+}
+
+unsigned long long btDefracBodyCache::computeKey(const btAlignedObjectArray<btVector3>& nodePosition, 
+												 const btAlignedObjectArray<int>& indices, int flags)
+{
+	unsigned long long hash = 14695981039346656037ull;
+	const unsigned int version = BT_DEFRAC_CACHE_VERSION;
+	HashBytes(hash, &version, sizeof(version));
+	HashBytes(hash, &flags, sizeof(flags));
+
+	for(int i=0; i<nodePosition.size(); ++i)
+		HashBytes(hash, nodePosition[i].m_floats, 3*sizeof(btScalar));//the 4th component is unused
+
+	if(indices.size() > 0)
+		HashBytes(hash, &indices[0], indices.size()*sizeof(int));
+
+	return hash;
+}
+
+std::string btDefracBodyCache::getFilename(unsigned long long key) const
+{
+	char name[32];
+	sprintf(name, "%016llx.xdc", key);
+
+	if(m_directory.empty())
+		return name;
+
+	char last = m_directory[m_directory.size()-1];
+	return (last == '/' || last == '\\') ? m_directory + name : m_directory + "/" + name;
+}
+
+bool btDefracBodyCache::open(unsigned long long key, int numNodes, int numTetrahedrons, btDefracBodyCacheFile& file) const
+{
+	return file.open(getFilename(key), key, numNodes, numTetrahedrons);
+}
+
+bool btDefracBodyCache::store(unsigned long long key, const btAlignedObjectArray<int>& nodeOrder, 
+							  const btAlignedObjectArray<int>& tetrahedronOrder, const btSparsityPattern& pattern, 
+							  const btAlignedObjectArray<btMatrix3x3>& basisMatrices, 
+							  const btAlignedObjectArray<btMatrix3x3_12x12>& stiffnessMatrices) const
+{
+	const int numNodes = nodeOrder.size();
+	const int numTets = basisMatrices.size();
+	btAssert(stiffnessMatrices.size() == numTets);
+
+	btDefracBodyCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	header.m_magic = BT_DEFRAC_CACHE_MAGIC;
+	header.m_version = BT_DEFRAC_CACHE_VERSION;
+	header.m_headerSize = sizeof(btDefracBodyCacheHeader);
+	header.m_scalarSize = sizeof(btScalar);
+	header.m_key = key;
+	header.m_numNodes = numNodes;
+	header.m_numTetrahedrons = numTets;
+	header.m_nonZeroCount = pattern.getNonZeroCount();
+	ComputeLayout(header);
+
+	char* image = (char*)calloc((size_t)header.m_fileSize, 1);
+
+	if(image == NULL)
+		return false;
+
+	memcpy(image, &header, sizeof(header));
+
+	if(numNodes > 0)
+		memcpy(image + header.m_nodeOrderOffset, &nodeOrder[0], numNodes*sizeof(int));
+
+	if(numTets > 0)
+		memcpy(image + header.m_tetrahedronOrderOffset, &tetrahedronOrder[0], numTets*sizeof(int));
+
+	memcpy(image + header.m_rowIndicesOffset, &pattern.getRowIndices()[0], (numNodes+1)*sizeof(int));
+
+	if(header.m_nonZeroCount > 0)
+		memcpy(image + header.m_columnIndicesOffset, &pattern.getColumnIndices()[0], header.m_nonZeroCount*sizeof(int));
+
+	if(numTets > 0)
+	{
+		memcpy(image + header.m_basisOffset, &basisMatrices[0], numTets*sizeof(btMatrix3x3));
+		memcpy(image + header.m_stiffnessOffset, &stiffnessMatrices[0], numTets*sizeof(btMatrix3x3_12x12));
+	}
+
+	//write to a temporary file and rename it, so a concurrent reader never sees a partial entry
+	const std::string filename = getFilename(key);
+	const std::string tempFilename = filename + ".tmp";
+	FILE* file = fopen(tempFilename.c_str(), "wb");
+	bool ok = file != NULL && fwrite(image, 1, (size_t)header.m_fileSize, file) == header.m_fileSize;
+
+	if(file != NULL)
+		ok = (fclose(file) == 0) && ok;
+
+	free(image);
+
+	if(ok)
+	{
+		remove(filename.c_str());
+		ok = rename(tempFilename.c_str(), filename.c_str()) == 0;
+	}
+
+	if(!ok)
+		remove(tempFilename.c_str());
+
+	return ok;
+}
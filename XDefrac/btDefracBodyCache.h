@@ -0,0 +1,90 @@
+#ifndef BT_DEFRAC_BODY_CACHE_H
+#define BT_DEFRAC_BODY_CACHE_H
+
+#include "LinearMath/btVector3.h"
+#include "LinearMath/btMatrix3x3.h"
+#include "LinearMath/btAlignedObjectArray.h"
+#include "btMappedFile.h"
+#include <string>
+
+#define BT_DEFRAC_CACHE_MAGIC 0x48434458 //"XDCH"
+#define BT_DEFRAC_CACHE_VERSION 2
+
+class btSparsityPattern;
+class btMatrix3x3_12x12;
+
+struct btDefracBodyCacheHeader
+{
+	unsigned int m_magic;
+	unsigned int m_version;
+	unsigned int m_headerSize;
+	unsigned int m_scalarSize;//sizeof(btScalar), caches are not shared between precisions
+	unsigned long long m_key;
+	unsigned int m_numNodes;
+	unsigned int m_numTetrahedrons;
+	unsigned int m_nonZeroCount;
+	unsigned int m_reserved;
+	unsigned long long m_nodeOrderOffset;//int per node
+	unsigned long long m_tetrahedronOrderOffset;//int per tetrahedron
+	unsigned long long m_rowIndicesOffset;//numNodes+1 ints
+	unsigned long long m_columnIndicesOffset;//nonZeroCount ints
+	unsigned long long m_basisOffset;//btMatrix3x3 per tetrahedron
+	unsigned long long m_stiffnessOffset;//btMatrix3x3_12x12 per tetrahedron, normalized stiffness
+	unsigned long long m_fileSize;
+};
+
+//A cache entry mapped in memory, see btDefracBodyCache::open
+class btDefracBodyCacheFile
+{
+private:
+	btMappedFile m_file;
+	const btDefracBodyCacheHeader* m_header;
+
+	const char* getSection(unsigned long long offset) const { return (const char*)m_file.getData() + offset; }
+
+public:
+	btDefracBodyCacheFile() : m_header(NULL) {}
+
+	bool open(const std::string& filename, unsigned long long key, int numNodes, int numTetrahedrons);
+	void close();
+
+	bool isOpen() const { return m_header != NULL; }
+
+	const int* getNodeOrder() const { return (const int*)getSection(m_header->m_nodeOrderOffset); }
+	const int* getTetrahedronOrder() const { return (const int*)getSection(m_header->m_tetrahedronOrderOffset); }
+	const int* getRowIndices() const { return (const int*)getSection(m_header->m_rowIndicesOffset); }
+	const int* getColumnIndices() const { return (const int*)getSection(m_header->m_columnIndicesOffset); }
+	const btMatrix3x3* getBasisMatrices() const { return (const btMatrix3x3*)getSection(m_header->m_basisOffset); }
+	const btMatrix3x3_12x12* getStiffnessMatrices() const { return (const btMatrix3x3_12x12*)getSection(m_header->m_stiffnessOffset); }
+};
+
+//A directory of files holding the data btDefracBodyTemplate computes at creation (node and tetrahedron
+//orderings, sparsity pattern, element basis and stiffness matrices), keyed by a hash of the mesh and
+//the creation flags. Stiffness is stored normalized, so an entry holds for any material. Files are only
+//valid for the machine and build that wrote them
+class btDefracBodyCache
+{
+private:
+	std::string m_directory;
+
+public:
+	btDefracBodyCache(const std::string& directory) : m_directory(directory) {}
+
+	const std::string& getDirectory() const { return m_directory; }
+
+	static unsigned long long computeKey(const btAlignedObjectArray<btVector3>& nodePosition, 
+		const btAlignedObjectArray<int>& indices, int flags);
+
+	std::string getFilename(unsigned long long key) const;
+
+	//maps the entry for key, if it exists, matches the mesh size and its orders and pattern are consistent
+	bool open(unsigned long long key, int numNodes, int numTetrahedrons, btDefracBodyCacheFile& file) const;
+
+	//writes the entry for key. The matrices are per tetrahedron, in their final order
+	bool store(unsigned long long key, const btAlignedObjectArray<int>& nodeOrder, 
+		const btAlignedObjectArray<int>& tetrahedronOrder, const btSparsityPattern& pattern, 
+		const btAlignedObjectArray<btMatrix3x3>& basisMatrices, 
+		const btAlignedObjectArray<btMatrix3x3_12x12>& stiffnessMatrices) const;
+};
+
+#endif
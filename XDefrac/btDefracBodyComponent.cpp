@@ -1,17 +1,38 @@
 
 #include "btDefracBodyComponent.h"
 #include "btDefracUtils.h"
-#include <boost/timer.hpp>
+#include "btMaterial.h"
+#include "BulletDynamics/Dynamics/btRigidBody.h"//gDeactivationTime, gDisableDeactivation
 
 
 btDefracBodyComponent::btDefracBodyComponent(const btAlignedObjectArray<btNode*>& nodes, 
 											 const btAlignedObjectArray<btTetrahedron*>& tetrahedrons, 
-											 const btAlignedObjectArray<int>& indices):
+											 const btAlignedObjectArray<int>& indices,
+											 const btSparsityPattern* pattern,
+											 const btAlignedObjectArray<int>* surfaceIndices):
 	m_K1(NULL),
 	m_K2(NULL),
-    m_invMassVector(nodes.size())
+    m_invMassVector(nodes.size()),
+	m_stepsSinceAssembly(0),
+	m_stiffnessChanged(true),
+	m_K0(NULL),
+	m_warped(false),
+	m_forceApplied(false),
+	m_kineticEnergy(0),
+	m_residual(0),
+	m_kineticEnergySleepingThreshold(btScalar(0.001)),
+	m_residualSleepingThreshold(btScalar(1.)),
+	m_solverPriority(1),
+	m_selfCollision(false),
+	m_selfCollisionMargin(btScalar(0.05))
 {
+	m_solverStatus.m_iterations = 0;
+	m_solverStatus.m_initialResidual = 0;
+	m_solverStatus.m_residual = 0;
+	m_solverStatus.m_converged = true;
+
 	btCollisionObject::m_internalType = CO_USER_TYPE;
+	m_collisionFlags &= ~CF_STATIC_OBJECT;//it takes part in simulation islands, which put it to sleep
 	m_collisionShape = new btDefracCollisionShape(this);
 	m_collisionShape->setMargin(0.25);
 
@@ -20,7 +41,13 @@ btDefracBodyComponent::btDefracBodyComponent(const btAlignedObjectArray<btNode*>
 	//copy each array
 	m_nodes.reserve(nodes.size());
 	for(int i=0; i<nodes.size(); ++i)
+	{
 		m_nodes.push_back(nodes[i]);
+		nodes[i]->setForceFlag(&m_forceApplied);
+
+		if(!nodes[i]->getForce().isZero())
+			m_forceApplied = true;
+	}
 
 	m_tetrahedrons.reserve(tetrahedrons.size());
 	for(int i=0; i<tetrahedrons.size(); ++i)
@@ -30,32 +57,160 @@ btDefracBodyComponent::btDefracBodyComponent(const btAlignedObjectArray<btNode*>
 	for(int i=0; i<indices.size(); ++i)
 		m_indices.push_back(indices[i]);
 
-    std::set<btMatrixIndex> matrixIndices;
-    
-    for (int t=0; t<m_tetrahedrons.size(); ++t) {
-        for (int i=0; i<4; ++i) {
-            int ii = m_indices[t*4 + i];
-            for (int j=0; j<4; ++j) {
-                int jj = m_indices[t*4 + j];
-                btMatrixIndex mi = {ii, jj};
-                matrixIndices.insert(mi);
-            }
-        }
+	m_rotations.resize(m_tetrahedrons.size());
+	m_assembledRotations.resize(m_tetrahedrons.size());
+
+    if (pattern == NULL) {
+        btSparsityPattern localPattern;
+        localPattern.buildFromTetrahedrons(m_nodes.size(), &m_indices[0], m_tetrahedrons.size());
+        m_K1 = new btSparseMatrix(localPattern);
+        m_K2 = new btSparseMatrix(localPattern);
+    }
+    else {
+        m_K1 = new btSparseMatrix(*pattern, true);
+        m_K2 = new btSparseMatrix(*pattern, true);
     }
-    
-    m_K1 = new btSparseMatrix(m_nodes.size(), matrixIndices);
-    m_K2 = new btSparseMatrix(m_nodes.size(), matrixIndices);
     
 	//const int kSize = 3*m_nodes.size();
 	//m_RKR_1.resize(kSize, kSize, 0);
 	//m_RK.resize(kSize, kSize, 0);
 	assembleMassVector();
+
+	if(surfaceIndices != NULL)
+		setSurfaceTriangles(*surfaceIndices);
+	else
+		extractSurfaceTriangles();
 }
 
 btDefracBodyComponent::~btDefracBodyComponent()
 {
+	for(int i=0; i<m_nodes.size(); ++i)
+		if(m_nodes[i]->getForceFlag() == &m_forceApplied)
+			m_nodes[i]->setForceFlag(NULL);
+
+    delete m_K0;
     delete m_K1;
     delete m_K2;
+    delete m_collisionShape;
+}
+
+void btDefracBodyComponent::setSurfaceTriangles(const btAlignedObjectArray<int>& indices)
+{
+	btAssert(indices.size()%3 == 0);
+	m_surfaceIndices.resize(indices.size());
+
+	for(int i=0; i<indices.size(); ++i)
+		m_surfaceIndices[i] = indices[i];
+
+	//a closed surface wound clockwise seen from outside, like Tetgen's .face files, has a negative volume
+	btScalar volume = 0;
+
+	for(int i=0; i<m_surfaceIndices.size(); i+=3)
+	{
+		const btVector3& p0 = m_nodes[m_surfaceIndices[i+0]]->getPosition0();
+		const btVector3& p1 = m_nodes[m_surfaceIndices[i+1]]->getPosition0();
+		const btVector3& p2 = m_nodes[m_surfaceIndices[i+2]]->getPosition0();
+		volume += p0.dot(p1.cross(p2));
+	}
+
+	if(volume < 0)
+		for(int i=0; i<m_surfaceIndices.size(); i+=3)
+			btSwap(m_surfaceIndices[i+1], m_surfaceIndices[i+2]);
+
+	surfaceChanged();
+}
+
+//a tetrahedron face, with its node indices sorted to match it with the same face of a neighbor
+struct btDefracFace
+{
+	int m_key[3];
+	int m_nodes[3];//in the order that makes its normal point away from the tetrahedron
+};
+
+struct btDefracFaceLess
+{
+	bool operator () (const btDefracFace& a, const btDefracFace& b) const
+	{
+		if(a.m_key[0] != b.m_key[0])
+			return a.m_key[0] < b.m_key[0];
+
+		if(a.m_key[1] != b.m_key[1])
+			return a.m_key[1] < b.m_key[1];
+
+		return a.m_key[2] < b.m_key[2];
+	}
+};
+
+void btDefracBodyComponent::extractSurfaceTriangles()
+{
+	//the faces of tetrahedron (a, b, c, d), each followed by the node opposite to it
+	static const int faceNodes[4][4] = {{1, 2, 3, 0}, {0, 3, 2, 1}, {0, 1, 3, 2}, {0, 2, 1, 3}};
+	btAlignedObjectArray<btDefracFace> faces;
+	faces.resize(m_tetrahedrons.size()*4);
+
+	for(int t=0; t<m_tetrahedrons.size(); ++t)
+	{
+		for(int f=0; f<4; ++f)
+		{
+			btDefracFace& face = faces[t*4 + f];
+			int* n = face.m_nodes;
+			n[0] = m_indices[t*4 + faceNodes[f][0]];
+			n[1] = m_indices[t*4 + faceNodes[f][1]];
+			n[2] = m_indices[t*4 + faceNodes[f][2]];
+
+			const btVector3& p0 = m_nodes[n[0]]->getPosition0();
+			const btVector3 normal = (m_nodes[n[1]]->getPosition0() - p0).cross(m_nodes[n[2]]->getPosition0() - p0);
+
+			if(normal.dot(m_nodes[m_indices[t*4 + faceNodes[f][3]]]->getPosition0() - p0) > 0)
+				btSwap(n[1], n[2]);
+
+			face.m_key[0] = btMin(n[0], btMin(n[1], n[2]));
+			face.m_key[2] = btMax(n[0], btMax(n[1], n[2]));
+			face.m_key[1] = n[0] + n[1] + n[2] - face.m_key[0] - face.m_key[2];
+		}
+	}
+
+	faces.quickSort(btDefracFaceLess());
+
+	//after sorting, the faces shared by two tetrahedrons come in pairs of equal keys
+	btDefracFaceLess less;
+	m_surfaceIndices.resize(0);
+
+	for(int i=0; i<faces.size(); )
+	{
+		int j = i+1;
+
+		while(j < faces.size() && !less(faces[i], faces[j]))
+			++j;
+
+		if(j == i+1)
+		{
+			m_surfaceIndices.push_back(faces[i].m_nodes[0]);
+			m_surfaceIndices.push_back(faces[i].m_nodes[1]);
+			m_surfaceIndices.push_back(faces[i].m_nodes[2]);
+		}
+
+		i = j;
+	}
+
+	surfaceChanged();
+}
+
+void btDefracBodyComponent::surfaceChanged()
+{
+	btAlignedObjectArray<bool> onSurface;
+	onSurface.resize(m_nodes.size(), false);
+
+	for(int i=0; i<m_surfaceIndices.size(); ++i)
+		onSurface[m_surfaceIndices[i]] = true;
+
+	m_surfaceNodes.resize(0);
+
+	for(int i=0; i<m_nodes.size(); ++i)
+		if(onSurface[i])
+			m_surfaceNodes.push_back(i);
+
+	static_cast<btDefracCollisionShape*>(m_collisionShape)->buildBvh();
 }
 
 btVector3n btDefracBodyComponent::getPositionVector()
@@ -107,6 +262,283 @@ btVector3n btDefracBodyComponent::getForceVector()
 	return r;
 }
 
+void btDefracBodyComponent::computeRotationsGramSchmidt()
+{
+	for(int t=0; t<m_tetrahedrons.size(); ++t)
+		m_rotations[t] = m_tetrahedrons[t]->getRotation();
+}
+
+void btDefracBodyComponent::computeRotationsPolar(int iterations)
+{
+	//the first call starts from the Gram-Schmidt rotations, which are exact for undeformed tetrahedrons
+	if(m_rotationStates.size() != m_tetrahedrons.size())
+	{
+		m_rotationStates.resize(m_tetrahedrons.size());
+
+		for(int t=0; t<m_tetrahedrons.size(); ++t)
+			m_tetrahedrons[t]->getRotation().getRotation(m_rotationStates[t]);
+	}
+
+	if(m_tetrahedrons.size() == 0)
+		return;
+
+	//m_rotations holds the deformation gradients while they are needed
+	for(int t=0; t<m_tetrahedrons.size(); ++t)
+		m_rotations[t] = m_tetrahedrons[t]->getDeformationGradient();
+
+	btDefracUtils::ExtractRotations(&m_rotations[0], &m_rotationStates[0], m_tetrahedrons.size(), iterations);
+
+	for(int t=0; t<m_tetrahedrons.size(); ++t)
+		m_rotations[t].setRotation(m_rotationStates[t]);
+}
+
+int btDefracBodyComponent::updateStiffnessMatrices(btScalar rotationTolerance, int fullAssemblyInterval)
+{
+	checkStiffnessRevisions();
+
+	if(m_stiffnessChanged || m_warped || (fullAssemblyInterval > 0 && m_stepsSinceAssembly >= fullAssemblyInterval))
+	{
+		m_K1->setZero();
+		m_K2->setZero();
+
+		for(int t=0; t<m_tetrahedrons.size(); ++t)
+		{
+			m_assembledRotations[t] = m_rotations[t];
+			accumulateStiffness(t, m_rotations[t], NULL);
+		}
+
+		recordStiffnessRevisions();
+		m_stepsSinceAssembly = 0;
+		m_stiffnessChanged = false;
+		m_warped = false;
+		return m_tetrahedrons.size();
+	}
+
+	//if R' is R rotated by an angle a then the squared Frobenius norm of R' - R is 8*sin(a/2)^2, which
+	//unlike the trace of R'*R^T keeps its precision for small angles
+	const btScalar s = btSin(rotationTolerance/2);
+	const btScalar maxDistance2 = 8*s*s;
+	int numAccumulated = 0;
+
+	for(int t=0; t<m_tetrahedrons.size(); ++t)
+	{
+		const btMatrix3x3& r = m_rotations[t];
+		const btMatrix3x3& previous = m_assembledRotations[t];
+		const btScalar distance2 = (r[0] - previous[0]).length2() + (r[1] - previous[1]).length2() +
+			(r[2] - previous[2]).length2();
+
+		if(distance2 > maxDistance2)
+		{
+			accumulateStiffness(t, r, &previous);
+			m_assembledRotations[t] = r;
+			++numAccumulated;
+		}
+	}
+
+	++m_stepsSinceAssembly;
+	return numAccumulated;
+}
+
+void btDefracBodyComponent::stiffnessChanged()
+{
+	m_stiffnessChanged = true;
+	delete m_K0;
+	m_K0 = NULL;
+}
+
+void btDefracBodyComponent::checkStiffnessRevisions()
+{
+	if(m_assembledRevisions.size() != m_tetrahedrons.size())
+	{
+		stiffnessChanged();
+		return;
+	}
+
+	for(int t=0; t<m_tetrahedrons.size(); ++t)
+	{
+		const btTetrahedron* pt = m_tetrahedrons[t];
+
+		if(pt->getRevision() != m_assembledRevisions[t] || pt->getMaterial()->getRevision() != m_assembledMaterialRevisions[t])
+		{
+			stiffnessChanged();
+			return;
+		}
+	}
+}
+
+void btDefracBodyComponent::recordStiffnessRevisions()
+{
+	m_assembledRevisions.resize(m_tetrahedrons.size());
+	m_assembledMaterialRevisions.resize(m_tetrahedrons.size());
+
+	for(int t=0; t<m_tetrahedrons.size(); ++t)
+	{
+		m_assembledRevisions[t] = m_tetrahedrons[t]->getRevision();
+		m_assembledMaterialRevisions[t] = m_tetrahedrons[t]->getMaterial()->getRevision();
+	}
+}
+
+//sets m_nodeRotations to the deformation gradient F of each node that maps the rest edges d0 to its
+//neighbors to the current ones d in the least squares sense, F = sum(d*d0^T)*inverse(sum(d0*d0^T))
+void btDefracBodyComponent::computeNodeDeformationGradients()
+{
+	const int* rows = m_K1->getRowIndices();
+	const int* columns = m_K1->getColumnIndices();
+
+	if(m_nodeRestInverse.size() != m_nodes.size())
+	{
+		m_nodeRestInverse.resize(m_nodes.size());
+		m_nodeRotations.resize(m_nodes.size());
+
+		for(int i=0; i<m_nodes.size(); ++i)
+		{
+			btMatrix3x3 Q(0,0,0,0,0,0,0,0,0);
+
+			for(int k=rows[i]; k<rows[i+1]; ++k)
+			{
+				const btVector3 d0 = m_nodes[columns[k]]->getPosition0() - m_nodes[i]->getPosition0();
+				Q[0] += d0*d0.x();
+				Q[1] += d0*d0.y();
+				Q[2] += d0*d0.z();
+			}
+
+			m_nodeRestInverse[i] = Q.inverse();
+		}
+	}
+
+	#pragma omp parallel for schedule(static)
+	for(int i=0; i<m_nodes.size(); ++i)
+	{
+		btMatrix3x3 A(0,0,0,0,0,0,0,0,0);
+		const btVector3& x = m_nodes[i]->getPosition();
+		const btVector3& x0 = m_nodes[i]->getPosition0();
+
+		for(int k=rows[i]; k<rows[i+1]; ++k)
+		{
+			const btNode* n = m_nodes[columns[k]];
+			const btVector3 d = n->getPosition() - x;
+			const btVector3 d0 = n->getPosition0() - x0;
+			A[0] += d0*d.x();
+			A[1] += d0*d.y();
+			A[2] += d0*d.z();
+		}
+
+		m_nodeRotations[i] = A*m_nodeRestInverse[i];
+	}
+}
+
+void btDefracBodyComponent::computeNodeRotationsGramSchmidt()
+{
+	computeNodeDeformationGradients();
+
+	for(int i=0; i<m_nodes.size(); ++i)
+		m_nodeRotations[i] = btDefracUtils::OrthonormalizeColumns(m_nodeRotations[i]);
+}
+
+void btDefracBodyComponent::computeNodeRotationsPolar(int iterations)
+{
+	computeNodeDeformationGradients();
+
+	if(m_nodes.size() == 0)
+		return;
+
+	if(m_nodeRotationStates.size() != m_nodes.size())
+	{
+		m_nodeRotationStates.resize(m_nodes.size());
+
+		for(int i=0; i<m_nodes.size(); ++i)
+			btDefracUtils::OrthonormalizeColumns(m_nodeRotations[i]).getRotation(m_nodeRotationStates[i]);
+	}
+
+	btDefracUtils::ExtractRotations(&m_nodeRotations[0], &m_nodeRotationStates[0], m_nodes.size(), iterations);
+
+	for(int i=0; i<m_nodes.size(); ++i)
+		m_nodeRotations[i].setRotation(m_nodeRotationStates[i]);
+}
+
+int btDefracBodyComponent::warpStiffnessMatrices(btScalar rotationTolerance)
+{
+	checkStiffnessRevisions();
+
+	if(m_K0 == NULL)
+	{
+		//K1 = K2 = K0 when every rotation is the identity
+		m_K1->setZero();
+		m_K2->setZero();
+
+		for(int t=0; t<m_tetrahedrons.size(); ++t)
+			accumulateStiffness(t, btMatrix3x3::getIdentity(), NULL);
+
+		m_K0 = new btSparseMatrix(*m_K1);
+		recordStiffnessRevisions();
+		m_stiffnessChanged = false;
+		m_warped = false;
+	}
+
+	const bool all = !m_warped;
+	m_warpedRotations.resize(m_nodes.size());
+	m_warped = true;
+
+	const int* rows = m_K0->getRowIndices();
+	const btMatrix3x3* k0 = m_K0->getElements();
+	btMatrix3x3* k1 = m_K1->getElements();
+	btMatrix3x3* k2 = m_K2->getElements();
+	const btScalar s = btSin(rotationTolerance/2);
+	const btScalar maxDistance2 = 8*s*s;//see updateStiffnessMatrices
+	int numWarped = 0;
+
+	#pragma omp parallel for schedule(static) reduction(+:numWarped)
+	for(int i=0; i<m_nodes.size(); ++i)
+	{
+		const btMatrix3x3& r = m_nodeRotations[i];
+		const btMatrix3x3& previous = m_warpedRotations[i];
+
+		if(!all && (r[0] - previous[0]).length2() + (r[1] - previous[1]).length2() +
+			(r[2] - previous[2]).length2() <= maxDistance2)
+			continue;
+
+		for(int k=rows[i]; k<rows[i+1]; ++k)
+		{
+			k2[k] = r*k0[k];
+			k1[k] = k2[k].timesTranspose(r);
+		}
+
+		m_warpedRotations[i] = r;
+		++numWarped;
+	}
+
+	return numWarped;
+}
+
+//adds the terms of tetrahedron t rotated by r to K1 and K2, minus its terms rotated by previous if given
+void btDefracBodyComponent::accumulateStiffness(int t, const btMatrix3x3& r, const btMatrix3x3* previous)
+{
+	const btTetrahedron* pt = m_tetrahedrons[t];
+
+	for(int i=0; i<4; ++i)
+	{
+		int ii = m_indices[t*4 + i];
+
+		for(int j=0; j<4; ++j)
+		{
+			int jj = m_indices[t*4 + j];
+			const btMatrix3x3 kij = pt->getStiffnessBlock(i*4 + j);
+			btMatrix3x3 k2ij = r * kij;
+			btMatrix3x3 k1ij = k2ij.timesTranspose(r);
+
+			if(previous != NULL)
+			{
+				const btMatrix3x3 p2ij = (*previous) * kij;
+				k1ij -= p2ij.timesTranspose(*previous);
+				k2ij -= p2ij;
+			}
+
+			(*m_K1)(ii, jj) += k1ij;
+			(*m_K2)(ii, jj) += k2ij;
+		}
+	}
+}
+
 void btDefracBodyComponent::assembleMassVector()
 {
 	for(int i=0; i<m_nodes.size(); ++i)
@@ -128,7 +560,162 @@ void btDefracBodyComponent::applyAcceleration(const btVector3 &acc)
 }
 void btDefracBodyComponent::zeroOutForces()
 {
+	if(!m_forceApplied)
+		return;
+
 	for(int i=0; i<m_nodes.size(); ++i)
 		m_nodes[i]->setForce(btVector3(0,0,0));
+
+	m_forceApplied = false;
+}
+
+void btDefracBodyComponent::updateDeactivation(btScalar timeStep)
+{
+	if((getActivationState() == ISLAND_SLEEPING) || (getActivationState() == DISABLE_DEACTIVATION))
+		return;
+
+	if(m_kineticEnergy < m_kineticEnergySleepingThreshold && m_residual < m_residualSleepingThreshold)
+	{
+		m_deactivationTime += timeStep;
+	}
+	else
+	{
+		m_deactivationTime = btScalar(0.);
+		setActivationState(ACTIVE_TAG);
+	}
 }
 
+bool btDefracBodyComponent::wantsSleeping() const
+{
+	if(getActivationState() == DISABLE_DEACTIVATION)
+		return false;
+
+	if(gDisableDeactivation || (gDeactivationTime == btScalar(0.)))
+		return false;
+
+	if((getActivationState() == ISLAND_SLEEPING) || (getActivationState() == WANTS_DEACTIVATION))
+		return true;
+
+	return m_deactivationTime > gDeactivationTime;
+}
+
+
+void btDefracCollisionShape::buildBvh()
+{
+	m_bvh.clear();
+	m_leaves.resize(m_body->getSurfaceTriangleCount());
+	m_refitOrder.resize(0);
+
+	for(int t=0; t<m_body->getSurfaceTriangleCount(); ++t)
+	{
+		btDbvtNode* leaf = m_bvh.insert(getTriangleVolume(t), 0);
+		leaf->dataAsInt = t;
+		m_leaves[t] = leaf;
+	}
+
+	//optimizeTopDown rebuilds the internal nodes only, the leaves stay
+	m_bvh.optimizeTopDown();
+
+	//in breadth first order every parent comes before its children, so refitBvh goes through it backwards
+	if(m_bvh.m_root != NULL && m_bvh.m_root->isinternal())
+		m_refitOrder.push_back(m_bvh.m_root);
+
+	for(int i=0; i<m_refitOrder.size(); ++i)
+	{
+		btDbvtNode* node = m_refitOrder[i];
+
+		for(int k=0; k<2; ++k)
+			if(node->childs[k]->isinternal())
+				m_refitOrder.push_back(node->childs[k]);
+	}
+
+	updateAabb();
+}
+
+void btDefracCollisionShape::refitBvh()
+{
+	//the leaves are independent, then each parent waits for its children
+	#pragma omp parallel for schedule(static)
+	for(int t=0; t<m_leaves.size(); ++t)
+		m_leaves[t]->volume = getTriangleVolume(t);
+
+	for(int i=m_refitOrder.size()-1; i>=0; --i)
+	{
+		btDbvtNode* node = m_refitOrder[i];
+		Merge(node->childs[0]->volume, node->childs[1]->volume, node->volume);
+	}
+
+	updateAabb();
+}
+
+btDbvtVolume btDefracCollisionShape::getTriangleVolume(int t) const
+{
+	btVector3 triangle[3];
+
+	for(int k=0; k<3; ++k)
+		triangle[k] = m_body->getNode(m_body->getSurfaceNodeIndex(t*3 + k))->getPosition();
+
+	btDbvtVolume volume = btDbvtVolume::FromPoints(triangle, 3);
+	volume.Expand(btVector3(getMargin(), getMargin(), getMargin()));
+	return volume;
+}
+
+void btDefracCollisionShape::updateAabb()
+{
+	if(m_bvh.m_root != NULL)
+	{
+		m_aabbMin = m_bvh.m_root->volume.Mins();
+		m_aabbMax = m_bvh.m_root->volume.Maxs();
+		return;
+	}
+
+	//no surface, so bound the nodes. Any component with a tetrahedron has surface triangles, so this only
+	//runs for empty or hand-built components and is left serial
+	m_aabbMin.setValue(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+	m_aabbMax = -m_aabbMin;
+
+	for(int i=0; i<m_body->getNodeCount(); ++i)
+	{
+		m_aabbMin.setMin(m_body->getNode(i)->getPosition());
+		m_aabbMax.setMax(m_body->getNode(i)->getPosition());
+	}
+
+	m_aabbMin -= btVector3(getMargin(), getMargin(), getMargin());
+	m_aabbMax += btVector3(getMargin(), getMargin(), getMargin());
+}
+
+struct btDefracTriangleCollider : public btDbvt::ICollide
+{
+	const btDefracBodyComponent* m_body;
+	btTriangleCallback* m_callback;
+
+	btDefracTriangleCollider(const btDefracBodyComponent* body, btTriangleCallback* callback):
+		m_body(body),
+		m_callback(callback)
+	{}
+
+	void Process(const btDbvtNode* leaf)
+	{
+		const int t = leaf->dataAsInt;
+		btVector3 triangle[3];
+
+		for(int k=0; k<3; ++k)
+			triangle[k] = m_body->getNode(m_body->getSurfaceNodeIndex(t*3 + k))->getPosition();
+
+		m_callback->processTriangle(triangle, 0, t);
+	}
+};
+
+void btDefracCollisionShape::processAllTriangles(btTriangleCallback* callback, const btVector3& aabbMin, const btVector3& aabbMax) const
+{
+	if(m_bvh.m_root == NULL)
+		return;
+
+	btDefracTriangleCollider collider(m_body, callback);
+	m_bvh.collideTV(m_bvh.m_root, btDbvtVolume::FromMM(aabbMin, aabbMax), collider);
+}
+
+void btDefracCollisionShape::collideTT(const btDefracCollisionShape& other, btDbvt::ICollide& policy) const
+{
+	m_bvh.collideTTpersistentStack(m_bvh.m_root, other.m_bvh.m_root, policy);
+}
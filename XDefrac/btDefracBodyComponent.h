@@ -4,6 +4,8 @@
 
 #include "BulletCollision/CollisionDispatch/btCollisionObject.h"
 #include "BulletCollision/CollisionShapes/btConcaveShape.h"
+#include "BulletCollision/BroadphaseCollision/btDbvt.h"
+#include "LinearMath/btAabbUtil2.h"
 
 #include "btElement.h"
 #include "LinearMath/btPoolAllocator.h"
@@ -12,6 +14,16 @@
 
 
 class btMaterial;
+class btSparsityPattern;
+
+//how far the CG solve of a component got in the last step
+struct btDefracSolverStatus
+{
+	int m_iterations;
+	btScalar m_initialResidual;
+	btScalar m_residual;
+	bool m_converged;
+};
 
 //A btDefracBodyComponent contains a set of nodes and tetrahedrons where, considering that two tetrahedrons
 //are adjacent iff they share a btNode, its adjacency graph is a connected graph
@@ -21,22 +33,53 @@ private:
 	btAlignedObjectArray<btNode*> m_nodes;
 	btAlignedObjectArray<btTetrahedron*> m_tetrahedrons;
 	btAlignedObjectArray<int> m_indices;
+	btAlignedObjectArray<int> m_surfaceIndices;//3 node indices per surface triangle
+	btAlignedObjectArray<int> m_surfaceNodes;//each node of the surface triangles once, in increasing order
     btSparseMatrix* m_K1;//assembled co-rotated stiffness
 	btSparseMatrix* m_K2;//like the one above
     std::vector<btScalar> m_invMassVector;
+	btAlignedObjectArray<btMatrix3x3> m_rotations;//current rotation of each tetrahedron
+	btAlignedObjectArray<btQuaternion> m_rotationStates;//the same, kept by computeRotationsPolar to warm start it
+	btAlignedObjectArray<btMatrix3x3> m_assembledRotations;//rotation of each tetrahedron in the assembled K1 and K2
+	int m_stepsSinceAssembly;//number of updates since K1 and K2 were last assembled from scratch
+	bool m_stiffnessChanged;
+	btAlignedObjectArray<unsigned int> m_assembledRevisions;//revision of each tetrahedron when K1 and K2, or K0, were last assembled from scratch
+	btAlignedObjectArray<unsigned int> m_assembledMaterialRevisions;//the same for the material of each tetrahedron
+	btSparseMatrix* m_K0;//rest stiffness, the sum of k over every tetrahedron, built when first warped and rebuilt when a revision changes
+	btAlignedObjectArray<btMatrix3x3> m_nodeRotations;//current rotation of each node
+	btAlignedObjectArray<btQuaternion> m_nodeRotationStates;//the same, kept by computeNodeRotationsPolar to warm start it
+	btAlignedObjectArray<btMatrix3x3> m_nodeRestInverse;//inverse of the sum of d0*d0^T over the edges d0 to its neighbors
+	btAlignedObjectArray<btMatrix3x3> m_warpedRotations;//rotation of each node in the warped K1 and K2
+	bool m_warped;//whether K1 and K2 were last updated by warpStiffnessMatrices
+	bool m_forceApplied;//whether a force was applied to any of its nodes since the last zeroOutForces, set through their force flag
+	btScalar m_kineticEnergy;//kinetic energy per unit mass after the last step
+	btScalar m_residual;//rms acceleration of the free nodes due to the net force in the last step
+	btScalar m_kineticEnergySleepingThreshold;
+	btScalar m_residualSleepingThreshold;
+	btDefracSolverStatus m_solverStatus;
+	btScalar m_solverPriority;
+	bool m_selfCollision;
+	btScalar m_selfCollisionMargin;
 	void assembleMassVector();
+	void accumulateStiffness(int t, const btMatrix3x3& r, const btMatrix3x3* previous);
+	void checkStiffnessRevisions();//calls stiffnessChanged if a tetrahedron or its material changed since the revisions were recorded
+	void recordStiffnessRevisions();
+	void computeNodeDeformationGradients();
+	void surfaceChanged();
 
 public:
 	btDefracBodyComponent(const btAlignedObjectArray<btNode*>& nodes, 
 		const btAlignedObjectArray<btTetrahedron*>& tetrahedrons, 
-		const btAlignedObjectArray<int>& indices);//build from lists of nodes and indices
+		const btAlignedObjectArray<int>& indices, const btSparsityPattern* pattern=NULL,
+		const btAlignedObjectArray<int>* surfaceIndices=NULL);//build from lists of nodes and indices. The stiffness matrices refer to the structure in pattern, which must outlive the component; it is computed if not given. So is the surface if surfaceIndices is not given
 	~btDefracBodyComponent();
 
 	void reset();
 	
 	void applyForce(const btVector3& force);
 	void applyAcceleration(const btVector3& acc);
-	void zeroOutForces();
+	void zeroOutForces();//does nothing if no force was applied since the last call
+	bool wasForceApplied() const { return m_forceApplied; }//true if a force was applied to any node since the last zeroOutForces
 
 	void setNodeVelocity(int i, const btVector3& v)
 	{
@@ -68,6 +111,90 @@ public:
         m_invMassVector[i] = m_nodes[i]->getInvMass();
 	}
 
+	//The component comes to rest like a btRigidBody, when both measures below stay under their
+	//thresholds for gDeactivationTime seconds. The world sets them after integrating each step
+	void setMotionMeasures(btScalar kineticEnergy, btScalar residual)
+	{
+		m_kineticEnergy = kineticEnergy;
+		m_residual = residual;
+	}
+
+	btScalar getKineticEnergy() const { return m_kineticEnergy; }
+	btScalar getResidual() const { return m_residual; }
+
+	void setSleepingThresholds(btScalar kineticEnergy, btScalar residual)
+	{
+		m_kineticEnergySleepingThreshold = kineticEnergy;
+		m_residualSleepingThreshold = residual;
+	}
+
+	btScalar getKineticEnergySleepingThreshold() const { return m_kineticEnergySleepingThreshold; }
+	btScalar getResidualSleepingThreshold() const { return m_residualSleepingThreshold; }
+
+	void updateDeactivation(btScalar timeStep);
+	bool wantsSleeping() const;
+
+	//compute the current rotation of each tetrahedron, either by Gram-Schmidt like
+	//btTetrahedron::getRotation, or by the iterative polar decomposition of btDefracUtils::ExtractRotations
+	//warm started with the rotations of the last call
+	void computeRotationsGramSchmidt();
+	void computeRotationsPolar(int iterations);
+	const btMatrix3x3& getRotation(int tetrahedron) const { return m_rotations[tetrahedron]; }
+
+	//Brings K1 = sum of R*k*R^T and K2 = sum of R*k up to date with the rotation R of each tetrahedron
+	//given by the last computeRotations call. Only the tetrahedrons that rotated more than rotationTolerance radians since their
+	//rotation was last accumulated are updated, by adding the difference of their terms, so a mesh at
+	//rest costs nothing but computing the rotations. K1 and K2 are assembled from scratch every
+	//fullAssemblyInterval updates (never if it is 0) to discard the rounding error of the differences,
+	//and whenever the revision of a tetrahedron or of its material changed since the last assembly, since
+	//the differences assume the stiffness of each term did not. Returns the number of tetrahedrons accumulated
+	int updateStiffnessMatrices(btScalar rotationTolerance, int fullAssemblyInterval);
+
+	//Stiffness warping, the alternative to updateStiffnessMatrices with one rotation per node instead
+	//of one per tetrahedron. The rotation of a node is that of the least squares deformation gradient of
+	//the edges to its neighbors in K1, the ones it shares a tetrahedron with, so there are as many
+	//extractions as nodes. The compute methods work like the ones for tetrahedrons above
+	void computeNodeRotationsGramSchmidt();
+	void computeNodeRotationsPolar(int iterations);
+	const btMatrix3x3& getNodeRotation(int node) const { return m_nodeRotations[node]; }
+
+	//Sets K1(i,j) = Ri*K0(i,j)*Ri^T and K2(i,j) = Ri*K0(i,j), where Ri is the rotation of node i and K0
+	//the rest stiffness, assembled once and again whenever the revision of a tetrahedron or of its material
+	//changes, which warps every row. Rows whose node rotated less than rotationTolerance radians
+	//since they were last warped are left as they are. Returns the number of rows warped
+	int warpStiffnessMatrices(btScalar rotationTolerance);
+
+	//makes the next update assemble K1 and K2 from scratch. Changes to the materials, stiffness scales or
+	//rest positions of its tetrahedrons are detected through their revisions and need not call it
+	void stiffnessChanged();
+
+	//The boundary triangles of the component, which its collision shape is made of, wound counter-clockwise
+	//seen from outside. Either given with 3 node indices each, e.g. from a .face file, and all flipped if
+	//they enclose a negative volume at rest, or extracted as the tetrahedron faces that are not shared by
+	//another tetrahedron. Both rebuild the bounding volume hierarchy
+	void setSurfaceTriangles(const btAlignedObjectArray<int>& indices);
+	void extractSurfaceTriangles();
+	int getSurfaceTriangleCount() const { return m_surfaceIndices.size()/3; }
+	int getSurfaceNodeIndex(int index) const { return m_surfaceIndices[index]; }//index of the (index%3)-th node of triangle index/3
+	int getSurfaceNodeCount() const { return m_surfaceNodes.size(); }
+	int getSurfaceNode(int index) const { return m_surfaceNodes[index]; }
+
+	const btDefracSolverStatus& getSolverStatus() const { return m_solverStatus; }
+	void setSolverStatus(const btDefracSolverStatus& status) { m_solverStatus = status; }
+
+	//weight of this component's solve in the time budget of the world, 1 by default
+	btScalar getSolverPriority() const { return m_solverPriority; }
+	void setSolverPriority(btScalar priority) { m_solverPriority = priority; }
+
+	//With self-collision, off by default, the world keeps the surface nodes of the component at least the
+	//self-collision margin away from its surface triangles, except from those with a node that shares a
+	//tetrahedron with it. The margin is smaller than the one of the collision shape, since nodes closer
+	//than it to a triangle at rest collide from the start
+	void setSelfCollision(bool enabled) { m_selfCollision = enabled; }
+	bool getSelfCollision() const { return m_selfCollision; }
+	void setSelfCollisionMargin(btScalar margin) { m_selfCollisionMargin = margin; }
+	btScalar getSelfCollisionMargin() const { return m_selfCollisionMargin; }
+
 	const std::vector<btScalar>& getInvMassVector() const { return m_invMassVector; }
 	btSparseMatrix& getK1() { return *m_K1; }
 	btSparseMatrix& getK2() { return *m_K2; }
@@ -103,12 +230,25 @@ public:
 };
 
 
+//The surface triangles of a btDefracBodyComponent in a btDbvt, one leaf per triangle with its index
+//as data. The tree is built once and refit to the deformed surface every step, keeping its topology
 class btDefracCollisionShape : public btConcaveShape
 {
+	mutable btDbvt m_bvh;//mutable since btDbvt::collideTV is not const, though it does not modify the tree
+	btAlignedObjectArray<btDbvtNode*> m_leaves;//the leaf of each triangle
+	btAlignedObjectArray<btDbvtNode*> m_refitOrder;//the internal nodes of m_bvh, children before their parent
+	btVector3 m_aabbMin;//bounds of the surface as of the last build or refit, margin included
+	btVector3 m_aabbMax;
+
+	btDbvtVolume getTriangleVolume(int t) const;//bounds of surface triangle t expanded by the margin
+	void updateAabb();
+
 public:
 	btDefracBodyComponent* m_body;
 
-	btDefracCollisionShape(btDefracBodyComponent* body)
+	btDefracCollisionShape(btDefracBodyComponent* body):
+		m_aabbMin(0, 0, 0),
+		m_aabbMax(0, 0, 0)
 	{
 		m_shapeType = CUSTOM_CONCAVE_SHAPE_TYPE;
 		m_body = body;
@@ -116,26 +256,20 @@ public:
 
 	virtual ~btDefracCollisionShape(){}
 
-	void	processAllTriangles(btTriangleCallback* /*callback*/,const btVector3& /*aabbMin*/,const btVector3& /*aabbMax*/) const
-	{
-		//not yet
-		//btAssert(0);
-	}
+	void buildBvh();//after the surface triangles of m_body change
+	void refitBvh();//recomputes the volumes bottom-up from the current node positions, and the AABB
+	void collideTT(const btDefracCollisionShape& other, btDbvt::ICollide& policy) const;//calls policy.Process(leaf, otherLeaf) for the triangles closer than the sum of the margins
+	const btDbvt& getBvh() const { return m_bvh; }
+
+	//calls callback with the surface triangles whose bounding box overlaps [aabbMin, aabbMax]
+	void	processAllTriangles(btTriangleCallback* callback,const btVector3& aabbMin,const btVector3& aabbMax) const;
 
 	///getAabb returns the axis aligned bounding box in the coordinate frame of the given transform t.
+	///It is the one cached by the last buildBvh or refitBvh, whose leaves are expanded by the margin, so
+	///node positions changed since then are not taken into account
 	virtual void getAabb(const btTransform& t,btVector3& aabbMin,btVector3& aabbMax) const
 	{
-		//const btAlignedObjectArray<btNode>& nodes = m_body->getNodeArray();
-		aabbMin.setValue(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
-		aabbMax = -aabbMin;
-
-		for(int i=0; i<m_body->getNodeCount(); ++i)
-		{
-			const btVector3& p = m_body->getNode(i)->getPosition();
-			btVector3 tp = t.getBasis()*p + t.getOrigin();
-			aabbMin.setMin(tp);
-			aabbMax.setMax(tp);
-		}
+		btTransformAabb(m_aabbMin, m_aabbMax, 0, t, aabbMin, aabbMax);
 	}
 
 
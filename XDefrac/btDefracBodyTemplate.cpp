@@ -0,0 +1,132 @@
+#include "btDefracBodyTemplate.h"
+#include "btDefracBody.h"
+#include "btDefracBodyCache.h"
+#include "btElement.h"
+
+#include <algorithm>
+
+btDefracBodyTemplate::btDefracBodyTemplate(const btAlignedObjectArray<btVector3>& nodePosition, 
+										   const btAlignedObjectArray<int>& indices, btScalar mass, 
+										   btMaterial* material, int flags, btDefracBodyCache* cache):
+	m_flags(flags)
+{
+	btAssert(indices.size()%4 == 0);//4 indices(nodes) for each tetrahedron
+
+	const int numNodes = nodePosition.size();
+	const int numTets = indices.size()/4;
+
+	btDefracBodyCacheFile cached;
+	unsigned long long cacheKey = 0;
+
+	if(cache)
+	{
+		cacheKey = btDefracBodyCache::computeKey(nodePosition, indices, flags);
+		cache->open(cacheKey, numNodes, numTets, cached);
+	}
+
+	if(cached.isOpen())
+	{
+		m_nodeOrder.resize(numNodes);
+		for(int i=0; i<numNodes; ++i)
+			m_nodeOrder[i] = cached.getNodeOrder()[i];
+	}
+	else if((flags & btDefracBody::CF_REORDER_NODES) && numTets > 0)
+	{
+		btSparsityPattern pattern;
+		pattern.buildFromTetrahedrons(numNodes, &indices[0], numTets);
+		btDefracUtils::ReverseCuthillMcKee(pattern, m_nodeOrder);
+	}
+	else
+	{
+		m_nodeOrder.resize(numNodes);
+		for(int i=0; i<numNodes; ++i)
+			m_nodeOrder[i] = i;
+	}
+
+	m_nodeIndexMap.resize(numNodes);
+	for(int i=0; i<numNodes; ++i)
+		m_nodeIndexMap[m_nodeOrder[i]] = i;
+
+	btAlignedObjectArray<int> nodeIndices;
+	nodeIndices.resize(indices.size());
+	for(int i=0; i<indices.size(); ++i)
+		nodeIndices[i] = m_nodeIndexMap[indices[i]];
+
+	if(cached.isOpen())
+	{
+		m_tetrahedronOrder.resize(numTets);
+		for(int i=0; i<numTets; ++i)
+			m_tetrahedronOrder[i] = cached.getTetrahedronOrder()[i];
+	}
+	else if(flags & btDefracBody::CF_SORT_TETRAHEDRONS)
+		btDefracUtils::SortTetrahedronsMorton(nodePosition, indices, m_tetrahedronOrder);
+	else if(flags & btDefracBody::CF_SORT_TETRAHEDRONS_BY_NODE)
+		btDefracUtils::SortTetrahedronsByNode(nodeIndices, m_tetrahedronOrder);
+	else
+	{
+		m_tetrahedronOrder.resize(numTets);
+		for(int i=0; i<numTets; ++i)
+			m_tetrahedronOrder[i] = i;
+	}
+
+	m_tetrahedronIndexMap.resize(numTets);
+	for(int i=0; i<numTets; ++i)
+		m_tetrahedronIndexMap[m_tetrahedronOrder[i]] = i;
+
+	m_indices.resize(indices.size());
+	for(int i=0; i<numTets; ++i)
+		for(int k=0; k<4; ++k)
+			m_indices[i*4+k] = nodeIndices[m_tetrahedronOrder[i]*4+k];
+
+	m_restPositions.resize(numNodes);
+	for(int i=0; i<numNodes; ++i)
+		m_restPositions[i] = nodePosition[m_nodeOrder[i]];
+
+	m_nodeMass = numNodes > 0 ? mass/numNodes : 0;
+
+	m_materials.resize(numTets);
+	for(int i=0; i<numTets; ++i)
+		m_materials[i] = material;
+
+	m_basisMatrices.resize(numTets);
+	m_stiffnessMatrices.resize(numTets);
+
+	if(cached.isOpen())
+	{
+		m_pattern.assign(numNodes, cached.getRowIndices(), cached.getColumnIndices());
+
+		if(numTets > 0)
+		{
+			std::copy(cached.getBasisMatrices(), cached.getBasisMatrices() + numTets, &m_basisMatrices[0]);
+			std::copy(cached.getStiffnessMatrices(), cached.getStiffnessMatrices() + numTets, &m_stiffnessMatrices[0]);
+		}
+	}
+	else
+	{
+		if(numTets > 0)
+			m_pattern.buildFromTetrahedrons(numNodes, &m_indices[0], numTets);
+
+		//element matrices only depend on their own nodes, so they are all computed in one parallel pass
+		#pragma omp parallel for schedule(static)
+		for(int i=0; i<numTets; ++i)
+		{
+			const btVector3 p[] = {m_restPositions[m_indices[i*4+0]], m_restPositions[m_indices[i*4+1]], 
+								   m_restPositions[m_indices[i*4+2]], m_restPositions[m_indices[i*4+3]]};
+
+			btTetrahedron::computeBasisMatrix(p, m_basisMatrices[i]);
+			btTetrahedron::computeStiffnessMatrix(p, m_stiffnessMatrices[i]);
+		}
+
+		if(cache)
+			cache->store(cacheKey, m_nodeOrder, m_tetrahedronOrder, m_pattern, m_basisMatrices, m_stiffnessMatrices);
+	}
+}
+
+void btDefracBodyTemplate::setSurfaceFaces(const btAlignedObjectArray<int>& originalIndices)
+{
+	btAssert(originalIndices.size()%3 == 0);
+	m_faceIndices.resize(originalIndices.size());
+
+	for(int i=0; i<originalIndices.size(); ++i)
+		m_faceIndices[i] = m_nodeIndexMap[originalIndices[i]];
+}
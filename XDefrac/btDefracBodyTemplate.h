@@ -0,0 +1,69 @@
+#ifndef BT_DEFRAC_BODY_TEMPLATE_H
+#define BT_DEFRAC_BODY_TEMPLATE_H
+
+#include "LinearMath/btVector3.h"
+#include "LinearMath/btMatrix3x3.h"
+#include "LinearMath/btAlignedObjectArray.h"
+
+#include "btDefracUtils.h"
+#include "btSparsityPattern.h"
+
+
+class btMaterial;
+class btDefracBodyCache;
+
+//The rest state of a deformable body: node rest positions and masses, tetrahedrons, element basis and
+//stiffness matrices, the stiffness sparsity pattern and the orderings chosen at creation. None of it
+//changes during simulation, so any number of btDefracBody instances can share one template, much like
+//rigid bodies share a btCollisionShape. A template must outlive the bodies created from it
+class btDefracBodyTemplate
+{
+private:
+	btAlignedObjectArray<btVector3> m_restPositions;//in body order
+	btAlignedObjectArray<int> m_indices;//4 node indices for each tetrahedron, in body order
+	btAlignedObjectArray<btMatrix3x3> m_basisMatrices;//one per tetrahedron
+	btAlignedObjectArray<btMatrix3x3_12x12> m_stiffnessMatrices;//one per tetrahedron, normalized so they do not depend on the material
+	btAlignedObjectArray<btMaterial*> m_materials;//one per tetrahedron
+	btSparsityPattern m_pattern;
+	btAlignedObjectArray<int> m_nodeOrder;//original index of each node
+	btAlignedObjectArray<int> m_nodeIndexMap;//current index of each original node
+	btAlignedObjectArray<int> m_tetrahedronOrder;//original index of each tetrahedron
+	btAlignedObjectArray<int> m_tetrahedronIndexMap;//current index of each original tetrahedron
+	btAlignedObjectArray<int> m_faceIndices;//3 node indices for each surface triangle
+	btScalar m_nodeMass;
+	int m_flags;
+
+public:
+	//flags are btDefracBody::CreationFlags. If cache is given, precomputed data is read from it or written to it
+	btDefracBodyTemplate(const btAlignedObjectArray<btVector3>& nodePosition, 
+		const btAlignedObjectArray<int>& indices, btScalar mass, btMaterial* material, int flags=0, 
+		btDefracBodyCache* cache=NULL);
+
+	int getNodeCount() const { return m_restPositions.size(); }
+	int getTetrahedronCount() const { return m_basisMatrices.size(); }
+	int getCreationFlags() const { return m_flags; }
+
+	const btVector3& getRestPosition(int index) const { return m_restPositions[index]; }
+	btScalar getNodeMass() const { return m_nodeMass; }
+	const btAlignedObjectArray<int>& getIndices() const { return m_indices; }
+
+	const btMatrix3x3& getBasisMatrix(int index) const { return m_basisMatrices[index]; }
+	const btMatrix3x3_12x12& getNormalizedStiffnessMatrix(int index) const { return m_stiffnessMatrices[index]; }//see btTetrahedron::getStiffnessBlock
+	btMaterial* getMaterial(int index) const { return m_materials[index]; }
+	void setMaterial(int index, btMaterial* material) { m_materials[index] = material; }//for bodies created afterwards
+
+	const btSparsityPattern& getSparsityPattern() const { return m_pattern; }
+
+	//see btDefracBody::getNodeIndexFromOriginal
+	int getNodeIndexFromOriginal(int originalIndex) const { return m_nodeIndexMap[originalIndex]; }
+	int getOriginalNodeIndex(int index) const { return m_nodeOrder[index]; }
+	int getTetrahedronIndexFromOriginal(int originalIndex) const { return m_tetrahedronIndexMap[originalIndex]; }
+	int getOriginalTetrahedronIndex(int index) const { return m_tetrahedronOrder[index]; }
+
+	void setSurfaceFaces(const btAlignedObjectArray<int>& originalIndices);//3 node indices per triangle, as given at creation
+	int getFaceCount() const { return m_faceIndices.size()/3; }
+	int getFaceNodeIndex(int index) const { return m_faceIndices[index]; }
+	const btAlignedObjectArray<int>& getFaceIndices() const { return m_faceIndices; }
+};
+
+#endif
@@ -4,10 +4,12 @@
 #include "btDefracBody.h"
 #include "btDefracBodyComponent.h"
 #include "btSpring.h"
+#include "BulletDynamics/Dynamics/btRigidBody.h"
 
 #include "btSparseMatrix.h"
+#include "btConjugateGradient.h"
 
-#include <boost/timer.hpp>
+#include <algorithm>
 
 
 btDefracDynamicsWorld::btDefracDynamicsWorld(btDispatcher* dispatcher,btBroadphaseInterface* pairCache,
@@ -15,9 +17,21 @@ btDefracDynamicsWorld::btDefracDynamicsWorld(btDispatcher* dispatcher,btBroadpha
 											 btCollisionConfiguration* collisionConfiguration)
 	:btDiscreteDynamicsWorld(dispatcher,pairCache,constraintSolver,collisionConfiguration),
 	m_cgMaxIter(10),
+	m_cgMinIter(2),
+	m_cgRelativeTolerance(btScalar(1e-3)),
+	m_cgAbsoluteTolerance(btScalar(1e-6)),
+	m_solverTimeBudget(0),
+	m_remainingSubSteps(1),
+	m_rotationTolerance(btScalar(0.001)),
+	m_fullAssemblyInterval(100),
+	m_rotationExtraction(ROTATION_GRAM_SCHMIDT),
+	m_polarIterations(2),
+	m_corotation(COROTATION_PER_ELEMENT),
+	m_nodeContactsEnabled(true),
+	m_faceContactsEnabled(true),
 	odeSolver(ODE_IMPLICIT_EULER)
 {
-
+	m_sparseSdf.Initialize();
 }
 
 btDefracDynamicsWorld::~btDefracDynamicsWorld()
@@ -43,6 +57,7 @@ void btDefracDynamicsWorld::addDefracBody(btDefracBody* body,
 void btDefracDynamicsWorld::removeDefracBody(btDefracBody* body)
 {
 	m_defracBodies.remove(body);
+	m_previousFaceContacts.resize(0);//they may refer to its components
 
 	for(int i=0; i<body->getComponentCount(); ++i)
 		btCollisionWorld::removeCollisionObject(body->getComponent(i));
@@ -57,6 +72,7 @@ void btDefracDynamicsWorld::removeDefracBodyComponent(btDefracBodyComponent* com
 	{
 		btDefracBody* body = *pbody;
 		body->removeComponent(component);
+		m_previousFaceContacts.resize(0);
 
 		if(body->getComponentCount() == 0)
 			removeDefracBody(body);
@@ -76,12 +92,16 @@ void btDefracDynamicsWorld::removeCollisionObject(btCollisionObject* collisionOb
 		btAssert(pbody != NULL);
 		btDefracBody* body = *pbody;
 		body->removeComponent(component);
+		m_previousFaceContacts.resize(0);
 
 		if(body->getComponentCount() == 0)
 			removeDefracBody(body);
 	}
 	else
+	{
+		m_sparseSdf.RemoveReferences(collisionObject->getCollisionShape());
 		btDiscreteDynamicsWorld::removeCollisionObject(collisionObject);
+	}
 }
 
 void btDefracDynamicsWorld::addSpring(btSpring* spring)
@@ -148,103 +168,136 @@ void btDefracDynamicsWorld::debugDrawWorld()
 	}	
 }
 
-/** Conjugate Gradient **/
-
-int pcg_solve(const btSparseMatrix& A, btVector3n& x, const btVector3n& b, const size_t maxiter = 10, const double rTOL = 1e-6, const double aTOL = 1e-14)
-{
-    const int size = x.size();
-    int iteration = 0;
-    
-    btVector3n resid(size);
-    btVector3n g(size);
-    btVector3n d1(size);
-    float alpha, beta, norm, h1, h2, norm_0;
-    
-    resid = b - A*x;
-    
-    g = resid;
-    
-    norm = resid.dot(resid);
-    norm_0 = norm;
-    ++iteration;
-    
-    d1 = resid;
-    h2 = resid.dot(d1);
-    
-    while ((iteration < maxiter) && (norm > (aTOL*aTOL)) && ((norm/norm_0) > (rTOL * rTOL)) ) {
-        h1 = h2;
-        
-        d1 = A*g; 
-        
-        h2 = g.dot(d1);
-        
-        alpha = h1/h2;
-        
-        x += alpha*g;
-        resid -= alpha*d1; 
-        
-        d1 = resid;
-        h2 = resid.dot(d1);      
-        
-        beta = h2/h1; 
-        g = beta*g + d1;
-        
-        norm = resid.dot(resid);
-        
-        ++iteration;
-    }
-    return iteration;
+//Sets the kinetic energy per unit mass of the component from the node velocities and its residual
+//as the rms acceleration of the free nodes, where acceleration is the net force divided by mass
+static void updateMotionMeasures(btDefracBodyComponent* component, const btVector3n& acceleration)
+{
+	const std::vector<btScalar>& invMass = component->getInvMassVector();
+	btScalar mass = 0, energy = 0, residual = 0;
+	int numFree = 0;
+
+	for(int i=0; i<component->getNodeCount(); ++i)
+	{
+		if(invMass[i] > 0)
+		{
+			const btScalar m = 1/invMass[i];
+			mass += m;
+			energy += m*component->getNode(i)->getVelocity().length2();
+			residual += acceleration[i].length2();
+			++numFree;
+		}
+	}
+
+	if(numFree > 0)
+		component->setMotionMeasures(btScalar(0.5)*energy/mass, btSqrt(residual/numFree));
+	else
+		component->setMotionMeasures(0, 0);
 }
 
-void btDefracDynamicsWorld::integrateMotionImplicitEuler(btDefracBodyComponent* component, 
-														 btScalar timeStep)
+//The linear system of the implicit Euler step of a component, A*x = b where x are the node velocities
+//at the end of the step, kept from its assembly until the solve is over
+struct btImplicitEulerSystem
 {
-	btSparseMatrix& K1 = component->getK1();
-	btSparseMatrix& K2 = component->getK2();
-
-    K1.setZero();
-    K2.setZero();
+	btDefracBodyComponent* m_component;
+	btSparseMatrix m_A;
+	btVector3n m_x;
+	btVector3n m_a;//acceleration of the nodes due to the net force at the start of the step
+	btVector3n m_b;
+	btConjugateGradient m_solver;
+	btDefracComponentStats m_stats;
+
+	btImplicitEulerSystem(btDefracBodyComponent* component, btScalar timeStep, btScalar alpha, btScalar beta,
+						  btScalar relativeTolerance, btScalar absoluteTolerance):
+		m_component(component),
+		m_A(btSparseMatrix::addDiagonal(btSparseMatrix::multiplyDiagonalLeft(component->getK1(), component->getInvMassVector()) * (timeStep*(alpha + timeStep)), timeStep*beta + 1)),
+		m_x(component->getVelocityVector()),
+		m_a(component->getInvMassVector() * (component->getForceVector() - (component->getK1()*component->getPositionVector()) + (component->getK2()*component->getPosition0Vector()))),
+		m_b(m_x + m_a*timeStep),
+		m_solver(m_A, m_x, m_b, relativeTolerance, absoluteTolerance)
+	{
+		//the matrix, x, a and b here plus the residual and the two direction vectors of the solver
+		m_stats.m_bytesAllocated = m_A.getAllocatedBytes() + 6*m_x.size()*sizeof(btVector3);
+	}
+};
 
-	//boost::timer t;
-	//t.restart();
+void btDefracDynamicsWorld::updateStiffnessMatrices(btDefracBodyComponent* component, btDefracComponentStats& stats)
+{
+	const unsigned long start = m_stepClock.getTimeMicroseconds();
 
-	for(int t=0; t<component->getTetrahedronCount(); ++t)
 	{
-		const btTetrahedron* pt = component->getTetrahedron(t);
-        const btMatrix3x3 r = pt->getRotation();
+		BT_PROFILE("extractRotations");
 
-		for(int i=0; i<4; ++i)
+		if(m_corotation == COROTATION_PER_NODE)
 		{
-			int ii = component->getNodeIndex(t*4 + i);
-
-			for(int j=0; j<4; ++j)
-			{
-				int jj = component->getNodeIndex(t*4 + j);
-                btMatrix3x3 kij = pt->getStiffnessBlock(i*4 + j);
-                btMatrix3x3 k2ij = r * kij;
-                btMatrix3x3 k1ij = k2ij * r.transpose();
-                
-                K1(ii, jj) += k1ij;
-                K2(ii, jj) += k2ij;
-			}
+			if(m_rotationExtraction == ROTATION_POLAR_DECOMPOSITION)
+				component->computeNodeRotationsPolar(m_polarIterations);
+			else
+				component->computeNodeRotationsGramSchmidt();
+		}
+		else
+		{
+			if(m_rotationExtraction == ROTATION_POLAR_DECOMPOSITION)
+				component->computeRotationsPolar(m_polarIterations);
+			else
+				component->computeRotationsGramSchmidt();
 		}
 	}
-	
-	//std::cout << "Assembly time: " << t.elapsed() << std::endl;
 
-	btVector3n w = component->getPositionVector();
-	btVector3n v = component->getPosition0Vector();
-	btVector3n f = component->getForceVector();
-	btVector3n x = component->getVelocityVector();
+	stats.m_rotationTime = m_stepClock.getTimeMicroseconds() - start;
+
+	{
+		BT_PROFILE("assembleStiffness");
+
+		if(m_corotation == COROTATION_PER_NODE)
+			component->warpStiffnessMatrices(m_rotationTolerance);
+		else
+			component->updateStiffnessMatrices(m_rotationTolerance, m_fullAssemblyInterval);
+	}
+
+	stats.m_assemblyTime = m_stepClock.getTimeMicroseconds() - start - stats.m_rotationTime;
+}
+
+btImplicitEulerSystem* btDefracDynamicsWorld::beginImplicitEuler(btDefracBodyComponent* component, 
+																  btScalar timeStep)
+{
+	btDefracComponentStats stats;
+	stats.m_component = component;
+	updateStiffnessMatrices(component, stats);
+
+	const unsigned long start = m_stepClock.getTimeMicroseconds();
 
 	btScalar alpha = 0.1f;
 	btScalar beta = 0.1f;
-    
-	btSparseMatrix A(btSparseMatrix::addDiagonal(btSparseMatrix::multiplyDiagonalLeft(K1, component->getInvMassVector()) * (timeStep*(alpha + timeStep)), timeStep*beta + 1));
 
-    btVector3n b =  x + ((component->getInvMassVector() * (f - (K1*w) + (K2*v))) * timeStep);
-    
-    m_lastNumIter = pcg_solve(A, x, b, m_cgMaxIter, 1e-3, 1e-6);
+	btImplicitEulerSystem* system;
+
+	{
+		BT_PROFILE("buildImplicitEulerSystem");
+		system = new btImplicitEulerSystem(component, timeStep, alpha, beta, m_cgRelativeTolerance, m_cgAbsoluteTolerance);
+	}
+
+	system->m_stats.m_component = component;
+	system->m_stats.m_rotationTime = stats.m_rotationTime;
+	system->m_stats.m_assemblyTime = stats.m_assemblyTime + (m_stepClock.getTimeMicroseconds() - start);
+	system->m_stats.m_solveTime = 0;
+
+	return system;
+}
+
+void btDefracDynamicsWorld::iterateImplicitEuler(btImplicitEulerSystem* system, int iterations)
+{
+	BT_PROFILE("solveCG");
+	const unsigned long start = m_stepClock.getTimeMicroseconds();
+	system->m_solver.iterate(iterations);
+	system->m_stats.m_solveTime += m_stepClock.getTimeMicroseconds() - start;
+}
+
+void btDefracDynamicsWorld::endImplicitEuler(btImplicitEulerSystem* system, btScalar timeStep)
+{
+	BT_PROFILE("writeBack");
+	const unsigned long start = m_stepClock.getTimeMicroseconds();
+	btDefracBodyComponent* component = system->m_component;
+	const btVector3n& x = system->m_x;
 
 	for(int i=0; i<component->getNodeCount(); ++i)
 	{
@@ -252,75 +305,637 @@ void btDefracDynamicsWorld::integrateMotionImplicitEuler(btDefracBodyComponent*
 		component->setNodeVelocity(i, velocity);
 		component->displaceNode(i, velocity*timeStep);
 	}
+
+	updateMotionMeasures(component, system->m_a);
+
+	btDefracSolverStatus status;
+	status.m_iterations = system->m_solver.getIterationCount();
+	status.m_initialResidual = system->m_solver.getInitialResidual();
+	status.m_residual = system->m_solver.getResidual();
+	status.m_converged = system->m_solver.isConverged();
+	component->setSolverStatus(status);
+
+	btDefracComponentStats& stats = system->m_stats;
+	stats.m_solver = status;
+	stats.m_integrationTime = m_stepClock.getTimeMicroseconds() - start;
+	m_stepStats.m_components.push_back(stats);
+
+	delete system;
+}
+
+void btDefracDynamicsWorld::integrateMotionImplicitEuler(btDefracBodyComponent* component, 
+														 btScalar timeStep)
+{
+	btImplicitEulerSystem* system = beginImplicitEuler(component, timeStep);
+	iterateImplicitEuler(system, (int)m_cgMaxIter - 1);
+	endImplicitEuler(system, timeStep);
+}
+
+//Runs the solvers of all systems until they converge or the deadline, given by m_stepClock, passes.
+//Each system gets at least m_cgMinIter iterations, and at most m_cgMaxIter. Then iterations go one at
+//a time to the system with the greatest relative residual times its component's priority, so every
+//solve makes progress in proportion to how far it is from converging
+void btDefracDynamicsWorld::solveWithinDeadline(btAlignedObjectArray<btImplicitEulerSystem*>& systems, 
+												unsigned long deadline)
+{
+	BT_PROFILE("solveWithinDeadline");
+	for(int i=0; i<systems.size(); ++i)
+		iterateImplicitEuler(systems[i], (int)m_cgMinIter - systems[i]->m_solver.getIterationCount());
+
+	while(m_stepClock.getTimeMicroseconds() < deadline)
+	{
+		btImplicitEulerSystem* next = NULL;
+		btScalar nextPriority = 0;
+
+		for(int i=0; i<systems.size(); ++i)
+		{
+			btConjugateGradient& solver = systems[i]->m_solver;
+
+			if(solver.isConverged() || solver.getIterationCount() >= (int)m_cgMaxIter)
+				continue;
+
+			const btScalar priority = solver.getRelativeResidual()*systems[i]->m_component->getSolverPriority();
+
+			if(next == NULL || priority > nextPriority)
+			{
+				next = systems[i];
+				nextPriority = priority;
+			}
+		}
+
+		if(next == NULL)
+			break;
+
+		iterateImplicitEuler(next, 1);
+	}
+}
+
+int btDefracDynamicsWorld::stepSimulation(btScalar timeStep, int maxSubSteps, btScalar fixedTimeStep)
+{
+	//count the substeps the base class is about to take, the same way it does, to split the time
+	//budget among them
+	m_stepClock.reset();
+	m_remainingSubSteps = 1;
+
+	if(maxSubSteps)
+		m_remainingSubSteps = btMin(maxSubSteps, int((m_localTime + timeStep)/fixedTimeStep));
+
+	return btDiscreteDynamicsWorld::stepSimulation(timeStep, maxSubSteps, fixedTimeStep);
 }
 
 void btDefracDynamicsWorld::integrateMotionExplicitEuler(btDefracBodyComponent* component, 
 														 btScalar timeStep)
 {
+	btDefracComponentStats stats;
+	stats.m_component = component;
+	updateStiffnessMatrices(component, stats);
+
+	BT_PROFILE("integrateExplicitEuler");
+	const unsigned long start = m_stepClock.getTimeMicroseconds();
 	btSparseMatrix& K1 = component->getK1();
 	btSparseMatrix& K2 = component->getK2();
 
-	static const btMatrix3x3 mZero(0,0,0,0,0,0,0,0,0);
-    
-	for(int t=0; t<component->getTetrahedronCount(); ++t)
+    btVector3n w = component->getPositionVector();
+	btVector3n v = component->getPosition0Vector();
+	btVector3n f = component->getForceVector();
+	f += K2*v - K1*w;
+
+	for(int i=0; i<component->getNodeCount(); ++i)
+		component->integrateNodeMotion(i, f[i], timeStep);
+
+	updateMotionMeasures(component, component->getInvMassVector() * f);
+
+	//no linear system, the forces are used as they are
+	stats.m_solver.m_iterations = 0;
+	stats.m_solver.m_initialResidual = 0;
+	stats.m_solver.m_residual = 0;
+	stats.m_solver.m_converged = true;
+	stats.m_solveTime = 0;
+	stats.m_integrationTime = m_stepClock.getTimeMicroseconds() - start;
+	stats.m_bytesAllocated = 3*component->getNodeCount()*sizeof(btVector3);
+	m_stepStats.m_components.push_back(stats);
+}
+
+void btDefracDynamicsWorld::updateDefracActivationState(btScalar timeStep)
+{
+	BT_PROFILE("updateDefracActivationState");
+	for(int i=0; i<m_defracBodies.size(); ++i)
 	{
-		for(int i=0; i<4; ++i)
+		btDefracBody* body = m_defracBodies[i];
+
+		for(int j=0; j<body->getComponentCount(); ++j)
 		{
-			int ii = component->getNodeIndex(t*4 + i);
-            
-			for(int j=0; j<4; ++j)
+			btDefracBodyComponent* c = body->getComponent(j);
+			c->updateDeactivation(timeStep);
+
+			if(c->wantsSleeping())
 			{
-				int jj = component->getNodeIndex(t*4 + j);
-                
-				K1(ii, jj) = mZero;
-				K2(ii, jj) = mZero;
+				//the island manager puts it to sleep in the next step, unless it touches something awake
+				if(c->getActivationState() == ACTIVE_TAG)
+					c->setActivationState(WANTS_DEACTIVATION);
+
+				if(c->getActivationState() == ISLAND_SLEEPING)
+				{
+					for(int k=0; k<c->getNodeCount(); ++k)
+						c->setNodeVelocity(k, btVector3(0,0,0));
+
+					c->setMotionMeasures(0, 0);
+				}
+			}
+			else
+			{
+				if(c->getActivationState() != DISABLE_DEACTIVATION)
+					c->setActivationState(ACTIVE_TAG);
 			}
 		}
 	}
+}
 
-	for(int t=0; t<component->getTetrahedronCount(); ++t)
+void btDefracDynamicsWorld::collideNodes()
+{
+	BT_PROFILE("collideNodes");
+
+	m_nodeContacts.resize(0);
+
+	btOverlappingPairCache* pairCache = getPairCache();
+	btBroadphasePair* pairs = pairCache->getOverlappingPairArrayPtr();
+
+	for(int p=0; p<pairCache->getNumOverlappingPairs(); ++p)
 	{
-		const btTetrahedron* pt = component->getTetrahedron(t);
-        const btMatrix3x3 r = pt->getRotation();
-        
-		for(int i=0; i<4; ++i)
+		btCollisionObject* object = (btCollisionObject*)pairs[p].m_pProxy0->m_clientObject;
+		btDefracBodyComponent* component = btDefracBodyComponent::upcast((btCollisionObject*)pairs[p].m_pProxy1->m_clientObject);
+
+		if(component == NULL)
 		{
-			int ii = component->getNodeIndex(t*4 + i);
-            
-			for(int j=0; j<4; ++j)
+			object = (btCollisionObject*)pairs[p].m_pProxy1->m_clientObject;
+			component = btDefracBodyComponent::upcast((btCollisionObject*)pairs[p].m_pProxy0->m_clientObject);
+		}
+
+		//the distance field is only defined for convex shapes
+		if(component == NULL || btDefracBodyComponent::upcast(object) != NULL || !component->isActive() ||
+		   !object->hasContactResponse() || !object->getCollisionShape()->isConvex())
+			continue;
+
+		const btTransform& transform = object->getWorldTransform();
+		const btScalar margin = component->getCollisionShape()->getMargin();
+		btVector3 aabbMin, aabbMax;
+		object->getCollisionShape()->getAabb(transform, aabbMin, aabbMax);
+		aabbMin -= btVector3(margin, margin, margin);
+		aabbMax += btVector3(margin, margin, margin);
+
+		for(int i=0; i<component->getSurfaceNodeCount(); ++i)
+		{
+			const int n = component->getSurfaceNode(i);
+			const btNode* node = component->getNode(n);
+
+			if(node->getInvMass() == 0 || !TestPointAgainstAabb2(aabbMin, aabbMax, node->getPosition()))
+				continue;
+
+			btVector3 normal;
+			const btScalar distance = m_sparseSdf.Evaluate(transform.invXform(node->getPosition()),
+				object->getCollisionShape(), normal, margin);
+
+			if(distance < 0)
 			{
-				int jj = component->getNodeIndex(t*4 + j);
-                btMatrix3x3 kij = pt->getStiffnessBlock(i*4 + j);
-                btMatrix3x3 k2ij = r * kij;
-                btMatrix3x3 k1ij = k2ij * r.transpose();
-                
-                K1(ii, jj) += k1ij;
-                K2(ii, jj) += k2ij;
+				btDefracNodeContact& c = m_nodeContacts.expand();
+				c.m_component = component;
+				c.m_node = n;
+				c.m_object = object;
+				c.m_normal = transform.getBasis()*normal;
+				c.m_distance = distance;
 			}
 		}
 	}
+}
+
+void btDefracDynamicsWorld::resolveNodeContacts()
+{
+	BT_PROFILE("resolveNodeContacts");
+
+	for(int i=0; i<m_nodeContacts.size(); ++i)
+	{
+		const btDefracNodeContact& c = m_nodeContacts[i];
+		const btNode* node = c.m_component->getNode(c.m_node);
+		btRigidBody* rigid = btRigidBody::upcast(c.m_object);
+
+		c.m_component->displaceNode(c.m_node, -c.m_distance*c.m_normal);
+
+		const btVector3& x = node->getPosition();
+		const btVector3 r = rigid ? x - rigid->getCenterOfMassPosition() : btVector3(0, 0, 0);
+		const btVector3 relativeVelocity = node->getVelocity() - (rigid ? rigid->getVelocityInLocalPoint(r) : btVector3(0, 0, 0));
+		const btScalar normalVelocity = relativeVelocity.dot(c.m_normal);
+
+		if(normalVelocity >= 0)
+			continue;
+
+		const btScalar invMass = node->getInvMass();
+		const btScalar normalImpulse = -normalVelocity/(invMass + (rigid ? rigid->computeImpulseDenominator(x, c.m_normal) : 0));
+		btVector3 impulse = normalImpulse*c.m_normal;
+
+		//the tangential velocity stops if the impulse needed is inside the friction cone, otherwise it is
+		//reduced by the largest impulse in it
+		const btVector3 tangentialVelocity = relativeVelocity - normalVelocity*c.m_normal;
+		const btScalar tangentialSpeed = tangentialVelocity.length();
+
+		if(tangentialSpeed > SIMD_EPSILON)
+		{
+			const btVector3 tangent = tangentialVelocity/tangentialSpeed;
+			const btScalar friction = c.m_component->getFriction()*c.m_object->getFriction();
+			const btScalar tangentialImpulse = tangentialSpeed/(invMass + (rigid ? rigid->computeImpulseDenominator(x, tangent) : 0));
+			impulse -= btMin(tangentialImpulse, friction*normalImpulse)*tangent;
+		}
+
+		c.m_component->setNodeVelocity(c.m_node, node->getVelocity() + impulse*invMass);
+
+		if(rigid && rigid->getInvMass() > 0)
+			rigid->applyImpulse(-impulse, r);
+	}
+}
 
-    btVector3n w = component->getPositionVector();
-	btVector3n v = component->getPosition0Vector();
-	btVector3n f = component->getForceVector();
-	f += K2*v - K1*w;
+struct btDefracTrianglePairCollector : public btDbvt::ICollide
+{
+	btAlignedObjectArray<int>& m_pairs;
 
-	for(int i=0; i<component->getNodeCount(); ++i)
-		component->integrateNodeMotion(i, f[i], timeStep);
+	btDefracTrianglePairCollector(btAlignedObjectArray<int>& pairs):
+		m_pairs(pairs)
+	{}
+
+	void Process(const btDbvtNode* leaf0, const btDbvtNode* leaf1)
+	{
+		m_pairs.push_back(leaf0->dataAsInt);
+		m_pairs.push_back(leaf1->dataAsInt);
+	}
+};
+
+//sorts the contacts by node, the deepest first
+struct btDefracFaceContactLess
+{
+	bool operator () (const btDefracFaceContact& a, const btDefracFaceContact& b) const
+	{
+		if(a.m_component != b.m_component)
+			return a.m_component < b.m_component;
+
+		if(a.m_node != b.m_node)
+			return a.m_node < b.m_node;
+
+		return a.m_distance < b.m_distance;
+	}
+};
+
+//orders the contacts by node and triangle, to look up those of the last step
+struct btDefracFaceContactPairLess
+{
+	bool operator () (const btDefracFaceContact& a, const btDefracFaceContact& b) const
+	{
+		if(a.m_component != b.m_component)
+			return a.m_component < b.m_component;
+
+		if(a.m_node != b.m_node)
+			return a.m_node < b.m_node;
+
+		if(a.m_otherComponent != b.m_otherComponent)
+			return a.m_otherComponent < b.m_otherComponent;
+
+		return a.m_triangle < b.m_triangle;
+	}
+};
+
+//whether contacts, sorted by btDefracFaceContactPairLess, has one between the same node and triangle as contact
+static bool HasContactPair(const btAlignedObjectArray<btDefracFaceContact>& contacts, const btDefracFaceContact& contact)
+{
+	btDefracFaceContactPairLess less;
+	int first = 0, last = contacts.size();
+
+	while(first < last)
+	{
+		const int middle = (first + last)/2;
+
+		if(less(contacts[middle], contact))
+			first = middle + 1;
+		else
+			last = middle;
+	}
+
+	return first < contacts.size() && !less(contact, contacts[first]);
+}
+
+//whether the node is closer to the plane of the triangle than margin and projects inside it. Behind the
+//plane, it must also have been in front of it at the start of the step, when the positions were
+//x - timeStep*v, or in contact with the triangle in the last step, as given by previousContacts
+static bool CollideNodeTriangle(btDefracBodyComponent* component, int node, btDefracBodyComponent* other, 
+								int triangle, btScalar margin, btScalar timeStep,
+								const btAlignedObjectArray<btDefracFaceContact>& previousContacts, btDefracFaceContact& contact)
+{
+	const btNode* n = component->getNode(node);
+	const btNode* corners[] = {other->getNode(other->getSurfaceNodeIndex(triangle*3 + 0)),
+							   other->getNode(other->getSurfaceNodeIndex(triangle*3 + 1)),
+							   other->getNode(other->getSurfaceNodeIndex(triangle*3 + 2))};
+	const btVector3& x = n->getPosition();
+	const btVector3& p0 = corners[0]->getPosition();
+	const btVector3 e1 = corners[1]->getPosition() - p0;
+	const btVector3 e2 = corners[2]->getPosition() - p0;
+	btVector3 normal = e1.cross(e2);
+	const btVector3 d = x - p0;
+	const btScalar scaledDistance = d.dot(normal);//times the length of normal, compared squared to skip the root
+	const btScalar length2 = normal.length2();
+
+	//farther than margin in front, or deeper than margin behind, where there is no telling which side it came from
+	if(scaledDistance*scaledDistance >= margin*margin*length2 || length2 < SIMD_EPSILON*SIMD_EPSILON)
+		return false;
+
+	const btScalar length = btSqrt(length2);
+	normal /= length;
+	const btScalar distance = scaledDistance/length;
+
+	const btVector3 q = d - distance*normal;
+	const btScalar d11 = e1.dot(e1), d12 = e1.dot(e2), d22 = e2.dot(e2);
+	const btScalar q1 = q.dot(e1), q2 = q.dot(e2);
+	const btScalar det = d11*d22 - d12*d12;
+	const btScalar w1 = (d22*q1 - d12*q2)/det;
+	const btScalar w2 = (d11*q2 - d12*q1)/det;
+
+	if(w1 < 0 || w2 < 0 || w1 + w2 > 1)
+		return false;
+
+	contact.m_component = component;
+	contact.m_node = node;
+	contact.m_otherComponent = other;
+	contact.m_triangle = triangle;
+
+	if(distance < 0)
+	{
+		const btVector3 s0 = p0 - corners[0]->getVelocity()*timeStep;
+		const btVector3 startNormal = (corners[1]->getPosition() - corners[1]->getVelocity()*timeStep - s0).cross(
+			corners[2]->getPosition() - corners[2]->getVelocity()*timeStep - s0);
+
+		if((x - n->getVelocity()*timeStep - s0).dot(startNormal) < 0 && !HasContactPair(previousContacts, contact))
+			return false;
+	}
+
+	contact.m_weights.setValue(1 - w1 - w2, w1, w2);
+	contact.m_normal = normal;
+	contact.m_distance = distance - margin;
+	return true;
+}
+
+void btDefracDynamicsWorld::collideComponents(btScalar timeStep)
+{
+	BT_PROFILE("collideComponents");
+
+	btOverlappingPairCache* pairCache = getPairCache();
+	btBroadphasePair* pairs = pairCache->getOverlappingPairArrayPtr();
+
+	for(int p=0; p<pairCache->getNumOverlappingPairs(); ++p)
+	{
+		btDefracBodyComponent* component0 = btDefracBodyComponent::upcast((btCollisionObject*)pairs[p].m_pProxy0->m_clientObject);
+		btDefracBodyComponent* component1 = btDefracBodyComponent::upcast((btCollisionObject*)pairs[p].m_pProxy1->m_clientObject);
+
+		if(component0 != NULL && component1 != NULL && (component0->isActive() || component1->isActive()) &&
+		   component0->hasContactResponse() && component1->hasContactResponse())
+			collideComponentPair(component0, component1, timeStep);
+	}
+}
+
+void btDefracDynamicsWorld::collideComponentPair(btDefracBodyComponent* component0, btDefracBodyComponent* component1,
+												 btScalar timeStep)
+{
+	const btDefracCollisionShape* shape0 = static_cast<const btDefracCollisionShape*>(component0->getCollisionShape());
+	const btDefracCollisionShape* shape1 = static_cast<const btDefracCollisionShape*>(component1->getCollisionShape());
+	const btScalar margin = shape0->getMargin() + shape1->getMargin();
+
+	m_trianglePairs.resize(0);
+	btDefracTrianglePairCollector collector(m_trianglePairs);
+	shape0->collideTT(*shape1, collector);
+
+	//the exact tests only read positions and each pair writes its own 6 slots
+	const int numPairs = m_trianglePairs.size()/2;
+	m_candidateContacts.resize(numPairs*6);
+
+	#pragma omp parallel for schedule(static)
+	for(int p=0; p<numPairs; ++p)
+	{
+		const int t0 = m_trianglePairs[p*2 + 0];
+		const int t1 = m_trianglePairs[p*2 + 1];
+		btDefracFaceContact* contacts = &m_candidateContacts[p*6];
+
+		for(int k=0; k<3; ++k)
+		{
+			if(!CollideNodeTriangle(component0, component0->getSurfaceNodeIndex(t0*3 + k), component1, t1, margin, timeStep,
+									m_previousFaceContacts, contacts[k]))
+				contacts[k].m_component = NULL;
+
+			if(!CollideNodeTriangle(component1, component1->getSurfaceNodeIndex(t1*3 + k), component0, t0, margin, timeStep,
+									m_previousFaceContacts, contacts[3 + k]))
+				contacts[3 + k].m_component = NULL;
+		}
+	}
+
+	int numContacts = 0;
+
+	for(int i=0; i<m_candidateContacts.size(); ++i)
+		if(m_candidateContacts[i].m_component != NULL)
+			m_candidateContacts[numContacts++] = m_candidateContacts[i];
+
+	if(numContacts == 0)
+		return;
+
+	//a node shared by several triangles or in front of several is tested many times, keep its deepest contact
+	m_candidateContacts.resize(numContacts);
+	m_candidateContacts.quickSort(btDefracFaceContactLess());
+
+	for(int i=0; i<numContacts; ++i)
+	{
+		const btDefracFaceContact& c = m_candidateContacts[i];
+
+		if(i == 0 || c.m_component != m_candidateContacts[i-1].m_component || c.m_node != m_candidateContacts[i-1].m_node)
+			m_faceContacts.push_back(c);
+	}
+
+	//a sleeping component touched by an active one has to move too
+	if(!component0->isActive())
+		component0->activate();
+
+	if(!component1->isActive())
+		component1->activate();
+}
+
+//whether nodes i and j are in a same tetrahedron, that is, whether K has a block at (i,j)
+static bool ShareTetrahedron(const btSparseMatrix& K, int i, int j)
+{
+	const int* columns = K.getColumnIndices();
+	return std::binary_search(columns + K.getRowIndices()[i], columns + K.getRowIndices()[i+1], j);
+}
+
+void btDefracDynamicsWorld::collideSelf(btDefracBodyComponent* component, btScalar timeStep)
+{
+	BT_PROFILE("collideSelf");
+
+	const btScalar margin = component->getSelfCollisionMargin();
+	const btSparseMatrix& K = component->getK1();
+	m_selfCollisionHash.build(component, margin);
+
+	//one slot per surface node for its deepest contact
+	const int numNodes = component->getSurfaceNodeCount();
+	m_candidateContacts.resize(numNodes);
+
+	#pragma omp parallel for schedule(dynamic, 64)
+	for(int i=0; i<numNodes; ++i)
+	{
+		const int node = component->getSurfaceNode(i);
+		const int bucket = m_selfCollisionHash.getBucket(component->getNode(node)->getPosition());
+		btDefracFaceContact& deepest = m_candidateContacts[i];
+		btDefracFaceContact contact;
+		deepest.m_component = NULL;
+
+		const int bucketEnd = m_selfCollisionHash.getBucketEnd(bucket);
+		const int end = bucketEnd + m_selfCollisionHash.getLargeTriangleCount();
+
+		//the triangles of the bucket followed by the large ones, which are in no bucket
+		for(int e=m_selfCollisionHash.getBucketBegin(bucket); e<end; ++e)
+		{
+			const int t = e < bucketEnd ? m_selfCollisionHash.getTriangle(e) : m_selfCollisionHash.getLargeTriangle(e - bucketEnd);
+
+			//the adjacency is checked last since most triangles in the bucket are not even close
+			if(CollideNodeTriangle(component, node, component, t, margin, timeStep, m_previousFaceContacts, contact) &&
+			   (deepest.m_component == NULL || contact.m_distance < deepest.m_distance) &&
+			   !ShareTetrahedron(K, node, component->getSurfaceNodeIndex(t*3 + 0)) &&
+			   !ShareTetrahedron(K, node, component->getSurfaceNodeIndex(t*3 + 1)) &&
+			   !ShareTetrahedron(K, node, component->getSurfaceNodeIndex(t*3 + 2)))
+				deepest = contact;
+		}
+	}
+
+	for(int i=0; i<numNodes; ++i)
+		if(m_candidateContacts[i].m_component != NULL)
+			m_faceContacts.push_back(m_candidateContacts[i]);
+}
+
+void btDefracDynamicsWorld::resolveFaceContacts()
+{
+	BT_PROFILE("resolveFaceContacts");
+
+	for(int i=0; i<m_faceContacts.size(); ++i)
+	{
+		const btDefracFaceContact& c = m_faceContacts[i];
+		const btNode* node = c.m_component->getNode(c.m_node);
+		const btNode* corners[3];
+		int cornerIndices[3];
+		btScalar invMass = node->getInvMass();//of the node against the point of the triangle
+		btVector3 triangleVelocity(0, 0, 0);
+
+		for(int k=0; k<3; ++k)
+		{
+			cornerIndices[k] = c.m_otherComponent->getSurfaceNodeIndex(c.m_triangle*3 + k);
+			corners[k] = c.m_otherComponent->getNode(cornerIndices[k]);
+			invMass += c.m_weights[k]*c.m_weights[k]*corners[k]->getInvMass();
+			triangleVelocity += c.m_weights[k]*corners[k]->getVelocity();
+		}
+
+		if(invMass == 0)
+			continue;
+
+		//move the node and the corners apart along the normal by their share of the inverse mass
+		const btScalar separation = -c.m_distance/invMass;
+		c.m_component->displaceNode(c.m_node, separation*node->getInvMass()*c.m_normal);
+
+		for(int k=0; k<3; ++k)
+			c.m_otherComponent->displaceNode(cornerIndices[k], -separation*c.m_weights[k]*corners[k]->getInvMass()*c.m_normal);
+
+		const btVector3 relativeVelocity = node->getVelocity() - triangleVelocity;
+		const btScalar normalVelocity = relativeVelocity.dot(c.m_normal);
+
+		if(normalVelocity >= 0)
+			continue;
+
+		const btScalar normalImpulse = -normalVelocity/invMass;
+		btVector3 impulse = normalImpulse*c.m_normal;
+
+		const btVector3 tangentialVelocity = relativeVelocity - normalVelocity*c.m_normal;
+		const btScalar tangentialSpeed = tangentialVelocity.length();
+
+		if(tangentialSpeed > SIMD_EPSILON)
+		{
+			const btScalar friction = c.m_component->getFriction()*c.m_otherComponent->getFriction();
+			impulse -= btMin(tangentialSpeed/invMass, friction*normalImpulse)*(tangentialVelocity/tangentialSpeed);
+		}
+
+		c.m_component->setNodeVelocity(c.m_node, node->getVelocity() + impulse*node->getInvMass());
+
+		for(int k=0; k<3; ++k)
+			c.m_otherComponent->setNodeVelocity(cornerIndices[k], corners[k]->getVelocity() - impulse*c.m_weights[k]*corners[k]->getInvMass());
+	}
+}
+
+//A sleeping component is left out of the step, unless some force was applied to its nodes since the
+//last one, like a spring pulling it, which wakes it up. Contacts wake it through the island manager
+bool btDefracDynamicsWorld::wakeUpIfForced(btDefracBodyComponent* component)
+{
+	if(component->isActive())
+		return true;
+
+	if(component->wasForceApplied())
+	{
+		component->activate();
+		return true;
+	}
+
+	return false;
 }
 
 void btDefracDynamicsWorld::internalSingleStepSimulation(btScalar timeStep)
 {
 	btDiscreteDynamicsWorld::internalSingleStepSimulation(timeStep);
+
+	BT_PROFILE("integrateDefracBodies");
+
+	++m_stepStats.m_step;
+	m_stepStats.m_timeStep = timeStep;
+	m_stepStats.m_components.resize(0);
 	//const static int nIterations = 1;
 	//timeStep /= nIterations;
 
 	//for(int k=0; k<nIterations; ++k)
 
-	for(int i=0; i<m_springs.size(); ++i)
-		m_springs[i]->applyForces();
+	{
+		BT_PROFILE("applySpringForces");
+
+		for(int i=0; i<m_springs.size(); ++i)
+			m_springs[i]->applyForces();
+	}
+
+	if(odeSolver == ODE_IMPLICIT_EULER && m_solverTimeBudget > 0)
+	{
+		//assemble every system first, then share out the time left for this substep among their solves
+		btAlignedObjectArray<btImplicitEulerSystem*> systems;
+
+		for(int i=0; i<m_defracBodies.size(); ++i)
+		{
+			btDefracBody* body = m_defracBodies[i];
+
+			for(int j=0; j<body->getComponentCount(); ++j)
+			{
+				btDefracBodyComponent* c = body->getComponent(j);
+
+				if(wakeUpIfForced(c))
+				{
+					c->applyAcceleration(m_gravity);
+					systems.push_back(beginImplicitEuler(c, timeStep));
+				}
+
+				c->zeroOutForces();
+			}
+		}
+
+		const unsigned long now = m_stepClock.getTimeMicroseconds();
+		const unsigned long budget = (unsigned long)(m_solverTimeBudget*1000000);
+		const int subSteps = btMax(m_remainingSubSteps, 1);
+		solveWithinDeadline(systems, now < budget ? now + (budget - now)/subSteps : now);
+		--m_remainingSubSteps;
 
-	if(odeSolver == ODE_IMPLICIT_EULER)
+		for(int i=0; i<systems.size(); ++i)
+			endImplicitEuler(systems[i], timeStep);
+	}
+	else if(odeSolver == ODE_IMPLICIT_EULER)
 		for(int i=0; i<m_defracBodies.size(); ++i)
 		{
 			btDefracBody* body = m_defracBodies[i];
@@ -328,8 +943,13 @@ void btDefracDynamicsWorld::internalSingleStepSimulation(btScalar timeStep)
 			for(int j=0; j<body->getComponentCount(); ++j)
 			{
 				btDefracBodyComponent* c = body->getComponent(j);
-				c->applyAcceleration(m_gravity);
-				integrateMotionImplicitEuler(c, timeStep);
+
+				if(wakeUpIfForced(c))
+				{
+					c->applyAcceleration(m_gravity);
+					integrateMotionImplicitEuler(c, timeStep);
+				}
+
 				c->zeroOutForces();
 			}
 		}
@@ -341,9 +961,63 @@ void btDefracDynamicsWorld::internalSingleStepSimulation(btScalar timeStep)
 			for(int j=0; j<body->getComponentCount(); ++j)
 			{
 				btDefracBodyComponent* c = body->getComponent(j);
-				c->applyAcceleration(m_gravity);
-				integrateMotionExplicitEuler(c, timeStep);
+
+				if(wakeUpIfForced(c))
+				{
+					c->applyAcceleration(m_gravity);
+					integrateMotionExplicitEuler(c, timeStep);
+				}
+
 				c->zeroOutForces();
 			}
 		}
+
+	//the contacts of the last step are kept to tell which nodes behind a triangle were touching it
+	m_previousFaceContacts.copyFromArray(m_faceContacts);
+	m_previousFaceContacts.quickSort(btDefracFaceContactPairLess());
+	m_faceContacts.resize(0);
+
+	if(m_faceContactsEnabled)
+		collideComponents(timeStep);
+
+	for(int i=0; i<m_defracBodies.size(); ++i)
+	{
+		btDefracBody* body = m_defracBodies[i];
+
+		for(int j=0; j<body->getComponentCount(); ++j)
+		{
+			btDefracBodyComponent* c = body->getComponent(j);
+
+			if(c->getSelfCollision() && c->isActive())
+				collideSelf(c, timeStep);
+		}
+	}
+
+	resolveFaceContacts();
+
+	if(m_nodeContactsEnabled)
+	{
+		collideNodes();
+		resolveNodeContacts();
+		m_sparseSdf.GarbageCollect();
+	}
+
+	{
+		BT_PROFILE("refitCollisionShapes");
+
+		for(int i=0; i<m_defracBodies.size(); ++i)
+		{
+			btDefracBody* body = m_defracBodies[i];
+
+			for(int j=0; j<body->getComponentCount(); ++j)
+			{
+				btDefracBodyComponent* c = body->getComponent(j);
+
+				if(c->isActive())
+					static_cast<btDefracCollisionShape*>(c->getCollisionShape())->refitBvh();
+			}
+		}
+	}
+
+	updateDefracActivationState(timeStep);
 }
\ No newline at end of file
@@ -4,10 +4,38 @@
 
 #include "LinearMath/btHashMap.h"
 #include "BulletDynamics/Dynamics/btDiscreteDynamicsWorld.h"
+#include "LinearMath/btQuickprof.h"
+#include "BulletSoftBody/btSparseSDF.h"
+#include "btDefracStepStats.h"
+#include "btDefracSpatialHash.h"
 
 class btDefracBody;
 class btDefracBodyComponent;
 class btSpring;
+struct btImplicitEulerSystem;
+
+//a surface node of a component closer to a convex collision object than the margin of the component
+struct btDefracNodeContact
+{
+	btDefracBodyComponent* m_component;
+	int m_node;
+	btCollisionObject* m_object;
+	btVector3 m_normal;//in world space, pointing away from m_object
+	btScalar m_distance;//distance to m_object minus the margin, negative
+};
+
+//a surface node of a component in front of a surface triangle of another one, closer than the sum of
+//their margins
+struct btDefracFaceContact
+{
+	btDefracBodyComponent* m_component;
+	int m_node;
+	btDefracBodyComponent* m_otherComponent;
+	int m_triangle;
+	btVector3 m_weights;//barycentric coordinates of the projection of the node on the triangle
+	btVector3 m_normal;//of the triangle, pointing outwards
+	btScalar m_distance;//distance to the triangle minus the margins, negative
+};
 
 class btDefracDynamicsWorld : public btDiscreteDynamicsWorld
 {
@@ -18,16 +46,61 @@ public:
 		ODE_IMPLICIT_EULER
 	};
 
+	enum RotationExtraction
+	{
+		ROTATION_GRAM_SCHMIDT,
+		ROTATION_POLAR_DECOMPOSITION
+	};
+
+	enum Corotation
+	{
+		COROTATION_PER_ELEMENT,//one rotation per tetrahedron, K1 and K2 assembled from the rotated element matrices
+		COROTATION_PER_NODE//one rotation per node, K1 and K2 warped from the rest stiffness (stiffness warping)
+	};
+
 private:
 	btHashMap<btHashKey<btDefracBodyComponent*>, btDefracBody*> m_componentToBody;
 	btAlignedObjectArray<btDefracBody*> m_defracBodies;
 	btAlignedObjectArray<btSpring*> m_springs;
 	unsigned int m_cgMaxIter;
-	unsigned int m_lastNumIter;
+	unsigned int m_cgMinIter;
+	btScalar m_cgRelativeTolerance;
+	btScalar m_cgAbsoluteTolerance;
+	btScalar m_solverTimeBudget;//seconds per stepSimulation, 0 if there is no budget
+	btClock m_stepClock;//started by stepSimulation
+	int m_remainingSubSteps;
+	btDefracStepStats m_stepStats;
+	btScalar m_rotationTolerance;
+	int m_fullAssemblyInterval;
+	RotationExtraction m_rotationExtraction;
+	int m_polarIterations;
+	Corotation m_corotation;
+	btSparseSdf<3> m_sparseSdf;
+	btAlignedObjectArray<btDefracNodeContact> m_nodeContacts;
+	bool m_nodeContactsEnabled;
+	btAlignedObjectArray<btDefracFaceContact> m_faceContacts;
+	btAlignedObjectArray<btDefracFaceContact> m_previousFaceContacts;//those of the last step sorted by node and triangle, which may stay behind their triangle
+	btAlignedObjectArray<int> m_trianglePairs;//2 triangle indices per pair found by collideComponentPair
+	btAlignedObjectArray<btDefracFaceContact> m_candidateContacts;//6 per triangle pair, one per node against the other triangle
+	bool m_faceContactsEnabled;
+	btDefracSpatialHash m_selfCollisionHash;
 
 	virtual void internalSingleStepSimulation(btScalar timeStep);
 	void integrateMotionImplicitEuler(btDefracBodyComponent* component, btScalar timeStep);
+	btImplicitEulerSystem* beginImplicitEuler(btDefracBodyComponent* component, btScalar timeStep);
+	void iterateImplicitEuler(btImplicitEulerSystem* system, int iterations);
+	void endImplicitEuler(btImplicitEulerSystem* system, btScalar timeStep);
+	void solveWithinDeadline(btAlignedObjectArray<btImplicitEulerSystem*>& systems, unsigned long deadline);
 	void integrateMotionExplicitEuler(btDefracBodyComponent* component, btScalar timeStep);
+	void updateStiffnessMatrices(btDefracBodyComponent* component, btDefracComponentStats& stats);
+	bool wakeUpIfForced(btDefracBodyComponent* component);//returns whether the component is to be simulated
+	void updateDefracActivationState(btScalar timeStep);
+	void collideNodes();
+	void resolveNodeContacts();
+	void collideComponents(btScalar timeStep);
+	void collideComponentPair(btDefracBodyComponent* component0, btDefracBodyComponent* component1, btScalar timeStep);
+	void collideSelf(btDefracBodyComponent* component, btScalar timeStep);
+	void resolveFaceContacts();
 
 	ODESolver odeSolver;
 
@@ -51,10 +124,75 @@ public:
 	void addSpring(btSpring* spring);
 	void removeSpring(btSpring* spring);
 
+	virtual int stepSimulation(btScalar timeStep, int maxSubSteps=1, btScalar fixedTimeStep=btScalar(1.)/btScalar(60.));
+
 	void setCGMaxIter(unsigned int maxIter) { m_cgMaxIter = maxIter; }
 	unsigned int getCGMaxIter() { return m_cgMaxIter; }
 
-	unsigned int getLastNumIter() { return m_lastNumIter; }
+	//the CG solve stops when the residual is below the absolute tolerance or the relative tolerance times
+	//the initial residual, or after CGMaxIter iterations
+	void setCGTolerance(btScalar relative, btScalar absolute) { m_cgRelativeTolerance = relative; m_cgAbsoluteTolerance = absolute; }
+	btScalar getCGRelativeTolerance() { return m_cgRelativeTolerance; }
+	btScalar getCGAbsoluteTolerance() { return m_cgAbsoluteTolerance; }
+
+	//With a time budget, in seconds, the CG solves of all components stop when stepSimulation has run for
+	//that long, after at least CGMinIter iterations each. The iterations are shared out by relative
+	//residual times btDefracBodyComponent::getSolverPriority, and each component reports how far it got
+	//in getSolverStatus. With 0, the default, every solve runs up to CGMaxIter iterations
+	void setSolverTimeBudget(btScalar seconds) { m_solverTimeBudget = seconds; }
+	btScalar getSolverTimeBudget() { return m_solverTimeBudget; }
+	void setCGMinIter(unsigned int minIter) { m_cgMinIter = minIter; }
+	unsigned int getCGMinIter() { return m_cgMinIter; }
+
+	//the CG iterations, residuals, timings and allocations of each component in the last internal step. It
+	//is rebuilt by every step, so copy it to keep it
+	const btDefracStepStats& getStepStats() const { return m_stepStats; }
+
+	//the stiffness terms of a tetrahedron are only updated when it rotates more than the tolerance, in
+	//radians, and all of them every interval steps, see btDefracBodyComponent::updateStiffnessMatrices
+	void setRotationTolerance(btScalar angle) { m_rotationTolerance = angle; }
+	btScalar getRotationTolerance() { return m_rotationTolerance; }
+	void setFullAssemblyInterval(int interval) { m_fullAssemblyInterval = interval; }
+	int getFullAssemblyInterval() { return m_fullAssemblyInterval; }
+
+	//how the rotation of each tetrahedron is found, Gram-Schmidt by default, which is cheaper. The polar
+	//decomposition is warm started with the rotations of the previous step and refined with the given
+	//number of iterations per step
+	void setRotationExtraction(RotationExtraction extraction) { m_rotationExtraction = extraction; }
+	RotationExtraction getRotationExtraction() { return m_rotationExtraction; }
+	void setPolarIterations(int iterations) { m_polarIterations = iterations; }
+	int getPolarIterations() { return m_polarIterations; }
+
+	void setCorotation(Corotation corotation) { m_corotation = corotation; }
+	Corotation getCorotation() { return m_corotation; }
+
+	//After each step, the surface nodes of the active components are tested against the convex collision
+	//objects their component overlaps in the broadphase, by the signed distance fields cached in
+	//getSparseSdf. A node closer than the margin of the component's collision shape is pushed out to it,
+	//and an impulse removes its velocity towards the object and, up to Coulomb friction, along it. Dynamic
+	//rigid bodies get the opposite impulse. Enabled by default
+	void setNodeContactsEnabled(bool enabled) { m_nodeContactsEnabled = enabled; }
+	bool getNodeContactsEnabled() { return m_nodeContactsEnabled; }
+	int getNumNodeContacts() const { return m_nodeContacts.size(); }
+	const btDefracNodeContact& getNodeContact(int i) const { return m_nodeContacts[i]; }
+	btSparseSdf<3>& getSparseSdf() { return m_sparseSdf; }
+
+	//After each step, the components that overlap in the broadphase, at least one of them active, collide
+	//through their surface BVHs: btDbvt::collideTT finds the pairs of triangles within the sum of the
+	//margins, and the surface nodes of each one are tested against the other. A node in front of a
+	//triangle and closer than the margins is separated from it and its approaching velocity removed, with
+	//Coulomb friction, by impulses shared between the node and the 3 of the triangle by inverse mass and
+	//barycentric weight. A node less than the margins behind the triangle is only separated from it if it
+	//was in front of it at the start of the step or touched it in the last step, so nodes are not pushed
+	//through triangles they reach from behind, and deeper ones are left alone. Only the deepest contact of
+	//each node is kept.
+	//Enabled by default. The self-collisions of the components that enable them, found through a
+	//btDefracSpatialHash of their surface, are contacts with m_otherComponent == m_component resolved the
+	//same way, whether this is enabled or not
+	void setFaceContactsEnabled(bool enabled) { m_faceContactsEnabled = enabled; }
+	bool getFaceContactsEnabled() { return m_faceContactsEnabled; }
+	int getNumFaceContacts() const { return m_faceContacts.size(); }
+	const btDefracFaceContact& getFaceContact(int i) const { return m_faceContacts[i]; }
 
 	virtual void debugDrawWorld();
 	void setODESolver(ODESolver solver) { odeSolver = solver; }
@@ -0,0 +1,145 @@
+#include "btDefracMeshFile.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+
+static unsigned long long AlignOffset(unsigned long long offset)
+{
+	return (offset + BT_DEFRAC_MESH_ALIGNMENT - 1) & ~(unsigned long long)(BT_DEFRAC_MESH_ALIGNMENT - 1);
+}
+
+//true if a section of count elements of the given size starts aligned at offset and ends within the file.
+//Written so that no corrupt offset or count can overflow
+static bool SectionFits(unsigned long long offset, unsigned long long count, unsigned long long elementSize, 
+						unsigned long long size)
+{
+	return offset%BT_DEFRAC_MESH_ALIGNMENT == 0 && offset <= size && count*elementSize <= size - offset;
+}
+
+//true if all the count node indices are in [0, numNodes)
+static bool IndicesInRange(const int* indices, int count, int numNodes)
+{
+	int invalid = 0;
+
+	#pragma omp parallel for schedule(static) reduction(+:invalid)
+	for(int i=0; i<count; ++i)
+		invalid += (unsigned int)indices[i] >= (unsigned int)numNodes;
+
+	return invalid == 0;
+}
+
+bool btDefracMeshFile::open(const std::string& filename)
+{
+	close();
+
+	if(!m_file.open(filename))
+		return false;
+
+	const size_t size = m_file.getSize();
+	const btDefracMeshFileHeader* header = (const btDefracMeshFileHeader*)m_file.getData();
+
+	//the counts must also fit the int arrays they are read into
+	if(size < sizeof(btDefracMeshFileHeader) ||
+	   header->m_magic != BT_DEFRAC_MESH_MAGIC ||
+	   header->m_version != BT_DEFRAC_MESH_VERSION ||
+	   header->m_headerSize != sizeof(btDefracMeshFileHeader) ||
+	   header->m_fileSize != size ||
+	   header->m_numNodes > INT_MAX ||
+	   header->m_numTetrahedrons > INT_MAX/4 ||
+	   header->m_numFaces > INT_MAX/3 ||
+	   !SectionFits(header->m_nodesOffset, header->m_numNodes, 4*sizeof(float), size) ||
+	   !SectionFits(header->m_tetrahedronsOffset, header->m_numTetrahedrons, 4*sizeof(int), size) ||
+	   !SectionFits(header->m_facesOffset, header->m_numFaces, 3*sizeof(int), size) ||
+	   (header->m_materialsOffset != 0 && !SectionFits(header->m_materialsOffset, header->m_numTetrahedrons, sizeof(int), size)))
+	{
+		close();
+		return false;
+	}
+
+	m_header = header;
+
+	//bodies index their nodes with these straight away, so they are checked once here
+	if(!IndicesInRange(getTetrahedronIndices(), getTetrahedronCount()*4, getNodeCount()) ||
+	   !IndicesInRange(getFaceIndices(), getFaceCount()*3, getNodeCount()))
+	{
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+void btDefracMeshFile::close()
+{
+	m_file.close();
+	m_header = NULL;
+}
+
+bool btDefracMeshFile::write(const std::string& filename, const btAlignedObjectArray<btVector3>& nodePosition,
+							 const btAlignedObjectArray<int>& indices, const btAlignedObjectArray<int>* faceIndices,
+							 const btAlignedObjectArray<int>* materials)
+{
+	btAssert(indices.size()%4 == 0);
+	btAssert(faceIndices == NULL || faceIndices->size()%3 == 0);
+	btAssert(materials == NULL || materials->size() == indices.size()/4);
+
+	btDefracMeshFileHeader header;
+	memset(&header, 0, sizeof(header));
+	header.m_magic = BT_DEFRAC_MESH_MAGIC;
+	header.m_version = BT_DEFRAC_MESH_VERSION;
+	header.m_headerSize = sizeof(btDefracMeshFileHeader);
+	header.m_numNodes = nodePosition.size();
+	header.m_numTetrahedrons = indices.size()/4;
+	header.m_numFaces = faceIndices ? faceIndices->size()/3 : 0;
+
+	header.m_nodesOffset = AlignOffset(sizeof(btDefracMeshFileHeader));
+	header.m_tetrahedronsOffset = AlignOffset(header.m_nodesOffset + header.m_numNodes*4ull*sizeof(float));
+	header.m_facesOffset = AlignOffset(header.m_tetrahedronsOffset + header.m_numTetrahedrons*4ull*sizeof(int));
+	unsigned long long end = header.m_facesOffset + header.m_numFaces*3ull*sizeof(int);
+
+	if(materials)
+	{
+		header.m_materialsOffset = AlignOffset(end);
+		end = header.m_materialsOffset + header.m_numTetrahedrons*1ull*sizeof(int);
+	}
+
+	header.m_fileSize = end;
+
+	//build the whole image in memory, then write it at once
+	char* image = (char*)calloc((size_t)header.m_fileSize, 1);
+
+	if(image == NULL)
+		return false;
+
+	memcpy(image, &header, sizeof(header));
+
+	float* nodes = (float*)(image + header.m_nodesOffset);
+
+	for(int i=0; i<nodePosition.size(); ++i)
+	{
+		nodes[i*4+0] = (float)nodePosition[i].x();
+		nodes[i*4+1] = (float)nodePosition[i].y();
+		nodes[i*4+2] = (float)nodePosition[i].z();
+		nodes[i*4+3] = 0;
+	}
+
+	if(indices.size() > 0)
+		memcpy(image + header.m_tetrahedronsOffset, &indices[0], indices.size()*sizeof(int));
+
+	if(header.m_numFaces > 0)
+		memcpy(image + header.m_facesOffset, &(*faceIndices)[0], faceIndices->size()*sizeof(int));
+
+	if(materials && materials->size() > 0)
+		memcpy(image + header.m_materialsOffset, &(*materials)[0], materials->size()*sizeof(int));
+
+	FILE* file = fopen(filename.c_str(), "wb");
+	bool ok = file != NULL && fwrite(image, 1, (size_t)header.m_fileSize, file) == header.m_fileSize;
+
+	if(file != NULL)
+		ok = (fclose(file) == 0) && ok;
+
+	free(image);
+	return ok;
+}
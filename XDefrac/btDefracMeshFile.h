@@ -0,0 +1,69 @@
+#ifndef BT_DEFRAC_MESH_FILE_H
+#define BT_DEFRAC_MESH_FILE_H
+
+#include "LinearMath/btVector3.h"
+#include "LinearMath/btAlignedObjectArray.h"
+#include "btMappedFile.h"
+#include <string>
+
+#define BT_DEFRAC_MESH_MAGIC 0x48534d58 //"XMSH"
+#define BT_DEFRAC_MESH_VERSION 1
+#define BT_DEFRAC_MESH_ALIGNMENT 16 //every section starts at a multiple of this
+
+//Layout of a binary tetrahedral mesh file. The header is followed by the sections at the given
+//byte offsets from the start of the file, all in native byte order:
+//nodes: m_numNodes*4 floats (x, y, z, unused)
+//tetrahedrons: m_numTetrahedrons*4 ints, zero based node indices
+//faces: m_numFaces*3 ints, zero based node indices of the surface triangles
+//materials: m_numTetrahedrons ints, material ID of each tetrahedron (only if m_materialsOffset != 0)
+struct btDefracMeshFileHeader
+{
+	unsigned int m_magic;
+	unsigned int m_version;
+	unsigned int m_headerSize;
+	unsigned int m_numNodes;
+	unsigned int m_numTetrahedrons;
+	unsigned int m_numFaces;
+	unsigned int m_reserved[2];
+	unsigned long long m_nodesOffset;
+	unsigned long long m_tetrahedronsOffset;
+	unsigned long long m_facesOffset;
+	unsigned long long m_materialsOffset;
+	unsigned long long m_fileSize;
+};
+
+//A read only view of a binary mesh file mapped in memory. The arrays returned by the getters
+//point straight into the mapping and are valid until close() or destruction
+class btDefracMeshFile
+{
+private:
+	btMappedFile m_file;
+	const btDefracMeshFileHeader* m_header;
+
+	const char* getSection(unsigned long long offset) const { return (const char*)m_file.getData() + offset; }
+
+public:
+	btDefracMeshFile() : m_header(NULL) {}
+
+	bool open(const std::string& filename);//maps the file and validates its header, sections and node indices
+	void close();
+
+	bool isOpen() const { return m_header != NULL; }
+
+	int getNodeCount() const { return m_header->m_numNodes; }
+	int getTetrahedronCount() const { return m_header->m_numTetrahedrons; }
+	int getFaceCount() const { return m_header->m_numFaces; }
+	bool hasMaterials() const { return m_header->m_materialsOffset != 0; }
+
+	const float* getNodes() const { return (const float*)getSection(m_header->m_nodesOffset); }
+	const int* getTetrahedronIndices() const { return (const int*)getSection(m_header->m_tetrahedronsOffset); }
+	const int* getFaceIndices() const { return (const int*)getSection(m_header->m_facesOffset); }
+	const int* getMaterials() const { return hasMaterials() ? (const int*)getSection(m_header->m_materialsOffset) : NULL; }
+
+	//writes a mesh file. faceIndices and materials may be NULL
+	static bool write(const std::string& filename, const btAlignedObjectArray<btVector3>& nodePosition,
+		const btAlignedObjectArray<int>& indices, const btAlignedObjectArray<int>* faceIndices,
+		const btAlignedObjectArray<int>* materials);
+};
+
+#endif
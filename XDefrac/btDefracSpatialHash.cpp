@@ -0,0 +1,93 @@
+#include "btDefracSpatialHash.h"
+#include "btDefracBodyComponent.h"
+#include "LinearMath/btMinMax.h"
+
+void btDefracSpatialHash::build(const btDefracBodyComponent* component, btScalar margin)
+{
+	const int numTriangles = component->getSurfaceTriangleCount();
+	m_cellRanges.resize(numTriangles*6);
+
+	btScalar extent = 0;
+
+	#pragma omp parallel for schedule(static) reduction(+:extent)
+	for(int t=0; t<numTriangles; ++t)
+	{
+		const btVector3& p0 = component->getNode(component->getSurfaceNodeIndex(t*3 + 0))->getPosition();
+		const btVector3& p1 = component->getNode(component->getSurfaceNodeIndex(t*3 + 1))->getPosition();
+		const btVector3& p2 = component->getNode(component->getSurfaceNodeIndex(t*3 + 2))->getPosition();
+		const btVector3 size = (p0 - p1).absolute() + (p1 - p2).absolute() + (p2 - p0).absolute();
+		extent += size.x() + size.y() + size.z();
+	}
+
+	//the sum of the absolute edge vectors is twice the bounding box, for its 3 axes
+	m_cellSize = numTriangles > 0 ? btMax(extent/(numTriangles*6), 2*margin) : btScalar(1);
+
+	//about 2 buckets per triangle keeps the collisions of different cells rare
+	m_bucketStart.resize(0);
+	m_bucketStart.resize(numTriangles*2 + 3, 0);
+
+	#pragma omp parallel for schedule(static)
+	for(int t=0; t<numTriangles; ++t)
+	{
+		btVector3 aabbMin = component->getNode(component->getSurfaceNodeIndex(t*3))->getPosition();
+		btVector3 aabbMax = aabbMin;
+
+		for(int k=1; k<3; ++k)
+		{
+			aabbMin.setMin(component->getNode(component->getSurfaceNodeIndex(t*3 + k))->getPosition());
+			aabbMax.setMax(component->getNode(component->getSurfaceNodeIndex(t*3 + k))->getPosition());
+		}
+
+		int* range = &m_cellRanges[t*6];
+		long long cells = 1;
+
+		for(int a=0; a<3; ++a)
+		{
+			range[a*2 + 0] = getCell(aabbMin[a] - margin);
+			range[a*2 + 1] = getCell(aabbMax[a] + margin);
+
+			if(cells <= BT_SPATIAL_HASH_MAX_CELLS)
+				cells *= range[a*2 + 1] - range[a*2 + 0] + 1;
+		}
+
+		//an empty range keeps it out of the buckets
+		if(cells > BT_SPATIAL_HASH_MAX_CELLS)
+			range[1] = range[0] - 1;
+	}
+
+	m_largeTriangles.resize(0);
+
+	for(int t=0; t<numTriangles; ++t)
+		if(m_cellRanges[t*6 + 1] < m_cellRanges[t*6])
+			m_largeTriangles.push_back(t);
+
+	//counting sort: the count of bucket b goes 2 places ahead, so after the prefix sum m_bucketStart[b+1]
+	//is the start of bucket b, and placing its entries advances it to its end, the start of bucket b+1
+	for(int pass=0; pass<2; ++pass)
+	{
+		if(pass == 1)
+		{
+			for(int b=1; b<m_bucketStart.size(); ++b)
+				m_bucketStart[b] += m_bucketStart[b-1];
+
+			m_entries.resize(m_bucketStart[m_bucketStart.size() - 1]);
+		}
+
+		for(int t=0; t<numTriangles; ++t)
+		{
+			const int* range = &m_cellRanges[t*6];
+
+			for(int z=range[4]; z<=range[5]; ++z)
+				for(int y=range[2]; y<=range[3]; ++y)
+					for(int x=range[0]; x<=range[1]; ++x)
+					{
+						const int b = getBucket(x, y, z);
+
+						if(pass == 0)
+							++m_bucketStart[b + 2];
+						else
+							m_entries[m_bucketStart[b + 1]++] = t;
+					}
+		}
+	}
+}
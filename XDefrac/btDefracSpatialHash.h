@@ -0,0 +1,57 @@
+#ifndef BT_DEFRAC_SPATIAL_HASH_H
+#define BT_DEFRAC_SPATIAL_HASH_H
+
+#include "LinearMath/btVector3.h"
+#include "LinearMath/btAlignedObjectArray.h"
+
+class btDefracBodyComponent;
+
+#define BT_SPATIAL_HASH_MAX_CELLS 64
+
+//A uniform grid over the surface triangles of a component, stored as a hash table of buckets so its
+//size depends on the number of triangles and not on the extent of the component. Each triangle is in
+//the buckets of every cell its bounding box, expanded by the margin, overlaps, so the triangles within
+//the margin of a point are all in the bucket of its cell. Cells with the same hash share a bucket. build
+//fills the same arrays again every step, with a counting sort that costs linear time in the triangles.
+//A triangle that would span more than BT_SPATIAL_HASH_MAX_CELLS cells, such as one stretched by an
+//exploding simulation, is kept in a list of large triangles instead, which every lookup also checks.
+//The surface nodes are not hashed: each one only looks up the bucket of its own cell
+class btDefracSpatialHash
+{
+private:
+	btScalar m_cellSize;
+	btAlignedObjectArray<int> m_bucketStart;//first entry of each bucket, followed by the number of entries, and one spare
+	btAlignedObjectArray<int> m_entries;//triangle indices, grouped by bucket
+	btAlignedObjectArray<int> m_cellRanges;//scratch, the first and last cell of each triangle on each axis, empty for large ones
+	btAlignedObjectArray<int> m_largeTriangles;//triangles over more than BT_SPATIAL_HASH_MAX_CELLS cells
+
+	//clamped so that far away or invalid coordinates still give a cell, and differences of cells fit an int
+	int getCell(btScalar x) const
+	{
+		const btScalar limit = btScalar(1 << 28);
+		const btScalar c = floor(x/m_cellSize);
+		return (int)(c > limit ? limit : (c >= -limit ? c : -limit));
+	}
+
+	int getBucket(int x, int y, int z) const
+	{
+		const unsigned int h = ((unsigned int)x*73856093u) ^ ((unsigned int)y*19349663u) ^ ((unsigned int)z*83492791u);
+		return (int)(h%(unsigned int)(m_bucketStart.size() - 2));
+	}
+
+public:
+	btDefracSpatialHash() : m_cellSize(1) {}
+
+	//The cell size is the mean extent of the triangles' bounding boxes, so most triangles are in a few cells
+	void build(const btDefracBodyComponent* component, btScalar margin);
+
+	int getBucket(const btVector3& p) const { return getBucket(getCell(p.x()), getCell(p.y()), getCell(p.z())); }
+	int getBucketBegin(int bucket) const { return m_bucketStart[bucket]; }
+	int getBucketEnd(int bucket) const { return m_bucketStart[bucket+1]; }
+	int getTriangle(int entry) const { return m_entries[entry]; }
+	int getLargeTriangleCount() const { return m_largeTriangles.size(); }
+	int getLargeTriangle(int index) const { return m_largeTriangles[index]; }
+	btScalar getCellSize() const { return m_cellSize; }
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef _BT_DEFRAC_STEP_STATS_H
+#define _BT_DEFRAC_STEP_STATS_H
+
+#include "LinearMath/btAlignedObjectArray.h"
+#include "btDefracBodyComponent.h"
+#include <ostream>
+
+//What the integration of a component cost in a step. Times are in microseconds: rotation extraction,
+//update of the stiffness matrices and of the linear system (assembly), CG iterations (solve), and the
+//write back of velocities and positions (integration). Bytes allocated counts the linear system and the
+//vectors of the solver, which are freed at the end of the step
+struct btDefracComponentStats
+{
+	const btDefracBodyComponent* m_component;
+	btDefracSolverStatus m_solver;
+	unsigned long m_rotationTime;
+	unsigned long m_assemblyTime;
+	unsigned long m_solveTime;
+	unsigned long m_integrationTime;
+	size_t m_bytesAllocated;
+};
+
+//The statistics of the last internal step of a btDefracDynamicsWorld, one entry per component simulated
+//in it. Sleeping components are left out
+struct btDefracStepStats
+{
+	int m_step;//index of the internal step, from 0, or -1 before the first one
+	btScalar m_timeStep;
+	btAlignedObjectArray<btDefracComponentStats> m_components;
+
+	btDefracStepStats() : m_step(-1), m_timeStep(0) {}
+
+	const btDefracComponentStats* findComponent(const btDefracBodyComponent* component) const
+	{
+		for(int i=0; i<m_components.size(); ++i)
+			if(m_components[i].m_component == component)
+				return &m_components[i];
+
+		return NULL;
+	}
+
+	int getTotalIterations() const
+	{
+		int iterations = 0;
+
+		for(int i=0; i<m_components.size(); ++i)
+			iterations += m_components[i].m_solver.m_iterations;
+
+		return iterations;
+	}
+
+	int getUnconvergedCount() const
+	{
+		int count = 0;
+
+		for(int i=0; i<m_components.size(); ++i)
+			if(!m_components[i].m_solver.m_converged)
+				++count;
+
+		return count;
+	}
+};
+
+//writes one line per component, as space separated key=value pairs
+inline std::ostream& operator << (std::ostream& out, const btDefracStepStats& stats)
+{
+	for(int i=0; i<stats.m_components.size(); ++i)
+	{
+		const btDefracComponentStats& c = stats.m_components[i];
+
+		out << "step=" << stats.m_step << " component=" << i
+			<< " iterations=" << c.m_solver.m_iterations
+			<< " initialResidual=" << c.m_solver.m_initialResidual
+			<< " residual=" << c.m_solver.m_residual
+			<< " converged=" << c.m_solver.m_converged
+			<< " rotationUs=" << c.m_rotationTime
+			<< " assemblyUs=" << c.m_assemblyTime
+			<< " solveUs=" << c.m_solveTime
+			<< " integrationUs=" << c.m_integrationTime
+			<< " bytes=" << c.m_bytesAllocated << "\n";
+	}
+
+	return out;
+}
+
+#endif
@@ -1,77 +1,440 @@
-
 #include "btDefracUtils.h"
 #include "btDefracBody.h"
+#include "btDefracBodyTemplate.h"
+#include "btSparsityPattern.h"
+#include "btDefracMeshFile.h"
+#include "btMappedFile.h"
+#include "btElement.h"
 
-#include <sstream>
-#include <fstream>
+#include <algorithm>
+#include <vector>
 
-btDefracBody* btDefracUtils::CreateFromTetgenFile(const std::string &baseFilename, btScalar mass, btMaterial* material)
+//A table of numbers read from a Tetgen text file: the header line followed by header[0] records with
+//the same number of columns each. '#' starts a comment that runs to the end of the line
+struct btTetgenTable
 {
-	std::stringstream ss0;
-	ss0 << baseFilename << ".node";
-	std::ifstream nodeFile(ss0.str().c_str());
+	int m_header[4];
+	int m_numHeaderValues;
+	int m_numRecords;
+	int m_numColumns;
+	std::vector<double> m_values;//m_numRecords*m_numColumns, row major
 
-	if(nodeFile.fail()) 
-		return NULL;
+	double get(int record, int column) const { return m_values[record*m_numColumns + column]; }
+};
+
+static bool IsBlank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char* SkipBlanks(const char* p, const char* end)
+{
+	while(p < end && (IsBlank(*p) || *p == ','))
+		++p;
+
+	return p;
+}
+
+static const char* SkipLine(const char* p, const char* end)
+{
+	while(p < end && *p != '\n')
+		++p;
+
+	return p < end ? p+1 : end;
+}
+
+//skips empty and comment lines, returns the start of the next line with data or end
+static const char* SkipToRecord(const char* p, const char* end)
+{
+	for(;;)
+	{
+		p = SkipBlanks(p, end);
+
+		if(p == end)
+			return end;
 
-	std::stringstream ss1;
-	ss1 << baseFilename << ".ele";
-	std::ifstream eleFile(ss1.str().c_str());
+		if(*p != '\n' && *p != '#')
+			return p;
+
+		p = SkipLine(p, end);
+	}
+}
+
+//parses a decimal number the same way regardless of the C locale. Returns NULL if there is none at p
+static const char* ParseNumber(const char* p, const char* end, double& value)
+{
+	static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+	bool negative = false;
+
+	if(p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+
+	unsigned long long mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	const char* start = p;
+
+	for(; p < end && *p >= '0' && *p <= '9'; ++p)
+	{
+		if(digits < 19)
+		{
+			mantissa = mantissa*10 + (*p - '0');
+			digits += mantissa > 0;
+		}
+		else
+			++exponent;
+	}
+
+	if(p < end && *p == '.')
+	{
+		for(++p; p < end && *p >= '0' && *p <= '9'; ++p)
+		{
+			if(digits < 19)
+			{
+				mantissa = mantissa*10 + (*p - '0');
+				digits += mantissa > 0;
+				--exponent;
+			}
+		}
+	}
 
-	if(eleFile.fail())
+	if(p == start || (p == start+1 && *start == '.'))
 		return NULL;
 
-	//Nodes
-	int nNodes = 0;
-	int nDimensions = 0;
-	int nAttributes = 0;
-	int hasBounds = 0;
+	if(p < end && (*p == 'e' || *p == 'E'))
+	{
+		const char* q = p+1;
+		bool negativeExponent = false;
 
-	nodeFile >> nNodes;
-	nodeFile >> nDimensions;
-	nodeFile >> nAttributes;
-	nodeFile >> hasBounds;
+		if(q < end && (*q == '-' || *q == '+'))
+			negativeExponent = *q++ == '-';
 
-	btAlignedObjectArray<btVector3> nodePosition;
-	nodePosition.reserve(nNodes);
+		if(q < end && *q >= '0' && *q <= '9')
+		{
+			int e = 0;
 
-	for(int i=0; i<nNodes; ++i)
+			for(; q < end && *q >= '0' && *q <= '9'; ++q)
+				e = e < 10000 ? e*10 + (*q - '0') : e;
+
+			exponent += negativeExponent ? -e : e;
+			p = q;
+		}
+	}
+
+	double v = (double)mantissa;
+
+	for(; exponent > 22; exponent -= 22)
+		v *= powers[22];
+
+	for(; exponent < -22; exponent += 22)
+		v /= powers[22];
+
+	v = exponent < 0 ? v/powers[-exponent] : v*powers[exponent];
+	value = negative ? -v : v;
+	return p;
+}
+
+//parses the numbers in the line at p into values, at most maxCount of them. Returns the number parsed
+//or -1 if something that is not a number is found. next receives the start of the following line
+static int ParseLine(const char* p, const char* end, double* values, int maxCount, const char*& next)
+{
+	int count = 0;
+
+	for(;;)
 	{
-		int index = 0;
-		btScalar x, y, z;
-		nodeFile >> index;
-		nodeFile >> x;
-		nodeFile >> y;
-		nodeFile >> z;
-		nodePosition.push_back(btVector3(x, y, z));
+		p = SkipBlanks(p, end);
+
+		if(p == end || *p == '\n' || *p == '#')
+			break;
+
+		double v;
+		p = ParseNumber(p, end, v);
+
+		if(p == NULL || (p < end && !IsBlank(*p) && *p != '\n' && *p != '#' && *p != ','))
+		{
+			next = end;
+			return -1;
+		}
+
+		if(count < maxCount)
+			values[count] = v;
+
+		++count;
 	}
 
-	//Tetrahedrons
-	int nTetrahedrons = 0;
+	next = SkipLine(p, end);
+	return count;
+}
 
-	eleFile >> nTetrahedrons;
-	eleFile >> nDimensions;
-	eleFile >> nAttributes;
+static int CountRecords(const char* p, const char* end)
+{
+	int count = 0;
 
-	btAlignedObjectArray<int> nodeIndex;
-	nodeIndex.reserve(nTetrahedrons*4);
+	for(p = SkipToRecord(p, end); p < end; p = SkipToRecord(SkipLine(p, end), end))
+		++count;
+
+	return count;
+}
+
+//reads a whole Tetgen file. The records are split in chunks at line boundaries, which are counted and
+//then parsed in parallel straight from the mapped file
+static bool ReadTetgenTable(const std::string& filename, btTetgenTable& table)
+{
+	btMappedFile file;
+
+	if(!file.open(filename))
+		return false;
+
+	const char* begin = (const char*)file.getData();
+	const char* end = begin + file.getSize();
+
+	//header
+	double header[4] = {0, 0, 0, 0};
+	const char* p = SkipToRecord(begin, end);
+	table.m_numHeaderValues = ParseLine(p, end, header, 4, p);
+
+	if(table.m_numHeaderValues < 1 || header[0] < 0)
+		return false;
 
+	for(int i=0; i<4; ++i)
+		table.m_header[i] = (int)header[i];
+
+	table.m_numRecords = table.m_header[0];
+	table.m_numColumns = 0;
+	table.m_values.clear();
+
+	if(table.m_numRecords == 0)
+		return true;
+
+	//the first record tells the number of columns
+	p = SkipToRecord(p, end);
+	const char* next;
+	table.m_numColumns = ParseLine(p, end, NULL, 0, next);
+
+	if(table.m_numColumns <= 0)
+		return false;
+
+	const int chunkSize = 1 << 18;
+	const int numChunks = (int)((end - p)/chunkSize) + 1;
+	std::vector<const char*> chunkStart(numChunks+1);
+	std::vector<int> chunkRecord(numChunks+1, 0);
+	chunkStart[0] = p;
+	chunkStart[numChunks] = end;
+
+	for(int i=1; i<numChunks; ++i)
+	{
+		const char* s = p + (size_t)i*chunkSize;
+		chunkStart[i] = s > chunkStart[i-1] ? SkipLine(s-1, end) : chunkStart[i-1];//starts right after a '\n'
+	}
+
+	#pragma omp parallel for schedule(static)
+	for(int i=0; i<numChunks; ++i)
+		chunkRecord[i+1] = CountRecords(chunkStart[i], chunkStart[i+1]);
+
+	for(int i=0; i<numChunks; ++i)
+		chunkRecord[i+1] += chunkRecord[i];
+
+	if(chunkRecord[numChunks] < table.m_numRecords)
+		return false;
+
+	table.m_values.resize(table.m_numRecords*(size_t)table.m_numColumns);
+	int failed = 0;
+
+	#pragma omp parallel for schedule(static) reduction(+:failed)
+	for(int i=0; i<numChunks; ++i)
+	{
+		const char* q = SkipToRecord(chunkStart[i], chunkStart[i+1]);
+		const int last = std::min(chunkRecord[i+1], table.m_numRecords);
+
+		for(int r=chunkRecord[i]; r<last; ++r)
+		{
+			if(ParseLine(q, chunkStart[i+1], &table.m_values[r*(size_t)table.m_numColumns], 
+				table.m_numColumns, q) != table.m_numColumns)
+			{
+				++failed;
+				break;
+			}
+
+			q = SkipToRecord(q, chunkStart[i+1]);
+		}
+	}
+
+	return failed == 0;
+}
+
+bool btDefracUtils::LoadTetgenFile(const std::string& baseFilename, btAlignedObjectArray<btVector3>& nodePosition, 
+								   btAlignedObjectArray<int>& indices, btAlignedObjectArray<int>* faceIndices, 
+								   btAlignedObjectArray<int>* tetrahedronAttributes)
+{
+	btTetgenTable table;
+
+	//Nodes: <# of points> <dimension (3)> <# of attributes> <boundary markers (0 or 1)>
+	//followed by <point #> <x> <y> <z> [attributes] [boundary marker]
+	if(!ReadTetgenTable(baseFilename + ".node", table) || table.m_numColumns < 4)
+		return false;
+
+	const int nNodes = table.m_numRecords;
+	const int firstIndex = nNodes > 0 ? (int)table.get(0, 0) : 1;//tetgen numbers from 0 or 1, depending on the input
+
+	nodePosition.resize(nNodes);
+
+	#pragma omp parallel for schedule(static)
+	for(int i=0; i<nNodes; ++i)
+		nodePosition[i].setValue((btScalar)table.get(i, 1), (btScalar)table.get(i, 2), (btScalar)table.get(i, 3));
+
+	//Tetrahedrons: <# of tetrahedra> <nodes per tetrahedron> <# of attributes>
+	//followed by <tetrahedron #> <node> <node> ... [attributes]
+	if(!ReadTetgenTable(baseFilename + ".ele", table) || table.m_numColumns < 5)
+		return false;
+
+	const int nTetrahedrons = table.m_numRecords;
+	const int nNodesPerTetrahedron = table.m_numHeaderValues > 1 ? table.m_header[1] : 4;
+	const int nAttributes = table.m_numColumns - 1 - nNodesPerTetrahedron;
+
+	indices.resize(nTetrahedrons*4);
+
+	#pragma omp parallel for schedule(static)
 	for(int i=0; i<nTetrahedrons; ++i)
-	{	
-		int index = 0;
-		int ni = 0;
-		eleFile >> index;
+	{
+		for(int j=0; j<4; ++j)//skip the extra nodes of second order tetrahedrons
+			indices[i*4+j] = (int)table.get(i, 1+j) - firstIndex;
+	}
 
-		for(int j=0; j<4; ++j)
+	if(tetrahedronAttributes)
+	{
+		tetrahedronAttributes->resize(nAttributes > 0 ? nTetrahedrons : 0);
+
+		for(int i=0; i<tetrahedronAttributes->size(); ++i)
+			(*tetrahedronAttributes)[i] = (int)table.get(i, 1+nNodesPerTetrahedron);
+	}
+
+	//Faces: <# of faces> <boundary marker (0 or 1)>
+	//followed by <face #> <node> <node> <node> [boundary marker]
+	if(faceIndices)
+	{
+		faceIndices->resize(0);
+
+		if(ReadTetgenTable(baseFilename + ".face", table) && table.m_numColumns >= 4)
 		{
-			eleFile >> ni;
-			nodeIndex.push_back(ni-1);
+			faceIndices->resize(table.m_numRecords*3);
+
+			for(int i=0; i<table.m_numRecords; ++i)
+			{
+				for(int j=0; j<3; ++j)
+					(*faceIndices)[i*3+j] = (int)table.get(i, 1+j) - firstIndex;
+			}
 		}
 	}
 
-	btDefracBody* body = new btDefracBody(nodePosition, nodeIndex, mass, material);
+	return true;
+}
 
-	return body;
+btDefracBody* btDefracUtils::CreateFromTetgenFile(const std::string &baseFilename, btScalar mass, btMaterial* material, 
+												  int flags, btDefracBodyCache* cache)
+{
+	btDefracBodyTemplate* bodyTemplate = CreateTemplateFromTetgenFile(baseFilename, mass, material, flags, cache);
+
+	if(bodyTemplate == NULL)
+		return NULL;
+
+	return new btDefracBody(bodyTemplate, true);
+}
+
+btDefracBodyTemplate* btDefracUtils::CreateTemplateFromTetgenFile(const std::string &baseFilename, btScalar mass, 
+																  btMaterial* material, int flags, btDefracBodyCache* cache)
+{
+	btAlignedObjectArray<btVector3> nodePosition;
+	btAlignedObjectArray<int> nodeIndex;
+	btAlignedObjectArray<int> faceIndex;
+
+	if(!LoadTetgenFile(baseFilename, nodePosition, nodeIndex, &faceIndex, NULL))
+		return NULL;
+
+	btDefracBodyTemplate* bodyTemplate = new btDefracBodyTemplate(nodePosition, nodeIndex, mass, material, flags, cache);
+
+	if(faceIndex.size() > 0)
+		bodyTemplate->setSurfaceFaces(faceIndex);
+
+	return bodyTemplate;
+}
+
+bool btDefracUtils::ConvertTetgenToBinaryFile(const std::string& baseFilename, const std::string& filename)
+{
+	btAlignedObjectArray<btVector3> nodePosition;
+	btAlignedObjectArray<int> nodeIndex;
+	btAlignedObjectArray<int> faceIndex;
+	btAlignedObjectArray<int> attributes;
+
+	if(!LoadTetgenFile(baseFilename, nodePosition, nodeIndex, &faceIndex, &attributes))
+		return false;
+
+	return btDefracMeshFile::write(filename, nodePosition, nodeIndex, &faceIndex, 
+		attributes.size() == nodeIndex.size()/4 && attributes.size() > 0 ? &attributes : NULL);
+}
+
+btDefracBody* btDefracUtils::CreateFromBinaryFile(const std::string& filename, btScalar mass, btMaterial* material, 
+												  int flags, btMaterial** materials, int numMaterials, 
+												  btDefracBodyCache* cache)
+{
+	btDefracBodyTemplate* bodyTemplate = CreateTemplateFromBinaryFile(filename, mass, material, flags, materials, numMaterials, cache);
+
+	if(bodyTemplate == NULL)
+		return NULL;
+
+	return new btDefracBody(bodyTemplate, true);
+}
+
+btDefracBodyTemplate* btDefracUtils::CreateTemplateFromBinaryFile(const std::string& filename, btScalar mass, 
+																  btMaterial* material, int flags, btMaterial** materials, 
+																  int numMaterials, btDefracBodyCache* cache)
+{
+	btDefracMeshFile file;
+
+	if(!file.open(filename))
+		return NULL;
+
+	const int numNodes = file.getNodeCount();
+	const int numTets = file.getTetrahedronCount();
+
+	//the arrays wrap the mapped memory wherever the layout matches, so nothing is copied
+	btAlignedObjectArray<btVector3> nodePosition;
+#ifdef BT_USE_DOUBLE_PRECISION
+	nodePosition.resize(numNodes);
+	const float* nodes = file.getNodes();
+
+	for(int i=0; i<numNodes; ++i)
+		nodePosition[i].setValue(nodes[i*4+0], nodes[i*4+1], nodes[i*4+2]);
+#else
+	nodePosition.initializeFromBuffer((void*)file.getNodes(), numNodes, numNodes);
+#endif
+
+	btAlignedObjectArray<int> nodeIndex;
+	nodeIndex.initializeFromBuffer((void*)file.getTetrahedronIndices(), numTets*4, numTets*4);
+
+	btAlignedObjectArray<int> faceIndex;
+	faceIndex.initializeFromBuffer((void*)file.getFaceIndices(), file.getFaceCount()*3, file.getFaceCount()*3);
+
+	btDefracBodyTemplate* bodyTemplate = new btDefracBodyTemplate(nodePosition, nodeIndex, mass, material, flags, cache);
+
+	if(faceIndex.size() > 0)
+		bodyTemplate->setSurfaceFaces(faceIndex);
+
+	const int* ids = file.getMaterials();
+
+	if(ids && materials)
+	{
+		for(int i=0; i<numTets; ++i)
+		{
+			int id = ids[i];
+
+			if(id >= 0 && id < numMaterials && materials[id] != NULL)
+				bodyTemplate->setMaterial(bodyTemplate->getTetrahedronIndexFromOriginal(i), materials[id]);
+		}
+	}
+
+	return bodyTemplate;
 }
 
 btMatrix3x3 btDefracUtils::OrthonormalizeColumns(const btMatrix3x3& m)
@@ -85,6 +448,326 @@ btMatrix3x3 btDefracUtils::OrthonormalizeColumns(const btMatrix3x3& m)
 	return r.transpose();
 }
 
+//Each iteration rotates q by the axis-angle omega that aligns the columns of R(q) with the columns
+//of F, omega = sum(r_i x f_i)/|sum(r_i . f_i)|, which converges to the rotation of the polar
+//decomposition of F (Muller et al., A Robust Method to Extract the Rotational Part of Deformations).
+//The deformation gradients are processed in batches of BT_ROTATION_BATCH laid out as structures of
+//arrays, so each step of the iteration runs on the whole batch at once and vectorizes
+#define BT_ROTATION_BATCH 4
+
+void btDefracUtils::ExtractRotations(const btMatrix3x3* F, btQuaternion* q, int count, int iterations)
+{
+	const int numBatches = (count + BT_ROTATION_BATCH - 1)/BT_ROTATION_BATCH;
+
+	#pragma omp parallel for schedule(static)
+	for(int b=0; b<numBatches; ++b)
+	{
+		const int first = b*BT_ROTATION_BATCH;
+		const int width = btMin(BT_ROTATION_BATCH, count - first);
+
+		btScalar f[9][BT_ROTATION_BATCH];//element (i,j) of F is f[i*3 + j]
+		btScalar qx[BT_ROTATION_BATCH], qy[BT_ROTATION_BATCH], qz[BT_ROTATION_BATCH], qw[BT_ROTATION_BATCH];
+
+		//the lanes past the end of a partial batch repeat its first element
+		for(int l=0; l<BT_ROTATION_BATCH; ++l)
+		{
+			const int k = first + (l < width ? l : 0);
+
+			for(int i=0; i<3; ++i)
+				for(int j=0; j<3; ++j)
+					f[i*3 + j][l] = F[k][i][j];
+
+			qx[l] = q[k].x();
+			qy[l] = q[k].y();
+			qz[l] = q[k].z();
+			qw[l] = q[k].w();
+		}
+
+		for(int it=0; it<iterations; ++it)
+		{
+			for(int l=0; l<BT_ROTATION_BATCH; ++l)
+			{
+				const btScalar xx = qx[l]*qx[l], yy = qy[l]*qy[l], zz = qz[l]*qz[l];
+				const btScalar xy = qx[l]*qy[l], xz = qx[l]*qz[l], yz = qy[l]*qz[l];
+				const btScalar wx = qw[l]*qx[l], wy = qw[l]*qy[l], wz = qw[l]*qz[l];
+
+				//q is only normalized at the end, so the rotation is that of q/|q|
+				const btScalar s = 2/(xx + yy + zz + qw[l]*qw[l]);
+
+				const btScalar r00 = 1 - s*(yy + zz), r01 = s*(xy - wz), r02 = s*(xz + wy);
+				const btScalar r10 = s*(xy + wz), r11 = 1 - s*(xx + zz), r12 = s*(yz - wx);
+				const btScalar r20 = s*(xz - wy), r21 = s*(yz + wx), r22 = 1 - s*(xx + yy);
+
+				//sum of the cross and dot products of the columns of R and F
+				const btScalar ox = r10*f[6][l] - r20*f[3][l] + r11*f[7][l] - r21*f[4][l] + r12*f[8][l] - r22*f[5][l];
+				const btScalar oy = r20*f[0][l] - r00*f[6][l] + r21*f[1][l] - r01*f[7][l] + r22*f[2][l] - r02*f[8][l];
+				const btScalar oz = r00*f[3][l] - r10*f[0][l] + r01*f[4][l] - r11*f[1][l] + r02*f[5][l] - r12*f[2][l];
+				const btScalar od = r00*f[0][l] + r10*f[3][l] + r20*f[6][l] + r01*f[1][l] + r11*f[4][l] + r21*f[7][l] +
+					r02*f[2][l] + r12*f[5][l] + r22*f[8][l];
+
+				//dq = (omega/2, 1) is the rotation by omega up to second order in its angle and a scale, so
+				//no trigonometric functions are needed. It turns by 2*atan(|omega|/2) < pi, and the fixed
+				//point omega = 0 is the same
+				const btScalar h = btScalar(0.5)/(btMax(od, -od) + SIMD_EPSILON);
+				const btScalar dx = ox*h, dy = oy*h, dz = oz*h;
+
+				//q = dq*q
+				const btScalar nx = qx[l] + qw[l]*dx + dy*qz[l] - dz*qy[l];
+				const btScalar ny = qy[l] + qw[l]*dy + dz*qx[l] - dx*qz[l];
+				const btScalar nz = qz[l] + qw[l]*dz + dx*qy[l] - dy*qx[l];
+				const btScalar nw = qw[l] - dx*qx[l] - dy*qy[l] - dz*qz[l];
+
+				qx[l] = nx;
+				qy[l] = ny;
+				qz[l] = nz;
+				qw[l] = nw;
+			}
+		}
+
+		for(int l=0; l<width; ++l)
+		{
+			q[first + l].setValue(qx[l], qy[l], qz[l], qw[l]);
+			q[first + l].normalize();
+		}
+	}
+}
+
+struct btNodeDegree
+{
+	int degree;
+	int node;
+
+	bool operator < (const btNodeDegree& nd) const
+	{
+		return degree < nd.degree || (degree == nd.degree && node < nd.node);
+	}
+};
+
+//breadth first search from root over the nodes not yet visited, appending them to order with
+//the neighbors of each node sorted by increasing degree. Returns the index of the first node of
+//the last level and the number of levels
+static int CuthillMcKeeLevels(const btSparsityPattern& pattern, int root, btAlignedObjectArray<int>& order,
+							  btAlignedObjectArray<char>& visited, int& lastLevelStart)
+{
+	const std::vector<int>& rows = pattern.getRowIndices();
+	const std::vector<int>& columns = pattern.getColumnIndices();
+
+	int levels = 0;
+	int levelStart = order.size();
+	int levelEnd = levelStart + 1;
+	order.push_back(root);
+	visited[root] = 1;
+	lastLevelStart = levelStart;
+
+	btAlignedObjectArray<btNodeDegree> neighbors;
+
+	while(levelStart < levelEnd)
+	{
+		++levels;
+		lastLevelStart = levelStart;
+
+		for(int k=levelStart; k<levelEnd; ++k)
+		{
+			int i = order[k];
+			neighbors.resize(0);
+
+			for(int c=rows[i]; c<rows[i+1]; ++c)
+			{
+				int j = columns[c];
+
+				if(!visited[j])
+				{
+					visited[j] = 1;
+					btNodeDegree nd = {rows[j+1] - rows[j], j};
+					neighbors.push_back(nd);
+				}
+			}
+
+			if(neighbors.size() > 0)
+				std::sort(&neighbors[0], &neighbors[0] + neighbors.size());
+
+			for(int n=0; n<neighbors.size(); ++n)
+				order.push_back(neighbors[n].node);
+		}
+
+		levelStart = levelEnd;
+		levelEnd = order.size();
+	}
+
+	return levels;
+}
+
+void btDefracUtils::ReverseCuthillMcKee(const btSparsityPattern& pattern, btAlignedObjectArray<int>& order)
+{
+	const int n = pattern.size();
+	const std::vector<int>& rows = pattern.getRowIndices();
+
+	order.resize(0);
+	order.reserve(n);
+
+	btAlignedObjectArray<char> visited;
+	btAlignedObjectArray<char> probe;
+	btAlignedObjectArray<int> probeOrder;
+	visited.resize(n, 0);
+
+	//nodes sorted by degree, so that each connected component starts at a node of minimum degree
+	btAlignedObjectArray<btNodeDegree> byDegree;
+	byDegree.resize(n);
+
+	for(int i=0; i<n; ++i)
+	{
+		btNodeDegree nd = {rows[i+1] - rows[i], i};
+		byDegree[i] = nd;
+	}
+
+	if(n > 0)
+		std::sort(&byDegree[0], &byDegree[0] + n);
+
+	for(int s=0; s<n; ++s)
+	{
+		int root = byDegree[s].node;
+
+		if(visited[root])
+			continue;
+
+		//look for a pseudo-peripheral root: restart from a minimum degree node of the last
+		//level while the number of levels (eccentricity) keeps increasing
+		int levels = 0;
+
+		for(int iteration=0; iteration<8; ++iteration)
+		{
+			probe.copyFromArray(visited);
+			probeOrder.resize(0);
+			int lastLevelStart = 0;
+			int l = CuthillMcKeeLevels(pattern, root, probeOrder, probe, lastLevelStart);
+
+			if(l <= levels)
+				break;
+
+			levels = l;
+			int candidate = probeOrder[lastLevelStart];
+
+			for(int k=lastLevelStart+1; k<probeOrder.size(); ++k)
+			{
+				int j = probeOrder[k];
+				if(rows[j+1] - rows[j] < rows[candidate+1] - rows[candidate])
+					candidate = j;
+			}
+
+			if(candidate == root)
+				break;
+
+			root = candidate;
+		}
+
+		int lastLevelStart = 0;
+		CuthillMcKeeLevels(pattern, root, order, visited, lastLevelStart);
+	}
+
+	//reverse
+	for(int i=0, j=order.size()-1; i<j; ++i, --j)
+		order.swap(i, j);
+}
+
+int btDefracUtils::ComputeBandwidth(const btSparsityPattern& pattern)
+{
+	const std::vector<int>& rows = pattern.getRowIndices();
+	const std::vector<int>& columns = pattern.getColumnIndices();
+	int bandwidth = 0;
+
+	for(int i=0; i<pattern.size(); ++i)
+		for(int c=rows[i]; c<rows[i+1]; ++c)
+			bandwidth = btMax(bandwidth, abs(columns[c] - i));
+
+	return bandwidth;
+}
+
+struct btTetrahedronKey
+{
+	unsigned int key;
+	int tetrahedron;
+
+	bool operator < (const btTetrahedronKey& tk) const
+	{
+		return key < tk.key || (key == tk.key && tetrahedron < tk.tetrahedron);
+	}
+};
+
+//spreads the lower 10 bits of x so that there are two zero bits between each
+static unsigned int MortonSpreadBits(unsigned int x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+static void SortTetrahedronKeys(btAlignedObjectArray<btTetrahedronKey>& keys, btAlignedObjectArray<int>& order)
+{
+	if(keys.size() > 0)
+		std::sort(&keys[0], &keys[0] + keys.size());
+
+	order.resize(keys.size());
+
+	for(int i=0; i<keys.size(); ++i)
+		order[i] = keys[i].tetrahedron;
+}
+
+void btDefracUtils::SortTetrahedronsMorton(const btAlignedObjectArray<btVector3>& nodePosition, 
+										   const btAlignedObjectArray<int>& indices, btAlignedObjectArray<int>& order)
+{
+	const int numTets = indices.size()/4;
+	btVector3 min(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+	btVector3 max = -min;
+
+	for(int i=0; i<nodePosition.size(); ++i)
+	{
+		min.setMin(nodePosition[i]);
+		max.setMax(nodePosition[i]);
+	}
+
+	//quantize the centroids to a 1024^3 grid over the bounding box
+	btVector3 extent = max - min;
+	btVector3 scale(extent.x() > 0 ? 1023/extent.x() : 0,
+					extent.y() > 0 ? 1023/extent.y() : 0,
+					extent.z() > 0 ? 1023/extent.z() : 0);
+
+	btAlignedObjectArray<btTetrahedronKey> keys;
+	keys.resize(numTets);
+
+	#pragma omp parallel for schedule(static)
+	for(int t=0; t<numTets; ++t)
+	{
+		btVector3 centroid = (nodePosition[indices[t*4+0]] + nodePosition[indices[t*4+1]] + 
+							  nodePosition[indices[t*4+2]] + nodePosition[indices[t*4+3]])*btScalar(0.25);
+		btVector3 q = (centroid - min)*scale;
+
+		keys[t].key = MortonSpreadBits((unsigned int)q.x()) | 
+					 (MortonSpreadBits((unsigned int)q.y()) << 1) | 
+					 (MortonSpreadBits((unsigned int)q.z()) << 2);
+		keys[t].tetrahedron = t;
+	}
+
+	SortTetrahedronKeys(keys, order);
+}
+
+void btDefracUtils::SortTetrahedronsByNode(const btAlignedObjectArray<int>& indices, btAlignedObjectArray<int>& order)
+{
+	const int numTets = indices.size()/4;
+	btAlignedObjectArray<btTetrahedronKey> keys;
+	keys.resize(numTets);
+
+	for(int t=0; t<numTets; ++t)
+	{
+		keys[t].key = (unsigned int)btMin(btMin(indices[t*4+0], indices[t*4+1]), btMin(indices[t*4+2], indices[t*4+3]));
+		keys[t].tetrahedron = t;
+	}
+
+	SortTetrahedronKeys(keys, order);
+}
+
 //From: http://www.torquepowered.com/community/blogs/view/309
 bool btDefracUtils::SegmentAABBIntersect(const btVector3 &start, const btVector3 &end, 
 						  const btVector3 &min, const btVector3 &max, btScalar *time)  
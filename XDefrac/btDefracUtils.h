@@ -4,9 +4,14 @@
 
 #include <string>
 #include "LinearMath/btMatrix3x3.h"
+#include "LinearMath/btQuaternion.h"
+#include "LinearMath/btAlignedObjectArray.h"
 
 class btDefracBody;
+class btDefracBodyTemplate;
 class btMaterial;
+class btSparsityPattern;
+class btDefracBodyCache;
 
 class btMatrix3x3_12x12//very application specific, stores a 12x12 matrix organized as 16 btMatrix3x3 blocks in row major order
 {
@@ -50,10 +55,50 @@ public:
 class btDefracUtils
 {
 public:
-	static btDefracBody* CreateFromTetgenFile(const std::string& baseFilename, btScalar mass, btMaterial* material);
+	static btDefracBody* CreateFromTetgenFile(const std::string& baseFilename, btScalar mass, btMaterial* material, 
+		int flags=0, btDefracBodyCache* cache=NULL);//flags are btDefracBody::CreationFlags
+
+	//like CreateFromTetgenFile, but returns the rest state alone, to create any number of bodies from it
+	static btDefracBodyTemplate* CreateTemplateFromTetgenFile(const std::string& baseFilename, btScalar mass, 
+		btMaterial* material, int flags=0, btDefracBodyCache* cache=NULL);
+
+	//reads the .node, .ele and, if faceIndices is given, .face files of a Tetgen mesh. Indices are
+	//converted to zero based. tetrahedronAttributes receives the first .ele attribute (region), if any
+	static bool LoadTetgenFile(const std::string& baseFilename, btAlignedObjectArray<btVector3>& nodePosition, 
+		btAlignedObjectArray<int>& indices, btAlignedObjectArray<int>* faceIndices=NULL, 
+		btAlignedObjectArray<int>* tetrahedronAttributes=NULL);
+
+	//writes a Tetgen mesh as a binary mesh file (see btDefracMeshFile), using the region attribute as material ID
+	static bool ConvertTetgenToBinaryFile(const std::string& baseFilename, const std::string& filename);
+
+	//maps a binary mesh file and builds a body from it without any parsing. If materials is given, each
+	//tetrahedron with a material ID in [0, numMaterials) uses materials[ID] instead of material
+	static btDefracBody* CreateFromBinaryFile(const std::string& filename, btScalar mass, btMaterial* material, 
+		int flags=0, btMaterial** materials=NULL, int numMaterials=0, btDefracBodyCache* cache=NULL);
+	static btDefracBodyTemplate* CreateTemplateFromBinaryFile(const std::string& filename, btScalar mass, 
+		btMaterial* material, int flags=0, btMaterial** materials=NULL, int numMaterials=0, btDefracBodyCache* cache=NULL);
 	
 	static btMatrix3x3 OrthonormalizeColumns(const btMatrix3x3& m);//orthonormalizes lines of m
 
+	//refines each rotation q[i] towards the rotational part of the polar decomposition of F[i] with the
+	//given number of iterations. It is meant to be warm started with the rotations of the previous step,
+	//which takes one or two iterations to follow the motion of a step
+	static void ExtractRotations(const btMatrix3x3* F, btQuaternion* q, int count, int iterations);
+
+	//computes a Reverse Cuthill-McKee ordering of the graph described by pattern, which reduces the
+	//bandwidth of the matrix. order[k] is the index of the node that goes to position k
+	static void ReverseCuthillMcKee(const btSparsityPattern& pattern, btAlignedObjectArray<int>& order);
+
+	//returns the maximum |i-j| over all non-zero blocks (i,j) in pattern
+	static int ComputeBandwidth(const btSparsityPattern& pattern);
+
+	//compute an ordering of the tetrahedrons given by indices (4 per tetrahedron). order[k] is the
+	//index of the tetrahedron that goes to position k. The first sorts by the Morton code of the
+	//centroids, the second by the smallest node index, which follows a previous node reordering
+	static void SortTetrahedronsMorton(const btAlignedObjectArray<btVector3>& nodePosition, 
+		const btAlignedObjectArray<int>& indices, btAlignedObjectArray<int>& order);
+	static void SortTetrahedronsByNode(const btAlignedObjectArray<int>& indices, btAlignedObjectArray<int>& order);
+
 	static bool SegmentAABBIntersect(const btVector3 &start, const btVector3 &end, 
 						  const btVector3 &min, const btVector3 &max, btScalar *time);
 
@@ -21,6 +21,9 @@ private:
 	btVector3 m_force;//force acting on btNode
 	btScalar  m_invMass;//inverse of btNode mass kg^-1
 	btAlignedObjectArray<btTetrahedron*> m_adjacentTetrahedrons;//array with references to every tet which contains this btNode
+	bool* m_forceFlag;//set to true whenever a non-zero force is applied, NULL if there is none
+
+	void forceApplied() { if(m_forceFlag) *m_forceFlag = true; }
 
 public:
 	btNode();
@@ -36,9 +39,13 @@ public:
 	void setVelocity(const btVector3& velocity) { m_velocity = velocity; }
 
 	const btVector3& getForce() const { return m_force; }
-	void setForce(const btVector3& force) { if(m_invMass > 0) m_force = force; }
-	void applyForce(const btVector3& force) { if(m_invMass > 0) m_force += force; }
-	void applyAcceleration(const btVector3& acc) { if(m_invMass > 0) m_force += acc/m_invMass; }
+	void setForce(const btVector3& force) { if(m_invMass > 0) { m_force = force; if(!force.isZero()) forceApplied(); } }
+	void applyForce(const btVector3& force) { if(m_invMass > 0) { m_force += force; forceApplied(); } }
+	void applyAcceleration(const btVector3& acc) { if(m_invMass > 0) { m_force += acc/m_invMass; forceApplied(); } }
+
+	//the component of the node points it to a flag of its own, which tells it to wake up
+	bool* getForceFlag() const { return m_forceFlag; }
+	void setForceFlag(bool* flag) { m_forceFlag = flag; }
 
 	btScalar getInvMass() const { return m_invMass; }
 
@@ -60,24 +67,59 @@ public:
 class btTetrahedron
 {
 private:
+	struct Matrices
+	{
+		btMatrix3x3 m_invV;
+		btMatrix3x3_12x12 m_k;
+	};
+
 	btNode* m_nodes[4];
-	btMatrix3x3 m_invV;//element basis matrix, it times a vector computes the vector coordinates in the btTetrahedron's aereal coordinates
-	btMatrix3x3_12x12 m_k;//element stiffness matrix
+	const btMatrix3x3* m_invV;//element basis matrix, it times a vector computes the vector coordinates in the btTetrahedron's aereal coordinates
+	const btMatrix3x3_12x12* m_k;//element stiffness matrix for lambda = 1, see getStiffnessBlock
     btMaterial* m_material;
+	btScalar m_stiffnessScale;
+	unsigned int m_revision;//incremented whenever its stiffness changes other than through its material
+	Matrices* m_ownMatrices;//where m_invV and m_k point to unless they are shared, NULL if they are
 
 	btTetrahedron();//no default constructor
+	btTetrahedron(const btTetrahedron&);
+	btTetrahedron& operator = (const btTetrahedron&);
+	Matrices* getOwnMatrices();//stops sharing the matrices, copying them to m_ownMatrices, and returns it
 	void computeBasisMatrix();
 	void computeStiffnessMatrix();
-	void computeStiffnessMatrix2();
 
 public:
 	btTetrahedron(btNode* nodes[4], btMaterial* material);//A tet can only exist given its nodes
+	btTetrahedron(btNode* nodes[4], btMaterial* material, const btMatrix3x3* invV, const btMatrix3x3_12x12* k);//shares the given basis and stiffness matrices, which must outlive it, until they are recomputed
+	~btTetrahedron();
+
+	//compute the basis and normalized stiffness matrices of a tetrahedron with rest positions p. Neither
+	//depends on the material
+	static void computeBasisMatrix(const btVector3 p[4], btMatrix3x3& invV);
+	static void computeStiffnessMatrix(const btVector3 p[4], btMatrix3x3_12x12& k);
+
+	bool hasSharedMatrices() const { return m_ownMatrices == NULL; }
 
-    btMatrix3x3 getRotation() const;
+	btMatrix3x3 getDeformationGradient() const;//maps rest shape edges to current ones
+    btMatrix3x3 getRotation() const;//rotational part of the deformation gradient, by Gram-Schmidt
 	void getCorotatedStiffnessMatrices(btMatrix3x3_12x12& rk, btMatrix3x3_12x12& rkr_1) const;//computes and returns the corotated stifness matrices matrix of this tetrahedron. It is not stored since its very likely that they will change every step
 
-	btScalar getStiffness(int i, int j) const { return m_k.get(i, j); }
-	const btMatrix3x3& getStiffnessBlock(int index) const { return m_k.get(index); }
+	//The stiffness of an isotropic tetrahedron is linear in the Lame parameters: block (i,j) is
+	//lambda*N + mu*(N^T + trace(N)*I), where N is block (i,j) of the normalized stiffness matrix, which
+	//only depends on the rest shape. The material and the stiffness scale are applied here, so
+	//changing them costs nothing until the next assembly
+	btMatrix3x3 getStiffnessBlock(int index) const;
+	btScalar getStiffness(int i, int j) const { return getStiffnessBlock((i/3)*4 + j/3)[i%3][j%3]; }
+	const btMatrix3x3_12x12& getNormalizedStiffnessMatrix() const { return *m_k; }
+	const btMatrix3x3& getBasisMatrix() const { return *m_invV; }
+
+	//The setters of the stiffness scale and material, and nodesPosition0Changed, increment the revision,
+	//which the component of the tetrahedron compares with the one it assembled its stiffness with, like
+	//the revision of the material, so it assembles the stiffness from scratch at its next update
+	unsigned int getRevision() const { return m_revision; }
+
+	btScalar getStiffnessScale() const { return m_stiffnessScale; }
+	void setStiffnessScale(btScalar scale) { m_stiffnessScale = scale; ++m_revision; }//multiplies the stiffness given by the material
 
 	void getAABB(btVector3& min, btVector3& max) const;
 
@@ -89,17 +131,14 @@ public:
 	void applyForce(const btVector3& f, const btVector3& p);
 	void applyForce(const btVector3& f, const btVector4& p);//apply force at volume coordinates p
 
-	const btMaterial* getMaterial() { return m_material; }
-	void setMaterial(btMaterial* material)
-	{
-		m_material = material;
-		computeStiffnessMatrix();
-	}
+	const btMaterial* getMaterial() const { return m_material; }
+	void setMaterial(btMaterial* material) { m_material = material; ++m_revision; }
 
 	void nodesPosition0Changed()//must be called whenever any of its nodes change position0, recompute stiffness and basis matrices
 	{
 		computeBasisMatrix();
 		computeStiffnessMatrix();
+		++m_revision;
 	}
 };
 
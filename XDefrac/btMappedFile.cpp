@@ -0,0 +1,79 @@
+#include "btMappedFile.h"
+
+#include <cstdio>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+bool btMappedFile::open(const std::string& filename)
+{
+	close();
+
+#ifdef _WIN32
+	//no mmap, read the whole file into an aligned buffer
+	FILE* file = fopen(filename.c_str(), "rb");
+
+	if(file == NULL)
+		return false;
+
+	fseek(file, 0, SEEK_END);
+	m_size = (size_t)ftell(file);
+	fseek(file, 0, SEEK_SET);
+	m_data = _aligned_malloc(m_size > 0 ? m_size : 1, 16);
+	bool ok = m_data != NULL && fread(m_data, 1, m_size, file) == m_size;
+	fclose(file);
+
+	if(!ok)
+	{
+		close();
+		return false;
+	}
+#else
+	int fd = ::open(filename.c_str(), O_RDONLY);
+
+	if(fd < 0)
+		return false;
+
+	struct stat st;
+
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+
+	m_size = (size_t)st.st_size;
+	m_data = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);//the mapping keeps its own reference to the file
+
+	if(m_data == MAP_FAILED)
+	{
+		m_data = NULL;
+		m_size = 0;
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+void btMappedFile::close()
+{
+	if(m_data != NULL)
+	{
+#ifdef _WIN32
+		_aligned_free(m_data);
+#else
+		munmap(m_data, m_size);
+#endif
+	}
+
+	m_data = NULL;
+	m_size = 0;
+}
@@ -0,0 +1,29 @@
+#ifndef BT_MAPPED_FILE_H
+#define BT_MAPPED_FILE_H
+
+#include <string>
+#include <cstddef>
+
+//A whole file mapped read only in memory (or read into an aligned buffer where mmap is not available)
+class btMappedFile
+{
+private:
+	void* m_data;
+	size_t m_size;
+
+	btMappedFile(const btMappedFile&);
+	btMappedFile& operator = (const btMappedFile&);
+
+public:
+	btMappedFile() : m_data(NULL), m_size(0) {}
+	~btMappedFile() { close(); }
+
+	bool open(const std::string& filename);
+	void close();
+
+	bool isOpen() const { return m_data != NULL; }
+	const void* getData() const { return m_data; }
+	size_t getSize() const { return m_size; }
+};
+
+#endif
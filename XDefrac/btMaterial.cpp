@@ -5,7 +5,8 @@
 btMaterial::btMaterial(btScalar youngModulus, btScalar poissonRatio):
 	m_e(youngModulus),
 	m_nu(poissonRatio),
-	m_E(6, 6)
+	m_E(6, 6),
+	m_revision(0)
 {
 	computeE();
 }
@@ -13,6 +14,9 @@ btMaterial::btMaterial(btScalar youngModulus, btScalar poissonRatio):
 void btMaterial::computeE()
 {
 	const btScalar c = m_e/((1+m_nu)*(1-2*m_nu));
+	m_lambda = c*m_nu;
+	m_mu = c*(0.5f-m_nu);
+	++m_revision;
     m_E.setZero();
 
 	m_E(0,0)=c*(1-m_nu), m_E(0,1)=c*m_nu,     m_E(0,2)=c*m_nu,     m_E(0,3)=0, m_E(0,4)=0, m_E(0,5)=0;
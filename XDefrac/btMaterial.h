@@ -10,7 +10,10 @@ class btMaterial
 private:
 	btScalar m_e;//Young modulus
 	btScalar m_nu;//Poisson ratio
+	btScalar m_lambda;//Lame parameters, derived from the two above
+	btScalar m_mu;
     Eigen::Matrix<btScalar, 6, 6, Eigen::RowMajor> m_E;
+	unsigned int m_revision;//incremented whenever the parameters change
 	void computeE();
 
 public:
@@ -19,6 +22,12 @@ public:
 	Eigen::Matrix<btScalar, 6, 6, Eigen::RowMajor>& getE() { return m_E; }
 	btScalar getYoungModulus() const { return m_e; }
 	btScalar getPoissonRatio() const { return m_nu; }
+	btScalar getLambda() const { return m_lambda; }
+	btScalar getMu() const { return m_mu; }//shear modulus
+
+	//Each setter increments the revision. The components whose tetrahedrons use this material compare
+	//it with the revision they assembled their stiffness with, and assemble it from scratch when it changed
+	unsigned int getRevision() const { return m_revision; }
 	void setYoungModulus(btScalar e);
 	void setPoissonRatio(btScalar nu);
 	void setYoungModulusAndPoissonRatio(btScalar youngModulus, btScalar poissonRatio);
@@ -0,0 +1,150 @@
+#include "btProfileTraceWriter.h"
+#include "LinearMath/btMinMax.h"
+
+#include <cstdio>
+
+btProfileTraceWriter::btProfileTraceWriter()
+{
+	setThreadName(0, "main");
+}
+
+void btProfileTraceWriter::setThreadName(int thread, const char* name)
+{
+	while(m_threadNames.size() <= thread)
+		m_threadNames.push_back(NULL);
+
+	m_threadNames[thread] = name;
+}
+
+#ifndef BT_NO_PROFILE
+
+//adds an event for each child of the current parent of iterator and their children in turn, starting
+//at start. Returns the end of the last one
+unsigned long btProfileTraceWriter::captureChildren(CProfileIterator* iterator, unsigned long start, int thread)
+{
+	//new nodes are linked at the head of the children list, so it is walked backwards to get the
+	//order in which they were first entered
+	int count = 0;
+
+	for(iterator->First(); !iterator->Is_Done(); iterator->Next())
+		++count;
+
+	for(int i=count-1; i>=0; --i)
+	{
+		iterator->First();
+
+		for(int j=0; j<i; ++j)
+			iterator->Next();
+
+		if(iterator->Get_Current_Total_Calls() == 0)
+			continue;
+
+		btProfileTraceEvent e;
+		e.m_name = iterator->Get_Current_Name();
+		e.m_start = start;
+		e.m_duration = (unsigned long)(iterator->Get_Current_Total_Time()*1000);
+		e.m_calls = iterator->Get_Current_Total_Calls();
+		e.m_thread = thread;
+		m_events.push_back(e);
+
+		iterator->Enter_Child(i);
+		captureChildren(iterator, start, thread);
+		iterator->Enter_Parent();
+
+		start += e.m_duration;
+	}
+
+	return start;
+}
+
+void btProfileTraceWriter::captureFrame()
+{
+	const unsigned long end = m_clock.getTimeMicroseconds();
+	const unsigned long frameTime = (unsigned long)(CProfileManager::Get_Time_Since_Reset()*1000);
+
+	const unsigned long start = end > frameTime ? end - frameTime : 0;
+
+	//the scopes of other threads are laid out from the start of the frame too, their real start within
+	//it is not recorded
+	for(int thread=0; thread<CProfileManager::Get_Thread_Count(); ++thread)
+	{
+		CProfileIterator* iterator = CProfileManager::Get_Thread_Iterator(thread);
+
+		if(iterator)
+		{
+			captureChildren(iterator, start, thread);
+			CProfileManager::Release_Iterator(iterator);
+		}
+	}
+}
+
+#else
+
+void btProfileTraceWriter::captureFrame()
+{
+}
+
+#endif //BT_NO_PROFILE
+
+//writes name as a JSON string. Profile names are plain text, so only quotes and backslashes are escaped
+static void WriteString(FILE* file, const char* name)
+{
+	fputc('"', file);
+
+	for(const char* c = name; *c; ++c)
+	{
+		if(*c == '"' || *c == '\\')
+			fputc('\\', file);
+
+		fputc(*c, file);
+	}
+
+	fputc('"', file);
+}
+
+bool btProfileTraceWriter::write(const std::string& filename) const
+{
+	FILE* file = fopen(filename.c_str(), "w");
+
+	if(!file)
+		return false;
+
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+	const char* separator = "\n";
+
+	int numThreads = m_threadNames.size();
+
+	for(int i=0; i<m_events.size(); ++i)
+		numThreads = btMax(numThreads, m_events[i].m_thread + 1);
+
+	for(int i=0; i<numThreads; ++i)
+	{
+		fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, \"args\": {\"name\": ", separator, i);
+
+		if(i < m_threadNames.size() && m_threadNames[i] != NULL)
+			WriteString(file, m_threadNames[i]);
+		else
+			fprintf(file, "\"thread %d\"", i);
+
+		fprintf(file, "}}");
+		separator = ",\n";
+	}
+
+	for(int i=0; i<m_events.size(); ++i)
+	{
+		const btProfileTraceEvent& e = m_events[i];
+
+		fprintf(file, "%s{\"name\": ", separator);
+		WriteString(file, e.m_name);
+		fprintf(file, ", \"cat\": \"bt\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %lu, \"dur\": %lu, \"args\": {\"calls\": %d}}",
+			e.m_thread, e.m_start, e.m_duration, e.m_calls);
+		separator = ",\n";
+	}
+
+	fprintf(file, "\n]}\n");
+
+	const bool ok = !ferror(file);
+	fclose(file);
+
+	return ok;
+}
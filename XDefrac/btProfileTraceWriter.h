@@ -0,0 +1,50 @@
+#ifndef BT_PROFILE_TRACE_WRITER_H
+#define BT_PROFILE_TRACE_WRITER_H
+
+#include "LinearMath/btQuickprof.h"
+#include "LinearMath/btAlignedObjectArray.h"
+#include <string>
+
+struct btProfileTraceEvent
+{
+	const char* m_name;//BT_PROFILE names are string literals, so they are kept as pointers
+	unsigned long m_start;//microseconds since the writer was created
+	unsigned long m_duration;//microseconds
+	int m_calls;
+	int m_thread;
+};
+
+//Collects the CProfileManager trees of each frame, one track per thread, as Chrome trace events and writes
+//them as JSON, to be opened in chrome://tracing or Perfetto. Call captureFrame after every stepSimulation, which resets the
+//tree at its start. btQuickprof only keeps the total time and calls of each scope, so the scopes under a
+//parent are laid out one after the other from its start, in the order they were first entered. That is
+//the real timeline for scopes entered once per frame; the calls of a scope entered more often are shown
+//as one event with its total time
+class btProfileTraceWriter
+{
+private:
+	btAlignedObjectArray<btProfileTraceEvent> m_events;
+	btAlignedObjectArray<const char*> m_threadNames;
+	btClock m_clock;
+
+#ifndef BT_NO_PROFILE
+	unsigned long captureChildren(CProfileIterator* iterator, unsigned long start, int thread);
+#endif
+
+public:
+	btProfileTraceWriter();
+
+	//names the track of thread, "main" for thread 0 and "thread <index>" for the others by default. name
+	//must outlive the writer
+	void setThreadName(int thread, const char* name);
+
+	void captureFrame();
+
+	void clear() { m_events.resize(0); }
+	int getEventCount() const { return m_events.size(); }
+	const btProfileTraceEvent& getEvent(int i) const { return m_events[i]; }
+
+	bool write(const std::string& filename) const;
+};
+
+#endif
@@ -11,13 +11,11 @@
 
 #include "LinearMath/btMatrix3x3.h"
 #include "btVector3n.h"
+#include "btSparsityPattern.h"
 #include <set>
 #include <ostream>
 
 
-#define BT_ZERO_ROW -1
-
-
 struct btMatrixIndex
 {
     int i, j;
@@ -41,15 +39,14 @@ public:
      */
     btSparseMatrix(int size, const std::set<btMatrixIndex>& indices) :
         m_size(size),
+        m_ownsStructure(true),
         m_zero(0,0,0,0,0,0,0,0,0)
     {
         m_elements = new btMatrix3x3[indices.size()];
-        m_columnIndices = new int[indices.size()];
-        m_rowIndices = new int[m_size+1];
+        int* columnIndices = new int[indices.size()];
+        int* rowIndices = new int[m_size+1];
         
-        m_rowIndices[0] = BT_ZERO_ROW;
-        int ri = 0; //index for m_rowIndices
-        int pri = -1; //previous matrix row index
+        int ri = 0; //index for rowIndices
         
         std::set<btMatrixIndex>::iterator it = indices.begin();
         
@@ -57,56 +54,81 @@ public:
             m_elements[i].setValue(0,0,0,0,0,0,0,0,0);
             
             const btMatrixIndex& mi = *(it++);
-            m_columnIndices[i] = mi.j;
-            
-            int d = mi.i - pri;
+            columnIndices[i] = mi.j;
             
-            if (d > 0) {
-                if (d == 1) {
-                    m_rowIndices[ri++] = i;
-                }
-                else { //d > 1
-                    for (int j=0; j<d-1; ++j) {
-                        m_rowIndices[ri++] = BT_ZERO_ROW;
-                    }
-                    m_rowIndices[ri++] = i;
-                }
+            while (ri <= mi.i) { //rows up to mi.i start here, empty rows included
+                rowIndices[ri++] = i;
             }
-            
-            pri = mi.i;
         }
         
-        while (ri < m_size) {
-            m_rowIndices[ri++] = BT_ZERO_ROW;
+        while (ri <= m_size) {
+            rowIndices[ri++] = (int)indices.size();
         }
         
-        m_rowIndices[m_size] = (int)indices.size();
+        m_columnIndices = columnIndices;
+        m_rowIndices = rowIndices;
+    }
+    
+    /**
+     * Creates a new square sparse matrix with the structure in pattern and all blocks set to zero.
+     * If shareStructure is true the matrix refers to the index arrays of pattern instead of copying
+     * them, so pattern must outlive it and every copy made from it.
+     */
+    btSparseMatrix(const btSparsityPattern& pattern, bool shareStructure=false) :
+        m_size(pattern.size()),
+        m_ownsStructure(!shareStructure),
+        m_zero(0,0,0,0,0,0,0,0,0)
+    {
+        int nonZeros = pattern.getNonZeroCount();
+        m_elements = new btMatrix3x3[nonZeros];
+        
+        for (int i=0; i<nonZeros; ++i) {
+            m_elements[i].setValue(0,0,0,0,0,0,0,0,0);
+        }
+        
+        if (shareStructure) {
+            m_columnIndices = nonZeros > 0 ? &pattern.getColumnIndices()[0] : NULL;
+            m_rowIndices = &pattern.getRowIndices()[0];
+        }
+        else {
+            m_columnIndices = copyIndices(pattern.getColumnIndices().empty() ? NULL : &pattern.getColumnIndices()[0], nonZeros);
+            m_rowIndices = copyIndices(&pattern.getRowIndices()[0], m_size+1);
+        }
     }
     
+    /**
+     * Copies the elements of S. The structure is shared if S shares it, otherwise it is copied too.
+     */
     btSparseMatrix(const btSparseMatrix& S) :
         m_size(S.m_size),
+        m_ownsStructure(S.m_ownsStructure),
         m_zero(0,0,0,0,0,0,0,0,0)
     {
         int nonZeros = S.m_rowIndices[S.m_size];
         m_elements = new btMatrix3x3[nonZeros];
-        m_columnIndices = new int[nonZeros];
-        m_rowIndices = new int[m_size+1];
         
         for (int i=0; i<nonZeros; ++i) {
             m_elements[i] = S.m_elements[i];
-            m_columnIndices[i] = S.m_columnIndices[i];
         }
         
-        for (int i=0; i<m_size+1; ++i) {
-            m_rowIndices[i] = S.m_rowIndices[i];
+        if (m_ownsStructure) {
+            m_columnIndices = copyIndices(S.m_columnIndices, nonZeros);
+            m_rowIndices = copyIndices(S.m_rowIndices, m_size+1);
+        }
+        else {
+            m_columnIndices = S.m_columnIndices;
+            m_rowIndices = S.m_rowIndices;
         }
     }
     
     ~btSparseMatrix()
     {
         delete[] m_elements;
-        delete[] m_columnIndices;
-        delete[] m_rowIndices;
+        
+        if (m_ownsStructure) {
+            delete[] m_columnIndices;
+            delete[] m_rowIndices;
+        }
     }
     
     /**
@@ -117,7 +139,22 @@ public:
     {
         return m_size;
     }
-    
+
+    /**
+     * Returns the number of bytes allocated by this matrix, which includes the structure only if
+     * it is not shared.
+     */
+    size_t getAllocatedBytes() const
+    {
+        size_t bytes = m_rowIndices[m_size]*sizeof(btMatrix3x3);
+
+        if (m_ownsStructure) {
+            bytes += (m_rowIndices[m_size] + m_size + 1)*sizeof(int);
+        }
+
+        return bytes;
+    }
+
     btSparseMatrix& operator = (const btSparseMatrix& S)
     {
         for (int i=0; i<m_rowIndices[m_size]; ++i) {
@@ -165,17 +202,8 @@ public:
         btSparseMatrix ret(S);
         
         for (int i=0; i<S.size(); ++i) {
-            if (S.m_rowIndices[i] == BT_ZERO_ROW) {
-                continue;
-            }
-            
             int begin = S.m_rowIndices[i];
             int end = S.m_rowIndices[i+1];
-            int ii = i+1;
-            
-            while (end == BT_ZERO_ROW) { //jump over empty(full zero) rows
-                end = S.m_rowIndices[++ii];
-            }
             
             for (int j=begin; j<end; ++j) {
                 ret.m_elements[j] = S.m_elements[j] * v[i];
@@ -190,17 +218,8 @@ public:
         btSparseMatrix ret(S);
         
         for (int i=0; i<S.size(); ++i) {
-            if (S.m_rowIndices[i] == BT_ZERO_ROW) {
-                continue;
-            }
-            
             int begin = S.m_rowIndices[i];
             int end = S.m_rowIndices[i+1];
-            int ii = i+1;
-            
-            while (end == BT_ZERO_ROW) { //jump over empty(full zero) rows
-                end = S.m_rowIndices[++ii];
-            }
             
             for (int j=begin; j<end; ++j) {
                 int jj = S.m_columnIndices[j];
@@ -220,17 +239,8 @@ public:
         const btMatrix3x3 Is = btMatrix3x3::getIdentity() * s;
         
         for (int i=0; i<S.size(); ++i) {
-            if (S.m_rowIndices[i] == BT_ZERO_ROW) {
-                continue;
-            }
-            
             int begin = S.m_rowIndices[i];
             int end = S.m_rowIndices[i+1];
-            int ii = i+1;
-            
-            while (end == BT_ZERO_ROW) { //jump over empty(full zero) rows
-                end = S.m_rowIndices[++ii];
-            }
             
             for (int j=begin; j<end; ++j) {
                 if (S.m_columnIndices[j] > i) {
@@ -254,6 +264,30 @@ public:
         return *this;
     }
     
+    /**
+     * Direct access to the compressed rows. The blocks of row i are getElements()[k] for k in
+     * [getRowIndices()[i], getRowIndices()[i+1]), and block k is in column getColumnIndices()[k].
+     */
+    btMatrix3x3* getElements()
+    {
+        return m_elements;
+    }
+    
+    const btMatrix3x3* getElements() const
+    {
+        return m_elements;
+    }
+    
+    const int* getRowIndices() const
+    {
+        return m_rowIndices;
+    }
+    
+    const int* getColumnIndices() const
+    {
+        return m_columnIndices;
+    }
+    
     friend btVector3n operator * (const btSparseMatrix& S, const btVector3n& v);
     friend btSparseMatrix operator * (const btSparseMatrix& S, btScalar s);
     friend std::ostream& operator << (std::ostream& out, const btSparseMatrix& S);
@@ -261,10 +295,22 @@ public:
 private:
     btMatrix3x3 *m_elements;
     int m_size; //Number of entries in m_elements.
-    int *m_columnIndices; //Array containing the column index for each btMatrix3x3 in m_elements.
-    int *m_rowIndices; //Array containing the index of the first element of each row in m_elements. The last is the number of elements, for 
+    const int *m_columnIndices; //Array containing the column index for each btMatrix3x3 in m_elements.
+    const int *m_rowIndices; //Array containing the index of the first element of each row in m_elements. The last is the number of elements, so row i ends where row i+1 begins.
+    bool m_ownsStructure; //Whether m_columnIndices and m_rowIndices were allocated by this matrix or belong to a btSparsityPattern.
     btMatrix3x3 m_zero; //Zero 3x3 matrix. Never access it directly, always use zero().
     
+    static int* copyIndices(const int* indices, int count)
+    {
+        int* copy = new int[count];
+        
+        for (int i=0; i<count; ++i) {
+            copy[i] = indices[i];
+        }
+        
+        return copy;
+    }
+    
     btMatrix3x3& zero() 
     {
         m_zero.setValue(0, 0, 0, 0, 0, 0, 0, 0, 0);
@@ -282,17 +328,8 @@ private:
      */
     btMatrix3x3 *__get(int i, int j) const 
     {
-        if (m_rowIndices[i] == BT_ZERO_ROW) {
-            return NULL;
-        }
-        
         int begin = m_rowIndices[i];
         int end = m_rowIndices[i+1];
-        int ii = i+1;
-        
-        while (end == BT_ZERO_ROW) { //jump over empty(full zero) rows
-            end = m_rowIndices[++ii];
-        }
         
         for (int jj=begin; jj<end; ++jj) {
             if (m_columnIndices[jj] == j) {
@@ -313,17 +350,8 @@ inline btVector3n operator * (const btSparseMatrix& S, const btVector3n& v)
     btVector3n ret(v.size(), 0);
     
     for (int i=0; i<S.size(); ++i) {
-        if (S.m_rowIndices[i] == BT_ZERO_ROW) {
-            continue;
-        }
-        
         int begin = S.m_rowIndices[i];
         int end = S.m_rowIndices[i+1];
-        int ii = i+1;
-        
-        while (end == BT_ZERO_ROW) { //jump over empty(full zero) rows
-            end = S.m_rowIndices[++ii];
-        }
         
         for (int j=begin; j<end; ++j) {
             int jj = S.m_columnIndices[j];
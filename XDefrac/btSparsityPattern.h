@@ -0,0 +1,131 @@
+#ifndef _BT_SPARSITY_PATTERN_H
+#define _BT_SPARSITY_PATTERN_H
+
+#include <vector>
+#include <algorithm>
+
+
+/**
+ * The structure of a square block sparse matrix in compressed sparse row (CSR) form. Row i
+ * has its column indices in m_columnIndices[m_rowIndices[i]..m_rowIndices[i+1]), sorted in
+ * increasing order. An empty row has m_rowIndices[i] == m_rowIndices[i+1].
+ */
+class btSparsityPattern
+{
+public:
+    btSparsityPattern() : m_size(0), m_rowIndices(1, 0) {}
+
+    /**
+     * Builds the pattern of the stiffness matrix of a tetrahedral mesh, which has a block at
+     * (i,j) iff nodes i and j share a tetrahedron. indices has 4 node indices per tetrahedron.
+     * Each row is gathered from the tetrahedrons adjacent to its node and then sorted, so no
+     * global ordered container is needed and rows are processed in parallel.
+     */
+    void buildFromTetrahedrons(int numNodes, const int* indices, int numTetrahedrons)
+    {
+        m_size = numNodes;
+
+        //node to tetrahedron adjacency, in CSR form too
+        std::vector<int> adjacentStart(numNodes+1, 0);
+
+        for (int i=0; i<numTetrahedrons*4; ++i) {
+            ++adjacentStart[indices[i]+1];
+        }
+
+        for (int i=0; i<numNodes; ++i) {
+            adjacentStart[i+1] += adjacentStart[i];
+        }
+
+        std::vector<int> adjacent(numTetrahedrons*4);
+        std::vector<int> fill(adjacentStart.begin(), adjacentStart.end()-1);
+
+        for (int t=0; t<numTetrahedrons; ++t) {
+            for (int k=0; k<4; ++k) {
+                adjacent[fill[indices[t*4 + k]]++] = t;
+            }
+        }
+
+        //gather the sorted unique columns of each row into a scratch buffer big enough for
+        //the worst case of 4 columns per adjacent tetrahedron
+        std::vector<int> scratch(numTetrahedrons*16);
+        std::vector<int> rowCount(numNodes);
+
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (int i=0; i<numNodes; ++i) {
+            int* row = scratch.empty() ? NULL : &scratch[adjacentStart[i]*4];
+            int count = 0;
+
+            for (int a=adjacentStart[i]; a<adjacentStart[i+1]; ++a) {
+                const int* tet = &indices[adjacent[a]*4];
+                row[count++] = tet[0];
+                row[count++] = tet[1];
+                row[count++] = tet[2];
+                row[count++] = tet[3];
+            }
+
+            std::sort(row, row + count);
+            rowCount[i] = (int)(std::unique(row, row + count) - row);
+        }
+
+        m_rowIndices.resize(numNodes+1);
+        m_rowIndices[0] = 0;
+
+        for (int i=0; i<numNodes; ++i) {
+            m_rowIndices[i+1] = m_rowIndices[i] + rowCount[i];
+        }
+
+        m_columnIndices.resize(m_rowIndices[numNodes]);
+
+        #pragma omp parallel for schedule(static)
+        for (int i=0; i<numNodes; ++i) {
+            if (rowCount[i] > 0) {
+                std::copy(&scratch[adjacentStart[i]*4], &scratch[adjacentStart[i]*4] + rowCount[i],
+                          &m_columnIndices[m_rowIndices[i]]);
+            }
+        }
+    }
+
+    /**
+     * Sets the pattern from CSR arrays built elsewhere, e.g. read back from a cache. rowIndices has
+     * size+1 entries.
+     */
+    void assign(int size, const int* rowIndices, const int* columnIndices)
+    {
+        m_size = size;
+        m_rowIndices.assign(rowIndices, rowIndices + size + 1);
+        m_columnIndices.assign(columnIndices, columnIndices + rowIndices[size]);
+    }
+    
+    /**
+     * Returns the width = height of the matrix in 3x3 block scale.
+     */
+    int size() const
+    {
+        return m_size;
+    }
+
+    /**
+     * Returns the number of non-zero blocks.
+     */
+    int getNonZeroCount() const
+    {
+        return m_rowIndices[m_size];
+    }
+
+    const std::vector<int>& getRowIndices() const
+    {
+        return m_rowIndices;
+    }
+
+    const std::vector<int>& getColumnIndices() const
+    {
+        return m_columnIndices;
+    }
+
+private:
+    int m_size;
+    std::vector<int> m_rowIndices; //m_size+1 offsets into m_columnIndices
+    std::vector<int> m_columnIndices;
+};
+
+#endif
@@ -0,0 +1,388 @@
+//Measures how far the faster solver settings drift from a tightly converged reference, to pick the
+//fastest one within an error budget, e.g.
+//XDefracAccuracy XDefracDemo/Resources [steps] [reference directory]
+//Each demo mesh runs the same scripted scenario with every configuration in configurations: gravity, the
+//nodes at the low x end pinned, and a spring that drags the far end up and sideways during the middle
+//half of the run and then lets go. Node positions and energy are sampled every few steps and compared
+//with the reference run. With a reference directory, the reference trajectories are read from it if
+//present and written to it otherwise, so a build in another precision can be compared against them.
+
+#include "btBulletDynamicsCommon.h"
+#include "btDefracDynamicsWorld.h"
+#include "btDefracBody.h"
+#include "btDefracBodyComponent.h"
+#include "btDefracUtils.h"
+#include "btMaterial.h"
+#include "btSpring.h"
+#include "LinearMath/btQuickprof.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+
+#define BT_TRAJECTORY_MAGIC 0x46524458 //"XDRF"
+#define BT_TRAJECTORY_VERSION 1
+
+static const char* meshes[] = {"box", "geosphere", "octopus", "skull"};
+static const int sampleInterval = 4;
+static const btScalar timeStep = btScalar(1.)/btScalar(60.);
+
+struct btSolverConfiguration
+{
+	const char* m_name;
+	int m_cgMaxIter;
+	btScalar m_cgRelativeTolerance;
+	btDefracDynamicsWorld::RotationExtraction m_rotationExtraction;
+	int m_polarIterations;
+	btScalar m_rotationTolerance;
+	int m_fullAssemblyInterval;
+	btDefracDynamicsWorld::Corotation m_corotation;
+};
+
+//CG to a relative residual of 1e-6, rotations refined to convergence and every stiffness term updated
+//every step
+static const btSolverConfiguration reference = {"reference", 5000, btScalar(1e-6), 
+	btDefracDynamicsWorld::ROTATION_POLAR_DECOMPOSITION, 10, 0, 1, btDefracDynamicsWorld::COROTATION_PER_ELEMENT};
+
+static const btSolverConfiguration configurations[] = {
+	{"cg5", 5, btScalar(1e-3), btDefracDynamicsWorld::ROTATION_GRAM_SCHMIDT, 0, btScalar(0.001), 100, btDefracDynamicsWorld::COROTATION_PER_ELEMENT},
+	{"cg10", 10, btScalar(1e-3), btDefracDynamicsWorld::ROTATION_GRAM_SCHMIDT, 0, btScalar(0.001), 100, btDefracDynamicsWorld::COROTATION_PER_ELEMENT},
+	{"cg20", 20, btScalar(1e-3), btDefracDynamicsWorld::ROTATION_GRAM_SCHMIDT, 0, btScalar(0.001), 100, btDefracDynamicsWorld::COROTATION_PER_ELEMENT},
+	{"cg40", 40, btScalar(1e-3), btDefracDynamicsWorld::ROTATION_GRAM_SCHMIDT, 0, btScalar(0.001), 100, btDefracDynamicsWorld::COROTATION_PER_ELEMENT},
+	{"cg20Polar", 20, btScalar(1e-3), btDefracDynamicsWorld::ROTATION_POLAR_DECOMPOSITION, 2, btScalar(0.001), 100, btDefracDynamicsWorld::COROTATION_PER_ELEMENT},
+	{"cg20Polar1", 20, btScalar(1e-3), btDefracDynamicsWorld::ROTATION_POLAR_DECOMPOSITION, 1, btScalar(0.001), 100, btDefracDynamicsWorld::COROTATION_PER_ELEMENT},
+	{"cg20RotationTolerance0.01", 20, btScalar(1e-3), btDefracDynamicsWorld::ROTATION_GRAM_SCHMIDT, 0, btScalar(0.01), 100, btDefracDynamicsWorld::COROTATION_PER_ELEMENT},
+	{"cg20FullAssembly", 20, btScalar(1e-3), btDefracDynamicsWorld::ROTATION_GRAM_SCHMIDT, 0, 0, 1, btDefracDynamicsWorld::COROTATION_PER_ELEMENT},
+	{"cg20PerNode", 20, btScalar(1e-3), btDefracDynamicsWorld::ROTATION_GRAM_SCHMIDT, 0, btScalar(0.001), 100, btDefracDynamicsWorld::COROTATION_PER_NODE}
+};
+
+//node positions, in the original node order, and total energy every sampleInterval steps
+struct btTrajectory
+{
+	int m_numNodes;
+	int m_steps;
+	btAlignedObjectArray<double> m_positions;//3 per node per sample
+	btAlignedObjectArray<double> m_energies;//per sample
+	double m_extent;//largest side of the initial bounding box
+
+	int getSampleCount() const { return m_energies.size(); }
+};
+
+struct btRunInfo
+{
+	double m_stepTime;
+	double m_iterations;
+	bool m_finite;
+};
+
+struct btTrajectoryFileHeader
+{
+	unsigned int m_magic;
+	unsigned int m_version;
+	unsigned int m_numNodes;
+	unsigned int m_steps;
+	unsigned int m_sampleInterval;
+	unsigned int m_numSamples;
+	double m_extent;
+};
+
+static void sample(btDefracBody* body, const btVector3& gravity, btTrajectory& trajectory)
+{
+	double kinetic = 0, potential = 0;
+
+	for(int i=0; i<body->getNodeCount(); ++i)
+	{
+		const btNode* node = body->getNode(body->getNodeIndexFromOriginal(i));
+		const btVector3& p = node->getPosition();
+
+		trajectory.m_positions.push_back(p.x());
+		trajectory.m_positions.push_back(p.y());
+		trajectory.m_positions.push_back(p.z());
+
+		if(node->getInvMass() > 0)
+		{
+			const double mass = 1/node->getInvMass();
+			kinetic += 0.5*mass*node->getVelocity().length2();
+			potential -= mass*gravity.dot(p);
+		}
+	}
+
+	trajectory.m_energies.push_back(kinetic + potential);
+}
+
+static bool simulate(const std::string& baseFilename, const btSolverConfiguration& configuration, int steps,
+					 btTrajectory& trajectory, btRunInfo& info)
+{
+	btDefaultCollisionConfiguration collisionConfiguration;
+	btCollisionDispatcher dispatcher(&collisionConfiguration);
+	btDbvtBroadphase broadphase;
+	btSequentialImpulseConstraintSolver constraintSolver;
+	btDefracDynamicsWorld world(&dispatcher, &broadphase, &constraintSolver, &collisionConfiguration);
+	world.setCGMaxIter(configuration.m_cgMaxIter);
+	world.setCGTolerance(configuration.m_cgRelativeTolerance, 0);
+	world.setRotationExtraction(configuration.m_rotationExtraction);
+	world.setPolarIterations(configuration.m_polarIterations);
+	world.setRotationTolerance(configuration.m_rotationTolerance);
+	world.setFullAssemblyInterval(configuration.m_fullAssemblyInterval);
+	world.setCorotation(configuration.m_corotation);
+
+	btMaterial material(3000, 0.3);
+	btDefracBody* body = btDefracUtils::CreateFromTetgenFile(baseFilename, 10, &material, 
+		btDefracBody::CF_REORDER_NODES | btDefracBody::CF_SORT_TETRAHEDRONS_BY_NODE);
+
+	if(!body)
+		return false;
+
+	btVector3 min(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT), max(-min);
+
+	for(int i=0; i<body->getNodeCount(); ++i)
+	{
+		min.setMin(body->getNode(i)->getPosition());
+		max.setMax(body->getNode(i)->getPosition());
+	}
+
+	const btScalar extent = (max - min)[(max - min).maxAxis()];
+
+	//pin the nodes in the lowest tenth along x and drag the tetrahedron furthest along x
+	btDefracBodyComponent* component = body->getComponent(0);
+	int dragged = 0;
+	btScalar draggedX = -BT_LARGE_FLOAT;
+
+	for(int i=0; i<component->getNodeCount(); ++i)
+		if(component->getNode(i)->getPosition().x() < min.x() + btScalar(0.1)*(max.x() - min.x()))
+			component->setNodeMass(i, 0);
+
+	for(int t=0; t<body->getTetrahedronCount(); ++t)
+	{
+		const btTetrahedron* tetrahedron = body->getTetrahedron(t);
+		const btScalar x = tetrahedron->getNode(0)->getPosition().x() + tetrahedron->getNode(1)->getPosition().x() + 
+			tetrahedron->getNode(2)->getPosition().x() + tetrahedron->getNode(3)->getPosition().x();
+
+		if(x > draggedX)
+		{
+			dragged = t;
+			draggedX = x;
+		}
+	}
+
+	world.addDefracBody(body);
+
+	btSpring spring(body->getTetrahedron(dragged), btVector4(0.25, 0.25, 0.25, 0.25), 100, 0);
+	const btVector3 anchor = spring.getSourcePosition();
+	const int dragStart = steps/4, dragEnd = steps*3/4;
+
+	trajectory.m_numNodes = body->getNodeCount();
+	trajectory.m_steps = steps;
+	trajectory.m_extent = extent;
+	trajectory.m_positions.resize(0);
+	trajectory.m_energies.resize(0);
+	info.m_stepTime = 0;
+	info.m_iterations = 0;
+
+	btClock clock;
+
+	for(int s=0; s<steps; ++s)
+	{
+		if(s == dragStart)
+			world.addSpring(&spring);
+		else if(s == dragEnd)
+			world.removeSpring(&spring);
+
+		if(s >= dragStart && s < dragEnd)
+		{
+			const btScalar phase = SIMD_PI*(s - dragStart)/(dragEnd - dragStart);
+			spring.setSourcePosition(anchor + btVector3(0, btSin(phase), btScalar(0.5)*btSin(2*phase))*(btScalar(0.5)*extent));
+		}
+
+		clock.reset();
+		world.stepSimulation(timeStep, 0);
+		info.m_stepTime += clock.getTimeMicroseconds()*1e-6;
+		info.m_iterations += world.getStepStats().getTotalIterations();
+
+		if((s + 1) % sampleInterval == 0)
+			sample(body, world.getGravity(), trajectory);
+	}
+
+	info.m_stepTime /= steps;
+	info.m_iterations /= steps;
+	info.m_finite = true;
+
+	for(int i=0; i<trajectory.m_energies.size() && info.m_finite; ++i)
+		info.m_finite = trajectory.m_energies[i]*0 == 0;
+
+	world.removeDefracBody(body);
+	delete body;
+
+	return true;
+}
+
+static bool readTrajectory(const std::string& filename, int steps, btTrajectory& trajectory)
+{
+	FILE* file = fopen(filename.c_str(), "rb");
+
+	if(!file)
+		return false;
+
+	btTrajectoryFileHeader header;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.m_magic == BT_TRAJECTORY_MAGIC && 
+		header.m_version == BT_TRAJECTORY_VERSION && header.m_steps == (unsigned int)steps && 
+		header.m_sampleInterval == (unsigned int)sampleInterval;
+
+	if(ok)
+	{
+		trajectory.m_numNodes = header.m_numNodes;
+		trajectory.m_steps = steps;
+		trajectory.m_extent = header.m_extent;
+		trajectory.m_positions.resize(header.m_numSamples*header.m_numNodes*3);
+		trajectory.m_energies.resize(header.m_numSamples);
+
+		ok = (header.m_numSamples == 0 || 
+			(fread(&trajectory.m_energies[0], sizeof(double), header.m_numSamples, file) == header.m_numSamples &&
+			 fread(&trajectory.m_positions[0], sizeof(double), trajectory.m_positions.size(), file) == (size_t)trajectory.m_positions.size()));
+	}
+
+	fclose(file);
+	return ok;
+}
+
+static bool writeTrajectory(const std::string& filename, const btTrajectory& trajectory)
+{
+	FILE* file = fopen(filename.c_str(), "wb");
+
+	if(!file)
+		return false;
+
+	btTrajectoryFileHeader header;
+	header.m_magic = BT_TRAJECTORY_MAGIC;
+	header.m_version = BT_TRAJECTORY_VERSION;
+	header.m_numNodes = trajectory.m_numNodes;
+	header.m_steps = trajectory.m_steps;
+	header.m_sampleInterval = sampleInterval;
+	header.m_numSamples = trajectory.getSampleCount();
+	header.m_extent = trajectory.m_extent;
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+	if(ok && header.m_numSamples > 0)
+	{
+		ok = fwrite(&trajectory.m_energies[0], sizeof(double), header.m_numSamples, file) == header.m_numSamples &&
+			fwrite(&trajectory.m_positions[0], sizeof(double), trajectory.m_positions.size(), file) == (size_t)trajectory.m_positions.size();
+	}
+
+	ok = fclose(file) == 0 && ok;
+	return ok;
+}
+
+//writes the errors of trajectory against the reference. Positions: root mean square and maximum distance
+//to the reference node over all samples, also relative to the mesh extent. Energy: root mean square of
+//the difference, relative to the root mean square change of the reference energy from its first sample
+static void writeErrors(const btTrajectory& trajectory, const btTrajectory& reference)
+{
+	double sum = 0, max = 0;
+
+	for(int i=0; i<trajectory.m_positions.size(); i+=3)
+	{
+		const double dx = trajectory.m_positions[i] - reference.m_positions[i];
+		const double dy = trajectory.m_positions[i+1] - reference.m_positions[i+1];
+		const double dz = trajectory.m_positions[i+2] - reference.m_positions[i+2];
+		const double d2 = dx*dx + dy*dy + dz*dz;
+		sum += d2;
+		max = d2 > max ? d2 : max;
+	}
+
+	const double rms = std::sqrt(sum/(trajectory.m_positions.size()/3));
+	double energyError = 0, energyChange = 0;
+
+	for(int i=0; i<trajectory.getSampleCount(); ++i)
+	{
+		const double e = trajectory.m_energies[i] - reference.m_energies[i];
+		const double c = reference.m_energies[i] - reference.m_energies[0];
+		energyError += e*e;
+		energyChange += c*c;
+	}
+
+	printf("\"positionRms\": %g, \"positionMax\": %g, \"relativePositionRms\": %g, \"relativeEnergyError\": %g", 
+		rms, std::sqrt(max), rms/reference.m_extent, energyChange > 0 ? std::sqrt(energyError/energyChange) : 0);
+}
+
+int main(int argc, char** argv)
+{
+	if(argc < 2 || argc > 4)
+	{
+		printf("usage: %s <resources directory> [steps] [reference directory]\n", argv[0]);
+		return 1;
+	}
+
+	const std::string resources(argv[1]);
+	const int steps = argc > 2 ? atoi(argv[2]) : 120;
+	const std::string referenceDirectory(argc > 3 ? argv[3] : "");
+
+	if(steps < sampleInterval)
+	{
+		printf("steps must be at least %d\n", sampleInterval);
+		return 1;
+	}
+
+	const int numMeshes = sizeof(meshes)/sizeof(meshes[0]);
+	const int numConfigurations = sizeof(configurations)/sizeof(configurations[0]);
+
+	printf("{\n  \"precision\": \"%s\",\n  \"steps\": %d,\n  \"timeStep\": %g,\n  \"sampleInterval\": %d,\n  \"meshes\": [\n",
+		sizeof(btScalar) == sizeof(double) ? "double" : "single", steps, timeStep, sampleInterval);
+
+	for(int m=0; m<numMeshes; ++m)
+	{
+		const std::string baseFilename = resources + "/" + meshes[m] + "/" + meshes[m] + ".1";
+		const std::string referenceFilename = referenceDirectory.empty() ? "" : referenceDirectory + "/" + meshes[m] + ".trajectory";
+		btTrajectory referenceTrajectory, trajectory;
+		btRunInfo info;
+		bool loaded = !referenceFilename.empty() && readTrajectory(referenceFilename, steps, referenceTrajectory);
+
+		if(!loaded)
+		{
+			if(!simulate(baseFilename, reference, steps, referenceTrajectory, info))
+			{
+				fprintf(stderr, "failed to load %s\n", baseFilename.c_str());
+				return 1;
+			}
+
+			if(!referenceFilename.empty() && !writeTrajectory(referenceFilename, referenceTrajectory))
+				fprintf(stderr, "failed to write %s\n", referenceFilename.c_str());
+
+			printf("    {\"mesh\": \"%s\", \"reference\": {\"loaded\": false, \"secondsPerStep\": %.6f, \"iterations\": %.2f, \"finite\": %s},\n", 
+				meshes[m], info.m_stepTime, info.m_iterations, info.m_finite ? "true" : "false");
+		}
+		else
+		{
+			printf("    {\"mesh\": \"%s\", \"reference\": {\"loaded\": true},\n", meshes[m]);
+		}
+
+		printf("     \"configurations\": [\n");
+
+		for(int c=0; c<numConfigurations; ++c)
+		{
+			if(!simulate(baseFilename, configurations[c], steps, trajectory, info))
+			{
+				fprintf(stderr, "failed to load %s\n", baseFilename.c_str());
+				return 1;
+			}
+
+			printf("      {\"name\": \"%s\", \"secondsPerStep\": %.6f, \"iterations\": %.2f, \"finite\": %s", 
+				configurations[c].m_name, info.m_stepTime, info.m_iterations, info.m_finite ? "true" : "false");
+
+			if(info.m_finite && trajectory.m_numNodes == referenceTrajectory.m_numNodes)
+			{
+				printf(", ");
+				writeErrors(trajectory, referenceTrajectory);
+			}
+
+			printf("}%s\n", c == numConfigurations-1 ? "" : ",");
+		}
+
+		printf("     ]}%s\n", m == numMeshes-1 ? "" : ",");
+	}
+
+	printf("  ]\n}\n");
+
+	return 0;
+}
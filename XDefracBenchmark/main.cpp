@@ -0,0 +1,201 @@
+//Steps the demo meshes without rendering and writes the timings as JSON, to track performance across
+//commits, e.g.
+//XDefracBenchmark XDefracDemo/Resources [steps] [output filename]
+//Each mesh is run with implicit Euler at every CG cap in cgMaxIters and once with explicit Euler, all
+//with fixed time steps, pinned by the first node like in XDefracDemo. The output defaults to stdout.
+
+#include "btBulletDynamicsCommon.h"
+#include "btDefracDynamicsWorld.h"
+#include "btDefracBody.h"
+#include "btDefracBodyComponent.h"
+#include "btDefracUtils.h"
+#include "btMaterial.h"
+#include "LinearMath/btQuickprof.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+static const char* meshes[] = {"box", "geosphere", "octopus", "skull"};
+static const int cgMaxIters[] = {5, 10, 20};
+static const int warmUpSteps = 5;//not measured, they include the first full assembly
+
+//totals over the measured steps of one run
+struct btBenchmarkResult
+{
+	int m_nodes;
+	int m_tetrahedrons;
+	double m_loadTime;
+	double m_stepTime;
+	double m_rotationTime;
+	double m_assemblyTime;
+	double m_solveTime;
+	double m_integrationTime;
+	long m_iterations;
+	int m_maxIterations;
+	int m_unconverged;
+	double m_residual;
+	double m_maxResidual;
+	bool m_finite;
+};
+
+static bool runBenchmark(const std::string& baseFilename, btDefracDynamicsWorld::ODESolver solver, int cgMaxIter,
+						 btScalar timeStep, int steps, btBenchmarkResult& result)
+{
+	btDefaultCollisionConfiguration collisionConfiguration;
+	btCollisionDispatcher dispatcher(&collisionConfiguration);
+	btDbvtBroadphase broadphase;
+	btSequentialImpulseConstraintSolver constraintSolver;
+	btDefracDynamicsWorld world(&dispatcher, &broadphase, &constraintSolver, &collisionConfiguration);
+	world.setODESolver(solver);
+	world.setCGMaxIter(cgMaxIter);
+
+	btMaterial material(3000, 0.3);
+	btClock clock;
+	btDefracBody* body = btDefracUtils::CreateFromTetgenFile(baseFilename, 10, &material, 
+		btDefracBody::CF_REORDER_NODES | btDefracBody::CF_SORT_TETRAHEDRONS_BY_NODE);
+
+	if(!body)
+		return false;
+
+	result.m_loadTime = clock.getTimeMicroseconds()*1e-6;
+	result.m_nodes = body->getNodeCount();
+	result.m_tetrahedrons = body->getTetrahedronCount();
+
+	body->getComponent(0)->setNodeMass(body->getNodeIndexFromOriginal(0), 0);
+	world.addDefracBody(body);
+
+	for(int i=0; i<warmUpSteps; ++i)
+		world.stepSimulation(timeStep, 0);
+
+	result.m_stepTime = 0;
+	result.m_rotationTime = result.m_assemblyTime = result.m_solveTime = result.m_integrationTime = 0;
+	result.m_iterations = 0;
+	result.m_maxIterations = 0;
+	result.m_unconverged = 0;
+	result.m_residual = result.m_maxResidual = 0;
+
+	for(int i=0; i<steps; ++i)
+	{
+		clock.reset();
+		world.stepSimulation(timeStep, 0);
+		result.m_stepTime += clock.getTimeMicroseconds()*1e-6;
+
+		const btDefracStepStats& stats = world.getStepStats();
+
+		for(int j=0; j<stats.m_components.size(); ++j)
+		{
+			const btDefracComponentStats& c = stats.m_components[j];
+			result.m_rotationTime += c.m_rotationTime*1e-6;
+			result.m_assemblyTime += c.m_assemblyTime*1e-6;
+			result.m_solveTime += c.m_solveTime*1e-6;
+			result.m_integrationTime += c.m_integrationTime*1e-6;
+			result.m_iterations += c.m_solver.m_iterations;
+			result.m_maxIterations = btMax(result.m_maxIterations, c.m_solver.m_iterations);
+			result.m_unconverged += c.m_solver.m_converged ? 0 : 1;
+			result.m_residual += c.m_solver.m_residual;
+			result.m_maxResidual = btMax(result.m_maxResidual, (double)c.m_solver.m_residual);
+		}
+	}
+
+	//a run that blew up is still reported, but its residuals would not be valid JSON
+	result.m_finite = result.m_residual == result.m_residual && result.m_residual*0 == 0;
+
+	for(int i=0; i<body->getNodeCount() && result.m_finite; ++i)
+	{
+		const btVector3& p = body->getNode(i)->getPosition();
+		result.m_finite = p.dot(p)*0 == 0;
+	}
+
+	world.removeDefracBody(body);
+	delete body;
+
+	return true;
+}
+
+static void writeResult(FILE* out, const char* mesh, const char* solver, int cgMaxIter, btScalar timeStep, 
+						int steps, const btBenchmarkResult& r, bool last)
+{
+	fprintf(out, "    {\"mesh\": \"%s\", \"solver\": \"%s\", \"cgMaxIter\": %d, \"timeStep\": %g, \"steps\": %d,\n",
+		mesh, solver, cgMaxIter, timeStep, steps);
+	fprintf(out, "     \"nodes\": %d, \"tetrahedrons\": %d, \"loadSeconds\": %.6f, \"stepsPerSecond\": %.3f,\n",
+		r.m_nodes, r.m_tetrahedrons, r.m_loadTime, r.m_stepTime > 0 ? steps/r.m_stepTime : 0);
+	fprintf(out, "     \"secondsPerStep\": {\"total\": %.6f, \"rotation\": %.6f, \"assembly\": %.6f, \"solve\": %.6f, \"integration\": %.6f},\n",
+		r.m_stepTime/steps, r.m_rotationTime/steps, r.m_assemblyTime/steps, r.m_solveTime/steps, r.m_integrationTime/steps);
+
+	if(r.m_finite)
+	{
+		fprintf(out, "     \"iterations\": {\"mean\": %.3f, \"max\": %d}, \"unconvergedSteps\": %d, \"residual\": {\"mean\": %g, \"max\": %g}, \"finite\": true}%s\n",
+			(double)r.m_iterations/steps, r.m_maxIterations, r.m_unconverged, r.m_residual/steps, r.m_maxResidual, last ? "" : ",");
+	}
+	else
+	{
+		fprintf(out, "     \"iterations\": {\"mean\": %.3f, \"max\": %d}, \"unconvergedSteps\": %d, \"residual\": null, \"finite\": false}%s\n",
+			(double)r.m_iterations/steps, r.m_maxIterations, r.m_unconverged, last ? "" : ",");
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if(argc < 2 || argc > 4)
+	{
+		printf("usage: %s <resources directory> [steps] [output filename]\n", argv[0]);
+		return 1;
+	}
+
+	const std::string resources(argv[1]);
+	const int steps = argc > 2 ? atoi(argv[2]) : 100;
+	FILE* out = argc > 3 ? fopen(argv[3], "w") : stdout;
+
+	if(steps <= 0 || !out)
+	{
+		printf("invalid steps or output filename\n");
+		return 1;
+	}
+
+	const int numMeshes = sizeof(meshes)/sizeof(meshes[0]);
+	const int numCGMaxIters = sizeof(cgMaxIters)/sizeof(cgMaxIters[0]);
+	const btScalar implicitTimeStep = btScalar(1.)/btScalar(60.);
+	const btScalar explicitTimeStep = btScalar(1.)/btScalar(6000.);//explicit Euler is only stable for small steps
+
+	fprintf(out, "{\n  \"precision\": \"%s\",\n  \"openmp\": %s,\n  \"warmUpSteps\": %d,\n  \"runs\": [\n",
+		sizeof(btScalar) == sizeof(double) ? "double" : "single",
+#ifdef _OPENMP
+		"true",
+#else
+		"false",
+#endif
+		warmUpSteps);
+
+	for(int m=0; m<numMeshes; ++m)
+	{
+		const std::string baseFilename = resources + "/" + meshes[m] + "/" + meshes[m] + ".1";
+		btBenchmarkResult result;
+
+		for(int c=0; c<numCGMaxIters; ++c)
+		{
+			if(!runBenchmark(baseFilename, btDefracDynamicsWorld::ODE_IMPLICIT_EULER, cgMaxIters[c], implicitTimeStep, steps, result))
+			{
+				fprintf(stderr, "failed to load %s\n", baseFilename.c_str());
+				return 1;
+			}
+
+			writeResult(out, meshes[m], "implicitEuler", cgMaxIters[c], implicitTimeStep, steps, result, false);
+		}
+
+		if(!runBenchmark(baseFilename, btDefracDynamicsWorld::ODE_EXPLICIT_EULER, 0, explicitTimeStep, steps, result))
+		{
+			fprintf(stderr, "failed to load %s\n", baseFilename.c_str());
+			return 1;
+		}
+
+		writeResult(out, meshes[m], "explicitEuler", 0, explicitTimeStep, steps, result, m == numMeshes-1);
+	}
+
+	fprintf(out, "  ]\n}\n");
+
+	if(out != stdout)
+		fclose(out);
+
+	return 0;
+}
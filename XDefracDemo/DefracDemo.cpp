@@ -82,7 +82,6 @@ void DefracDemo::clientMoveAndDisplay()
 		int numSimSteps;
 		numSimSteps = m_dynamicsWorld->stepSimulation(dt, 0, 1.0/30);
 		//numSimSteps = m_dynamicsWorld->stepSimulation(dt,10,1./240.f);
-		std::cout << "numIter: " << getDefracDynamicsWorld()->getLastNumIter() << std::endl;
 
 #ifdef VERBOSE_TIMESTEPPING_CONSOLEOUTPUT
 		if (!numSimSteps)
@@ -242,14 +241,15 @@ void DefracDemo::initDemo()
 
 	if(m_meshFilename.size() > 0)
 	{
-		m_body = btDefracUtils::CreateFromTetgenFile(m_meshFilename, 10, m_material);
+		m_body = btDefracUtils::CreateFromTetgenFile(m_meshFilename, 10, m_material, 
+			btDefracBody::CF_REORDER_NODES | btDefracBody::CF_SORT_TETRAHEDRONS_BY_NODE);
 	}
 	else
 	{
 		m_body = new btDefracBody(tetraNodes, tetraIndices, 2000, m_material);
 	}
 
-	m_body->getComponent(0)->setNodeMass(0, 0);
+	m_body->getComponent(0)->setNodeMass(m_body->getNodeIndexFromOriginal(0), 0);
 	//m_body->getComponent(0)->setNodeMass(400, 0);
 
 	world->addDefracBody(m_body);
@@ -300,7 +300,7 @@ void DefracDemo::renderme()
 
     glEnable(GL_LIGHTING);
 	m_dynamicsWorld->debugDrawWorld();
-	const btVector3 position = m_body->getComponent(0)->getNode(0)->getPosition();
+	const btVector3 position = m_body->getNode(m_body->getNodeIndexFromOriginal(0))->getPosition();
 	const btVector3 unit(1,1,1);
 	glDisable(GL_LIGHTING);
 	idraw->drawBox(position-unit*0.05, position+unit*0.05, btVector3(1,0,0));
@@ -317,6 +317,7 @@ void DefracDemo::keyboardCallback(unsigned char key, int x, int y)
 	{
 	case	',':	m_raycast=!m_raycast;break;
 	case	';':	m_autocam=!m_autocam;break;
+	case	'v':	std::cout << getDefracDynamicsWorld()->getStepStats();break;//solver stats of the last step
 	case	'q':	
 		{
 			btDefracDynamicsWorld* ddw = getDefracDynamicsWorld();
@@ -0,0 +1,349 @@
+//Times the btSparseMatrix and btVector3n kernels used by the solver on synthetic grid meshes of several
+//sizes and on the given Tetgen meshes, and writes the results as JSON, e.g.
+//XDefracKernelBenchmark 15 XDefracDemo/Resources/skull/skull.1
+//Each kernel is run in batches that take at least a millisecond, after warm-up batches. The time per call
+//of every batch is a sample, and the min, median, mean and standard deviation of the samples are reported.
+
+#include "btSparseMatrix.h"
+#include "btSparsityPattern.h"
+#include "btVector3n.h"
+#include "btDefracUtils.h"
+#include "LinearMath/btQuickprof.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+
+static const int gridSizes[] = {8, 16, 24, 32};//cubes per side
+static const int warmUpBatches = 2;
+static const unsigned long minBatchTime = 1000;//microseconds
+
+//the data every kernel works on, built once per mesh
+struct btKernelContext
+{
+	int m_numNodes;
+	std::vector<int> m_indices;//4 per tetrahedron
+	btSparsityPattern m_pattern;
+	btSparseMatrix* m_matrix;
+	btVector3n* m_x;
+	btVector3n* m_y;
+	std::vector<btScalar> m_diagonal;
+	btMatrix3x3 m_block;
+	btScalar m_sink;//keeps the results alive
+
+	int getTetrahedronCount() const { return (int)m_indices.size()/4; }
+};
+
+typedef void (*btKernel)(btKernelContext& context);
+
+static void buildPattern(btKernelContext& c)
+{
+	btSparsityPattern pattern;
+	pattern.buildFromTetrahedrons(c.m_numNodes, &c.m_indices[0], c.getTetrahedronCount());
+	c.m_sink += pattern.getNonZeroCount();
+}
+
+//the ordered set construction the pattern replaced, for comparison
+static void buildFromIndexSet(btKernelContext& c)
+{
+	std::set<btMatrixIndex> indices;
+
+	for(int t=0; t<c.getTetrahedronCount(); ++t)
+		for(int a=0; a<4; ++a)
+			for(int b=0; b<4; ++b)
+			{
+				btMatrixIndex mi;
+				mi.i = c.m_indices[t*4 + a];
+				mi.j = c.m_indices[t*4 + b];
+				indices.insert(mi);
+			}
+
+	btSparseMatrix S(c.m_numNodes, indices);
+	c.m_sink += S.getElements()[0][0][0];
+}
+
+static void constructMatrix(btKernelContext& c)
+{
+	btSparseMatrix S(c.m_pattern, true);
+	c.m_sink += S.getElements()[0][0][0];
+}
+
+static void setZero(btKernelContext& c)
+{
+	c.m_matrix->setZero();
+	c.m_sink += c.m_matrix->getElements()[0][0][0];
+}
+
+//adds a block for every pair of nodes of every tetrahedron, like the stiffness assembly
+static void assemble(btKernelContext& c)
+{
+	btSparseMatrix& S = *c.m_matrix;
+
+	for(int t=0; t<c.getTetrahedronCount(); ++t)
+	{
+		const int* tet = &c.m_indices[t*4];
+
+		for(int a=0; a<4; ++a)
+			for(int b=0; b<4; ++b)
+				S(tet[a], tet[b]) += c.m_block;
+	}
+
+	c.m_sink += S.getElements()[0][0][0];
+}
+
+static void multiplyVector(btKernelContext& c)
+{
+	btVector3n y = (*c.m_matrix) * (*c.m_x);
+	c.m_sink += y[0][0];
+}
+
+static void multiplyDiagonalLeft(btKernelContext& c)
+{
+	btSparseMatrix S = btSparseMatrix::multiplyDiagonalLeft(*c.m_matrix, c.m_diagonal);
+	c.m_sink += S.getElements()[0][0][0];
+}
+
+static void addDiagonal(btKernelContext& c)
+{
+	btSparseMatrix S = btSparseMatrix::addDiagonal(*c.m_matrix, 1);
+	c.m_sink += S.getElements()[0][0][0];
+}
+
+static void dot(btKernelContext& c)
+{
+	c.m_sink += c.m_x->dot(*c.m_y);
+}
+
+//y += a*x, written the way the CG solver does it
+static void axpy(btKernelContext& c)
+{
+	*c.m_y += btScalar(1e-6)*(*c.m_x);
+	c.m_sink += (*c.m_y)[0][0];
+}
+
+struct btKernelInfo
+{
+	const char* m_name;
+	btKernel m_kernel;
+	bool m_perBlock;//whether the work is proportional to the non-zero blocks, or else to the nodes
+	bool m_large;//whether it takes too long to repeat on the biggest meshes
+};
+
+static const btKernelInfo kernels[] = {
+	{"buildPattern", buildPattern, true, false},
+	{"buildFromIndexSet", buildFromIndexSet, true, true},
+	{"constructMatrix", constructMatrix, true, false},
+	{"setZero", setZero, true, false},
+	{"assemble", assemble, true, false},
+	{"multiplyVector", multiplyVector, true, false},
+	{"multiplyDiagonalLeft", multiplyDiagonalLeft, true, false},
+	{"addDiagonal", addDiagonal, true, false},
+	{"dot", dot, false, false},
+	{"axpy", axpy, false, false}
+};
+
+//returns the seconds per call of each batch
+static std::vector<double> timeKernel(btKernel kernel, btKernelContext& context, int repetitions)
+{
+	btClock clock;
+	int calls = 1;
+
+	//double the batch until it takes long enough to time, which also warms up
+	for(;;)
+	{
+		clock.reset();
+
+		for(int i=0; i<calls; ++i)
+			kernel(context);
+
+		if(clock.getTimeMicroseconds() >= minBatchTime)
+			break;
+
+		calls *= 2;
+	}
+
+	for(int b=0; b<warmUpBatches; ++b)
+		for(int i=0; i<calls; ++i)
+			kernel(context);
+
+	std::vector<double> samples(repetitions);
+
+	for(int r=0; r<repetitions; ++r)
+	{
+		clock.reset();
+
+		for(int i=0; i<calls; ++i)
+			kernel(context);
+
+		samples[r] = clock.getTimeMicroseconds()*1e-6/calls;
+	}
+
+	return samples;
+}
+
+static void buildGrid(int n, btKernelContext& context)
+{
+	//each cube is split in 6 tetrahedrons around its main diagonal, which matches the neighbor cubes
+	static const int paths[6][3] = {{1,2,4}, {1,4,2}, {2,1,4}, {2,4,1}, {4,1,2}, {4,2,1}};//x=1, y=2, z=4
+	const int m = n+1;
+
+	context.m_numNodes = m*m*m;
+	context.m_indices.clear();
+
+	for(int z=0; z<n; ++z)
+		for(int y=0; y<n; ++y)
+			for(int x=0; x<n; ++x)
+				for(int p=0; p<6; ++p)
+				{
+					int corner = 0;
+					context.m_indices.push_back(x + m*(y + m*z));
+
+					for(int k=0; k<3; ++k)
+					{
+						corner |= paths[p][k];
+						context.m_indices.push_back((x + (corner & 1)) + m*((y + ((corner >> 1) & 1)) + m*(z + ((corner >> 2) & 1))));
+					}
+				}
+}
+
+static bool loadMesh(const std::string& baseFilename, btKernelContext& context)
+{
+	btAlignedObjectArray<btVector3> nodes;
+	btAlignedObjectArray<int> indices;
+
+	if(!btDefracUtils::LoadTetgenFile(baseFilename, nodes, indices))
+		return false;
+
+	context.m_numNodes = nodes.size();
+	context.m_indices.assign(&indices[0], &indices[0] + indices.size());
+	return true;
+}
+
+static void prepare(btKernelContext& context)
+{
+	context.m_pattern.buildFromTetrahedrons(context.m_numNodes, &context.m_indices[0], context.getTetrahedronCount());
+	context.m_matrix = new btSparseMatrix(context.m_pattern, true);
+	context.m_x = new btVector3n(context.m_numNodes);
+	context.m_y = new btVector3n(context.m_numNodes);
+	context.m_diagonal.resize(context.m_numNodes);
+	context.m_block.setValue(1, 2, 3, 2, 4, 5, 3, 5, 6);
+	context.m_sink = 0;
+
+	for(int i=0; i<context.m_numNodes; ++i)
+	{
+		(*context.m_x)[i] = btVector3(btScalar(i%7), btScalar(i%5), btScalar(i%3));
+		(*context.m_y)[i] = btVector3(1, 1, 1);
+		context.m_diagonal[i] = btScalar(1)/(1 + i%4);
+	}
+
+	assemble(context);
+}
+
+static void release(btKernelContext& context)
+{
+	delete context.m_matrix;
+	delete context.m_x;
+	delete context.m_y;
+}
+
+static void writeMesh(FILE* out, const std::string& name, btKernelContext& context, int repetitions, bool last)
+{
+	const int numKernels = sizeof(kernels)/sizeof(kernels[0]);
+	const int nonZeros = context.m_pattern.getNonZeroCount();
+
+	fprintf(out, "    {\"mesh\": \"%s\", \"nodes\": %d, \"tetrahedrons\": %d, \"nonZeroBlocks\": %d, \"kernels\": [\n", 
+		name.c_str(), context.m_numNodes, context.getTetrahedronCount(), nonZeros);
+
+	bool first = true;
+
+	for(int k=0; k<numKernels; ++k)
+	{
+		const btKernelInfo& info = kernels[k];
+
+		if(info.m_large && context.m_numNodes > 20000)
+			continue;
+
+		std::vector<double> samples = timeKernel(info.m_kernel, context, repetitions);
+		std::sort(samples.begin(), samples.end());
+
+		double mean = 0, variance = 0;
+
+		for(size_t i=0; i<samples.size(); ++i)
+			mean += samples[i];
+
+		mean /= samples.size();
+
+		for(size_t i=0; i<samples.size(); ++i)
+			variance += (samples[i] - mean)*(samples[i] - mean);
+
+		variance /= samples.size() > 1 ? samples.size() - 1 : 1;
+
+		const double median = samples.size() % 2 ? samples[samples.size()/2] : 
+			(samples[samples.size()/2 - 1] + samples[samples.size()/2])/2;
+		const int units = info.m_perBlock ? nonZeros : context.m_numNodes;
+
+		fprintf(out, "%s      {\"kernel\": \"%s\", \"seconds\": {\"min\": %.9f, \"median\": %.9f, \"mean\": %.9f, \"stddev\": %.9f}, \"nanosecondsPer%s\": %.3f}",
+			first ? "" : ",\n", info.m_name, samples[0], median, mean, std::sqrt(variance), info.m_perBlock ? "Block" : "Node",
+			median*1e9/units);
+		first = false;
+	}
+
+	fprintf(out, "\n    ]}%s\n", last ? "" : ",");
+}
+
+int main(int argc, char** argv)
+{
+	const int repetitions = argc > 1 ? atoi(argv[1]) : 15;
+
+	if(repetitions <= 0)
+	{
+		printf("usage: %s [repetitions] [Tetgen base filename...]\n", argv[0]);
+		return 1;
+	}
+
+	const int numGrids = sizeof(gridSizes)/sizeof(gridSizes[0]);
+	const int numMeshes = argc > 2 ? argc - 2 : 0;
+	double sink = 0;
+
+	printf("{\n  \"precision\": \"%s\",\n  \"repetitions\": %d,\n  \"meshes\": [\n", 
+		sizeof(btScalar) == sizeof(double) ? "double" : "single", repetitions);
+
+	for(int g=0; g<numGrids; ++g)
+	{
+		btKernelContext context;
+		buildGrid(gridSizes[g], context);
+		prepare(context);
+
+		char name[32];
+		sprintf(name, "grid%d", gridSizes[g]);
+		writeMesh(stdout, name, context, repetitions, g == numGrids-1 && numMeshes == 0);
+
+		sink += context.m_sink;
+		release(context);
+	}
+
+	for(int m=0; m<numMeshes; ++m)
+	{
+		btKernelContext context;
+
+		if(!loadMesh(argv[m+2], context))
+		{
+			fprintf(stderr, "failed to load %s\n", argv[m+2]);
+			return 1;
+		}
+
+		prepare(context);
+		writeMesh(stdout, argv[m+2], context, repetitions, m == numMeshes-1);
+
+		sink += context.m_sink;
+		release(context);
+	}
+
+	printf("  ]\n}\n");
+
+	return sink == 12345 ? 2 : 0;//never, but the compiler cannot tell
+}
@@ -0,0 +1,42 @@
+
+//Converts Tetgen meshes (.node/.ele/.face) to the binary mesh format read by
+//btDefracUtils::CreateFromBinaryFile, e.g.
+//XDefracMeshConverter Resources/skull/skull.1 [Resources/skull/skull.xmsh]
+//The output defaults to the base filename with the .xmsh extension.
+
+#include "btDefracUtils.h"
+#include "btDefracMeshFile.h"
+
+#include <cstdio>
+#include <string>
+
+int main(int argc, char** argv)
+{
+	if(argc != 2 && argc != 3)
+	{
+		printf("usage: %s <tetgen base filename> [output filename]\n", argv[0]);
+		return 1;
+	}
+
+	const std::string baseFilename(argv[1]);
+	const std::string filename(argc == 3 ? argv[2] : baseFilename + ".xmsh");
+
+	if(!btDefracUtils::ConvertTetgenToBinaryFile(baseFilename, filename))
+	{
+		printf("failed to convert %s to %s\n", baseFilename.c_str(), filename.c_str());
+		return 1;
+	}
+
+	btDefracMeshFile file;
+
+	if(!file.open(filename))
+	{
+		printf("failed to read back %s\n", filename.c_str());
+		return 1;
+	}
+
+	printf("%s: %d nodes, %d tetrahedrons, %d faces%s\n", filename.c_str(), file.getNodeCount(), 
+		file.getTetrahedronCount(), file.getFaceCount(), file.hasMaterials() ? ", material IDs" : "");
+
+	return 0;
+}
@@ -290,6 +290,17 @@ void	CProfileNode::CleanupMemory()
 	Sibling = NULL;
 }
 
+
+void	CProfileNode::Merge( CProfileNode * node )
+{
+	for ( CProfileNode * child = node->Child; child != NULL; child = child->Sibling ) {
+		CProfileNode * target = Get_Sub_Node( child->Name );
+		target->TotalCalls += child->TotalCalls;
+		target->TotalTime += child->TotalTime;
+		target->Merge( child );
+	}
+}
+
 CProfileNode::~CProfileNode( void )
 {
 	delete ( Child);
@@ -422,9 +433,76 @@ void	CProfileIterator::Enter_Parent( void )
 ***************************************************************************************************/
 
 CProfileNode	CProfileManager::Root( "Root", NULL );
-CProfileNode *	CProfileManager::CurrentNode = &CProfileManager::Root;
+CProfileNode	CProfileManager::MergedRoot( "Root", NULL );
 int				CProfileManager::FrameCounter = 0;
 unsigned long int			CProfileManager::ResetTime = 0;
+bool			CProfileManager::Enabled = true;
+
+
+/***************************************************************************************************
+**
+** Per thread trees
+**
+** Each thread has its own current node, so it only ever writes to its own tree. A thread gets an
+** index the first time it profiles, by an atomic increment, and publishes its root in the slot of
+** that index. Only the thread with index 0 uses CProfileManager::Root.
+**
+***************************************************************************************************/
+
+#if defined(_MSC_VER)
+#define BT_PROFILE_THREAD_LOCAL __declspec(thread)
+#else
+#define BT_PROFILE_THREAD_LOCAL __thread
+#endif
+
+#define BT_PROFILE_THREAD_UNREGISTERED -1
+#define BT_PROFILE_THREAD_UNPROFILED -2	// there were already BT_QUICKPROF_MAX_THREADS threads
+
+static BT_PROFILE_THREAD_LOCAL CProfileNode *	gCurrentNode = NULL;
+static BT_PROFILE_THREAD_LOCAL int				gThreadIndex = BT_PROFILE_THREAD_UNREGISTERED;
+static CProfileNode * volatile					gThreadRoots[BT_QUICKPROF_MAX_THREADS];
+static volatile long							gThreadCount = 0;
+
+// Returns the value of *value before the increment
+static long	Profile_Atomic_Increment( volatile long * value )
+{
+#if defined(BT_USE_WINDOWS_TIMERS)
+	return InterlockedIncrement( value ) - 1;
+#else
+	return __sync_fetch_and_add( value, 1 );
+#endif
+}
+
+static void	Profile_Publish( CProfileNode * volatile * slot, CProfileNode * node )
+{
+#if defined(BT_USE_WINDOWS_TIMERS)
+	InterlockedExchangePointer( (void * volatile *)slot, node );
+#else
+	__sync_synchronize();
+	*slot = node;
+#endif
+}
+
+// Sets up the tree of the calling thread, returns false if it cannot be profiled
+static bool	Profile_Register_Thread( CProfileNode * root0 )
+{
+	if ( gThreadIndex != BT_PROFILE_THREAD_UNREGISTERED ) {
+		return gThreadIndex >= 0;
+	}
+
+	long index = Profile_Atomic_Increment( &gThreadCount );
+
+	if ( index >= BT_QUICKPROF_MAX_THREADS ) {
+		gThreadIndex = BT_PROFILE_THREAD_UNPROFILED;
+		return false;
+	}
+
+	CProfileNode * root = index == 0 ? root0 : new CProfileNode( "Root", NULL );
+	gThreadIndex = (int)index;
+	gCurrentNode = root;
+	Profile_Publish( &gThreadRoots[index], root );
+	return true;
+}
 
 
 /***********************************************************************************************
@@ -442,11 +520,15 @@ unsigned long int			CProfileManager::ResetTime = 0;
  *=============================================================================================*/
 void	CProfileManager::Start_Profile( const char * name )
 {
-	if (name != CurrentNode->Get_Name()) {
-		CurrentNode = CurrentNode->Get_Sub_Node( name );
+	if ( gCurrentNode == NULL && !Profile_Register_Thread( &Root ) ) {
+		return;
+	}
+
+	if (name != gCurrentNode->Get_Name()) {
+		gCurrentNode = gCurrentNode->Get_Sub_Node( name );
 	} 
 	
-	CurrentNode->Call();
+	gCurrentNode->Call();
 }
 
 
@@ -455,10 +537,14 @@ void	CProfileManager::Start_Profile( const char * name )
  *=============================================================================================*/
 void	CProfileManager::Stop_Profile( void )
 {
+	if ( gCurrentNode == NULL ) {
+		return;
+	}
+
 	// Return will indicate whether we should back up to our parent (we may
 	// be profiling a recursive function)
-	if (CurrentNode->Return()) {
-		CurrentNode = CurrentNode->Get_Parent();
+	if (gCurrentNode->Return()) {
+		gCurrentNode = gCurrentNode->Get_Parent();
 	}
 }
 
@@ -470,14 +556,76 @@ void	CProfileManager::Stop_Profile( void )
  *=============================================================================================*/
 void	CProfileManager::Reset( void )
 { 
+	Profile_Register_Thread( &Root );
+
 	gProfileClock.reset();
 	Root.Reset();
     Root.Call();
+
+	for ( int i = 1; i < Get_Thread_Count(); i++ ) {
+		if ( gThreadRoots[i] != NULL ) {
+			gThreadRoots[i]->Reset();
+		}
+	}
+
 	FrameCounter = 0;
 	Profile_Get_Ticks(&ResetTime);
 }
 
 
+void	CProfileManager::CleanupMemory( void )
+{
+	Root.CleanupMemory();
+	MergedRoot.CleanupMemory();
+
+	// only the children are deleted, the current node of every thread outside a scope is its root
+	for ( int i = 1; i < Get_Thread_Count(); i++ ) {
+		if ( gThreadRoots[i] != NULL ) {
+			gThreadRoots[i]->CleanupMemory();
+		}
+	}
+}
+
+
+/***********************************************************************************************
+ * CProfileManager::Get_Thread_Count -- Number of threads that have a profile tree             *
+ *=============================================================================================*/
+int	CProfileManager::Get_Thread_Count( void )
+{
+	long count = gThreadCount;
+	return count < BT_QUICKPROF_MAX_THREADS ? (int)count : BT_QUICKPROF_MAX_THREADS;
+}
+
+
+/***********************************************************************************************
+ * CProfileManager::Get_Thread_Iterator -- Iterator over the tree of the given thread          *
+ *                                                                                             *
+ *    Returns NULL if the thread is still setting its tree up.                                 *
+ *=============================================================================================*/
+CProfileIterator *	CProfileManager::Get_Thread_Iterator( int thread )
+{
+	CProfileNode * root = thread == 0 ? &Root : gThreadRoots[thread];
+	return root != NULL ? new CProfileIterator( root ) : NULL;
+}
+
+
+/***********************************************************************************************
+ * CProfileManager::Merge_Threads -- Sum the trees of all threads into the merged tree         *
+ *=============================================================================================*/
+void	CProfileManager::Merge_Threads( void )
+{
+	MergedRoot.Reset();
+
+	for ( int i = 0; i < Get_Thread_Count(); i++ ) {
+		CProfileNode * root = i == 0 ? &Root : gThreadRoots[i];
+
+		if ( root != NULL ) {
+			MergedRoot.Merge( root );
+		}
+	}
+}
+
+
 /***********************************************************************************************
  * CProfileManager::Increment_Frame_Counter -- Increment the frame counter                    *
  *=============================================================================================*/
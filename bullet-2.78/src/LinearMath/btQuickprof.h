@@ -75,6 +75,7 @@ public:
 	CProfileNode * Get_Child( void )			{ return Child; }
 
 	void				CleanupMemory();
+	void				Merge( CProfileNode * node );	// Adds the totals of the children of node to the children of this
 	void				Reset( void );
 	void				Call( void );
 	bool				Return( void );
@@ -130,16 +131,21 @@ protected:
 };
 
 
+///Maximum number of threads with a profile tree, scopes on any further thread are not recorded
+#define BT_QUICKPROF_MAX_THREADS 64
+
 ///The Manager for the Profile system
+///Each thread records into a tree of its own, created the first time it enters a scope, so scopes can be
+///used on worker threads without locks. Thread 0 is the first thread that calls Reset or enters a scope,
+///usually the one stepping the world, and its tree is the one Get_Iterator returns. Reset, Merge_Threads
+///and CleanupMemory read or delete the trees of all threads, so they must only be called when no thread
+///is inside a scope, e.g. at the start and end of a frame.
 class	CProfileManager {
 public:
 	static	void						Start_Profile( const char * name );
 	static	void						Stop_Profile( void );
 
-	static	void						CleanupMemory(void)
-	{
-		Root.CleanupMemory();
-	}
+	static	void						CleanupMemory(void);
 
 	static	void						Reset( void );
 	static	void						Increment_Frame_Counter( void );
@@ -153,15 +159,27 @@ public:
 	}
 	static	void						Release_Iterator( CProfileIterator * iterator ) { delete ( iterator); }
 
+	static	int						Get_Thread_Count( void );
+	static	CProfileIterator *	Get_Thread_Iterator( int thread );
+
+	///Sums the trees of all threads into one, by the path of names from the root
+	static	void						Merge_Threads( void );
+	static	CProfileIterator *	Get_Merged_Iterator( void )	{ return new CProfileIterator( &MergedRoot ); }
+
+	///When disabled, BT_PROFILE scopes only cost a test of this flag. Only change it between frames
+	static	void						Set_Enabled( bool enabled )	{ Enabled = enabled; }
+	static	bool						Is_Enabled( void )				{ return Enabled; }
+
 	static void	dumpRecursive(CProfileIterator* profileIterator, int spacing);
 
 	static void	dumpAll();
 
 private:
 	static	CProfileNode			Root;
-	static	CProfileNode *			CurrentNode;
+	static	CProfileNode			MergedRoot;
 	static	int						FrameCounter;
 	static	unsigned long int					ResetTime;
+	static	bool					Enabled;
 };
 
 
@@ -169,15 +187,20 @@ private:
 ///Use the BT_PROFILE macro at the start of scope to time
 class	CProfileSample {
 public:
-	CProfileSample( const char * name )
+	CProfileSample( const char * name ) : Started( CProfileManager::Is_Enabled() )
 	{ 
-		CProfileManager::Start_Profile( name ); 
+		if ( Started )
+			CProfileManager::Start_Profile( name ); 
 	}
 
 	~CProfileSample( void )					
 	{ 
-		CProfileManager::Stop_Profile(); 
+		if ( Started )
+			CProfileManager::Stop_Profile(); 
 	}
+
+private:
+	bool	Started;
 };
 
 